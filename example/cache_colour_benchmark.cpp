@@ -0,0 +1,102 @@
+/* cache_colour_benchmark.cpp
+Shows page aligned buffers processed in lockstep evicting each other, and colouring fixing it
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/* Allocates many page aligned buffers and repeatedly reads the first few cache lines of each in
+turn, as a pipeline stage or pool walk examining buffer headers would. Uncoloured, every header
+lands in the same few level one cache sets and the buffers evict each other on every round.
+Coloured, the headers are spread across all the sets and stay resident.
+
+Usage: cache_colour_benchmark [buffers=64] [rounds=200000]
+*/
+
+#include "../include/boost/kernelalloc/cache_colour.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace boost::kernel_alloc;
+
+// The header lines read per buffer per round. Kept constant so the inner loop unrolls and only the cache shows in the timing.
+static const size_t lines=4;
+
+static double run(source &src, size_t buffers, size_t rounds, bool colour)
+{
+  const size_t bytes=64*1024;
+  cache_colourer colourer;
+  std::vector<source::pointer> allocations;
+  std::vector<allocation::map_t> maps;
+  std::vector<const unsigned long long *> headers;
+  for(size_t n=0; n<buffers; n++)
+  {
+    auto a(src.allocate(colour ? bytes+colourer.padding() : bytes));
+    if(!a)
+    {
+      fprintf(stderr, "allocate failed: %s\n", a.error().message().c_str());
+      exit(1);
+    }
+    allocation::map_t m((*a)->map_prefault());
+    if(!m.addr)
+    {
+      fprintf(stderr, "map failed: %s\n", m.ec.message().c_str());
+      exit(1);
+    }
+    allocation::map_t view(colour ? cache_colourer::apply(m, colourer.next(), bytes) : m);
+    memset(view.addr, 1, view.length);
+    headers.push_back((const unsigned long long *) view.addr);
+    allocations.push_back(std::move(*a));
+    maps.push_back(m);
+  }
+  unsigned long long sum=0;
+  auto begin=chrono::steady_clock::now();
+  for(size_t r=0; r<rounds; r++)
+    for(size_t n=0; n<buffers; n++)
+      for(size_t l=0; l<lines; l++)
+        sum+=headers[n][l*64/sizeof(unsigned long long)];
+  auto end=chrono::steady_clock::now();
+  if(sum==42)
+    printf(" ");
+  for(size_t n=0; n<buffers; n++)
+    allocations[n]->unmap(maps[n]);
+  return chrono::duration<double, std::nano>(end-begin).count()/(double)(rounds*buffers*lines);
+}
+
+int main(int argc, char *argv[])
+{
+  const size_t buffers=argc>1 ? (size_t) atol(argv[1]) : 64;
+  const size_t rounds=argc>2 ? (size_t) atol(argv[2]) : 200000;
+  auto src(std::make_shared<nonpersistent_source>());
+  printf("Cache line %u bytes, level one way span %u bytes, %u buffers reading %u lines each\n",
+    (unsigned) cache_line_size(), (unsigned) cache_way_span(), (unsigned) buffers, (unsigned) lines);
+  double aligned=run(*src, buffers, rounds, false);
+  double coloured=run(*src, buffers, rounds, true);
+  printf("Page aligned: %.2f ns per line\nColoured:     %.2f ns per line\nSpeedup:      %.2fx\n", aligned, coloured, aligned/coloured);
+  return 0;
+}
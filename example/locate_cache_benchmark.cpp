@@ -0,0 +1,110 @@
+/* locate_cache_benchmark.cpp
+Measures the per thread cache in front of locate_addr on std container workloads
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/* Builds std containers on allocator<T>, then looks up the address of every element in the order
+container code touches them, once with locate_addr() and once with locate_addr_cached(), and prints
+the hit rate and time per lookup of each. Vector elements share one map per vector so lookups in a
+row hit. Each list node is its own allocation, so a list walk mostly misses, which shows what the
+cache costs when it cannot help.
+
+It allocates from nonpersistent_source, which this tree declares but does not yet implement, so
+it only runs once that implementation is present.
+
+Usage: locate_cache_benchmark [containers=16] [elements=4096] [rounds=20]
+*/
+
+#include "../include/boost/kernelalloc/kernel_alloc.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+
+using namespace boost::kernel_alloc;
+
+template<class F> static double time_lookups(const std::vector<void *> &addrs, size_t rounds, F &&locate)
+{
+  size_t found=0;
+  auto begin=chrono::steady_clock::now();
+  for(size_t r=0; r<rounds; r++)
+    for(void *p : addrs)
+      if(std::get<1>(locate(p)))
+        ++found;
+  auto end=chrono::steady_clock::now();
+  if(found!=addrs.size()*rounds)
+    fprintf(stderr, "Only found %u of %u addresses\n", (unsigned) found, (unsigned)(addrs.size()*rounds));
+  return chrono::duration<double, std::nano>(end-begin).count()/(double)(rounds*addrs.size());
+}
+
+static void report(const char *workload, const std::vector<void *> &addrs, size_t rounds)
+{
+  double uncached=time_lookups(addrs, rounds, [](void *p) { return source::locate_addr(p); });
+  auto before=source::locate_cache_stats();
+  double cached=time_lookups(addrs, rounds, [](void *p) { return source::locate_addr_cached(p); });
+  auto after=source::locate_cache_stats();
+  unsigned long long hits=after.hits-before.hits, misses=after.misses-before.misses;
+  printf("%s: %u lookups, hit rate %.1f%%, locate_addr %.1f ns, cached %.1f ns, speedup %.2fx\n", workload,
+    (unsigned)(addrs.size()*rounds), 100.0*hits/(double)(hits+misses), uncached, cached, uncached/cached);
+}
+
+int main(int argc, char *argv[])
+{
+  const size_t containers=argc>1 ? (size_t) atol(argv[1]) : 16;
+  const size_t elements=argc>2 ? (size_t) atol(argv[2]) : 4096;
+  const size_t rounds=argc>3 ? (size_t) atol(argv[3]) : 20;
+  source_ptr src(std::make_shared<nonpersistent_source>());
+  
+  typedef std::vector<int, allocator<int>> vector_t;
+  std::vector<vector_t> vectors;
+  std::vector<void *> addrs;
+  for(size_t c=0; c<containers; c++)
+    vectors.push_back(vector_t(elements, 0, allocator<int>(src)));
+  for(auto &v : vectors)
+    for(auto &i : v)
+      addrs.push_back(&i);
+  report("vector walk", addrs, rounds);
+  
+  // Interleave the vectors, as a merge would
+  addrs.clear();
+  for(size_t i=0; i<elements; i++)
+    for(auto &v : vectors)
+      addrs.push_back(&v[i]);
+  report("vector merge", addrs, rounds);
+  
+  typedef std::list<int, allocator<int>> list_t;
+  list_t list((allocator<int>(src)));
+  for(size_t i=0; i<elements; i++)
+    list.push_back((int) i);
+  addrs.clear();
+  for(auto &i : list)
+    addrs.push_back(&i);
+  report("list walk", addrs, rounds);
+  return 0;
+}
@@ -0,0 +1,301 @@
+/* arena.hpp
+Monotonic arenas carved from allocations
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_ARENA_HPP
+#define BOOST_KERNELALLOC_ARENA_HPP
+
+#include "page_size.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+/*! \file arena.hpp
+ * \brief Provides a monotonic bump allocator over allocations which resets by discarding
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+/*! \class arena
+ * \brief Bump allocates objects from large allocations, releasing them all at once by discarding the pages used.
+ *
+ * Allocating from an arena is a pointer increment. Nothing is ever freed individually: instead
+ * reset() makes all of the arena available again in one go, issuing a discard() over just the pages
+ * which were used so their RAM goes back to the kernel, but keeping the allocations and their maps
+ * so the next round of use costs no syscalls beyond page faults. Per request scratch memory thus
+ * costs a pointer bump per object and a single madvise per request.
+ *
+ * Storage comes in blocks, each an allocation from the source mapped in whole. The first block is
+ * allocated on first use, and if it fills a further block of twice the size is chained on, up to
+ * a maximum block size. Because kernel memory is committed lazily, large blocks cost nothing until
+ * touched, so the default first block is sized to make a second block rare. Blocks are chained
+ * rather than one allocation being grown with allocation::resize(), because a relocating resize
+ * requires every map to be gone and would move objects already handed out, and try_resize() can
+ * only grow into the slack of actual_size().
+ *
+ * Nested scopes are supported by mark() and rollback(), or the RAII scope class, which return the
+ * arena to an earlier position without discarding anything. Destructors of objects created in the
+ * arena are never run.
+ *
+ * An arena is not thread safe. Use this_thread_arena() for an arena per thread.
+ */
+class arena
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+
+  //! \brief Configures an arena
+  struct config_t
+  {
+    size_type block_size;       //!< The size of the first block
+    size_type max_block_size;   //!< Subsequent blocks double in size up to this
+    config_t() : block_size(64*1024*1024), max_block_size(1024*1024*1024) { }
+  };
+
+  //! \brief A position in the arena returned by mark()
+  struct mark_t
+  {
+    size_type block;    //!< The block index
+    size_type offset;   //!< The offset into the block
+  };
+
+  /*! \class scope
+   * \brief Rolls the arena back on destruction to where it was on construction.
+   */
+  class scope
+  {
+    arena &_arena;
+    mark_t _mark;
+  public:
+    //! \brief Marks \em a
+    explicit scope(arena &a) BOOST_NOEXCEPT : _arena(a), _mark(a.mark()) { }
+    scope(const scope &)=delete;
+    scope &operator=(const scope &)=delete;
+    ~scope() { _arena.rollback(_mark); }
+  };
+private:
+  struct block_t
+  {
+    source::pointer a;
+    allocation::map_t m;
+    size_type high;     // The highest offset used since the last reset
+  };
+  source &_source;
+  config_t _config;
+  std::vector<block_t> _blocks;
+  size_type _current;
+  char *_ptr, *_end;
+  error_code _ec;
+
+  void _note_high() BOOST_NOEXCEPT
+  {
+    if(_blocks.empty())
+      return;
+    block_t &b=_blocks[_current];
+    size_type offset=(size_type)(_ptr-(char *) b.m.addr);
+    if(offset>b.high)
+      b.high=offset;
+  }
+  void _enter(size_type block, size_type offset) BOOST_NOEXCEPT
+  {
+    _current=block;
+    _ptr=(char *) _blocks[block].m.addr+offset;
+    _end=(char *) _blocks[block].m.addr+_blocks[block].m.length;
+  }
+  static void *_carve(char *&ptr, char *end, size_type bytes, size_type align) BOOST_NOEXCEPT
+  {
+    uintptr_t p=((uintptr_t) ptr+align-1) & ~(uintptr_t)(align-1);
+    if(!ptr || p>(uintptr_t) end || bytes>(uintptr_t) end-p)
+      return nullptr;
+    ptr=(char *)(p+bytes);
+    return (void *) p;
+  }
+  void *_allocate_slow(size_type bytes, size_type align) BOOST_NOEXCEPT
+  {
+    _note_high();
+    // Blocks beyond the current one are left over from before a reset or rollback, so reuse those first
+    for(size_type n=_blocks.empty() ? 0 : _current+1; n<_blocks.size(); n++)
+    {
+      _enter(n, 0);
+      if(void *ret=_carve(_ptr, _end, bytes, align))
+        return ret;
+    }
+    if(bytes>(size_type)-1/2-align)
+    {
+      _ec=error_code(ENOMEM, std::system_category());
+      return nullptr;
+    }
+    size_type size=_blocks.empty() ? _config.block_size : _blocks.back().m.length*2;
+    if(size>_config.max_block_size)
+      size=_config.max_block_size;
+    if(size<bytes+align)
+      size=bytes+align;
+    size=page_round_up(size);
+    try
+    {
+      auto a(_source.allocate(size));
+      if(!a)
+      {
+        _ec=a.error();
+        return nullptr;
+      }
+      block_t b;
+      b.a=std::move(*a);
+      b.m=b.a->map();
+      b.high=0;
+      if(!b.m.addr)
+      {
+        _ec=b.m.ec;
+        return nullptr;
+      }
+      _blocks.push_back(std::move(b));
+    }
+    catch(...)
+    {
+      _ec=error_code(ENOMEM, std::system_category());
+      return nullptr;
+    }
+    _enter(_blocks.size()-1, 0);
+    return _carve(_ptr, _end, bytes, align);
+  }
+public:
+  //! \brief Constructs an arena drawing blocks from \em src, which must outlive it. No memory is allocated until first use.
+  explicit arena(source &src, config_t config=config_t()) BOOST_NOEXCEPT : _source(src), _config(config), _current(0), _ptr(nullptr), _end(nullptr) { }
+  arena(const arena &)=delete;
+  arena &operator=(const arena &)=delete;
+  ~arena()
+  {
+    for(auto &b : _blocks)
+      b.a->unmap(b.m);
+  }
+
+  //! \brief The configuration of this arena
+  const config_t &config() const BOOST_NOEXCEPT { return _config; }
+
+  //! \brief The error which caused the last failed allocation
+  error_code last_error() const BOOST_NOEXCEPT { return _ec; }
+
+  /*! \brief Returns \em bytes aligned to \em align, which must be a power of two, or null if a
+  further block could not be allocated, in which case last_error() says why.
+  */
+  void *allocate(size_type bytes, size_type align=alignof(std::max_align_t)) BOOST_NOEXCEPT
+  {
+    if(void *ret=_carve(_ptr, _end, bytes, align))
+      return ret;
+    return _allocate_slow(bytes, align);
+  }
+  //! \brief Returns uninitialised storage for \em no objects of type T, or null
+  template<class T> T *allocate_array(size_type no) BOOST_NOEXCEPT
+  {
+    if(no>(size_type)-1/sizeof(T))
+      return nullptr;
+    return static_cast<T *>(allocate(no*sizeof(T), alignof(T)));
+  }
+  //! \brief Constructs a T in the arena, returning null if out of memory. Its destructor will never be called.
+  template<class T, class... Args> T *make(Args &&... args)
+  {
+    void *p=allocate(sizeof(T), alignof(T));
+    return p ? new(p) T(std::forward<Args>(args)...) : nullptr;
+  }
+
+  //! \brief Returns the current position, for a later rollback()
+  mark_t mark() BOOST_NOEXCEPT
+  {
+    mark_t ret={ _current, _blocks.empty() ? 0 : (size_type)(_ptr-(char *) _blocks[_current].m.addr) };
+    return ret;
+  }
+  //! \brief Returns the arena to the position \em m, making everything allocated since available again. Nothing is discarded.
+  void rollback(const mark_t &m) BOOST_NOEXCEPT
+  {
+    if(_blocks.empty())
+      return;
+    _note_high();
+    _enter(m.block, m.offset);
+  }
+
+  /*! \brief Makes all of the arena available again, discarding every page used since the last
+  reset so its RAM is released. Blocks and their maps are kept for reuse.
+  */
+  void reset() BOOST_NOEXCEPT
+  {
+    if(_blocks.empty())
+      return;
+    _note_high();
+    for(auto &b : _blocks)
+    {
+      if(!b.high)
+        continue;
+      allocation::map_t d(b.m.offset, page_round_up(b.high));
+      if(d.length>b.m.length)
+        d.length=b.m.length;
+      d.addr=b.m.addr;
+      b.a->discard(d);
+      b.high=0;
+    }
+    _enter(0, 0);
+  }
+
+  //! \brief The bytes handed out since the last reset, including alignment padding
+  size_type used() const BOOST_NOEXCEPT
+  {
+    size_type ret=0;
+    for(size_type n=0; n<_current && n<_blocks.size(); n++)
+      ret+=_blocks[n].m.length;
+    if(!_blocks.empty())
+      ret+=(size_type)(_ptr-(char *) _blocks[_current].m.addr);
+    return ret;
+  }
+  //! \brief The total size of the blocks held
+  size_type capacity() const BOOST_NOEXCEPT
+  {
+    size_type ret=0;
+    for(auto &b : _blocks)
+      ret+=b.m.length;
+    return ret;
+  }
+};
+
+/*! \brief Returns an arena private to the calling thread, drawing from a process wide source of
+type \em Source and destroyed when the thread exits. Callers should reset() it at the end of
+each unit of work, and use arena::scope for anything nested.
+*/
+template<class Source=nonpersistent_source> inline arena &this_thread_arena()
+{
+  static std::shared_ptr<Source> src(std::make_shared<Source>());
+  static thread_local arena a(*src);
+  return a;
+}
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
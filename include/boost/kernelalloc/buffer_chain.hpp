@@ -0,0 +1,345 @@
+/* buffer_chain.hpp
+Zero copy reference counted chains of slices of allocations
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_BUFFER_CHAIN_HPP
+#define BOOST_KERNELALLOC_BUFFER_CHAIN_HPP
+
+#include <algorithm>
+#ifndef WIN32
+#include <sys/uio.h>
+#endif
+
+/*! \file buffer_chain.hpp
+ * \brief Provides zero copy reference counted chains of slices of mapped allocations
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+/*! \class buffer_segment
+ * \brief An allocation kept mapped for as long as any buffer chain refers to it.
+ *
+ * The segment owns both the allocation and its map, unmapping it when the last reference goes.
+ */
+class buffer_segment
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+private:
+  source::pointer _allocation;
+  allocation::map_t _map;
+  buffer_segment(source::pointer a, allocation::map_t m) : _allocation(std::move(a)), _map(m) { }
+  buffer_segment(const buffer_segment &)=delete;
+  buffer_segment &operator=(const buffer_segment &)=delete;
+public:
+  ~buffer_segment()
+  {
+    if(_allocation && _map.addr)
+      _allocation->unmap(_map);
+  }
+  //! \brief Maps the whole of \em a, which the segment takes ownership of
+  static expected<std::shared_ptr<buffer_segment>, error_code> make(source::pointer a) BOOST_NOEXCEPT
+  {
+    allocation::map_t m(0, a->size());
+    if(!a->map(m))
+      return make_unexpected(m.ec);
+    return make(std::move(a), m);
+  }
+  //! \brief Takes ownership of \em a and its existing map \em m, which is unmapped when the segment dies
+  static expected<std::shared_ptr<buffer_segment>, error_code> make(source::pointer a, allocation::map_t m) BOOST_NOEXCEPT
+  {
+    try
+    {
+      return std::shared_ptr<buffer_segment>(new buffer_segment(std::move(a), m));
+    }
+    catch(...)
+    {
+      if(a && m.addr)
+        a->unmap(m);
+      return make_unexpected(error_code(ENOMEM, std::system_category()));
+    }
+  }
+  //! \brief The allocation
+  const source::pointer &get_allocation() const BOOST_NOEXCEPT { return _allocation; }
+  //! \brief The map of the allocation
+  const allocation::map_t &map() const BOOST_NOEXCEPT { return _map; }
+  //! \brief The mapped address
+  char *data() const BOOST_NOEXCEPT { return (char *) _map.addr; }
+  //! \brief The mapped length
+  size_type size() const BOOST_NOEXCEPT { return _map.length; }
+};
+
+/*! \class buffer_chain
+ * \brief A sequence of bytes made of reference counted slices of mapped allocations, never copied.
+ *
+ * A chain is a window onto an immutable array of slices, each slice a range of a buffer_segment.
+ * Cloning copies the reference to the array and the window, so is O(1) however long the chain.
+ * Trimming and splitting only move the windows of the chains concerned, in O(log slices) through
+ * the running offsets kept in the array. Appending pushes onto the array in place when no other
+ * chain shares it and the window reaches its end, which is the common case of building a message
+ * up, and otherwise first copies the slice references in the window into a new array. The bytes
+ * themselves are never copied, so a payload received into an allocation can be framed, split and
+ * written out with iovecs() without ever moving.
+ *
+ * The bytes of a chain are shared with its clones, so writing through data() of one is seen by
+ * all. Chains are not thread safe, but distinct chains sharing slices may be used from different
+ * threads.
+ */
+class buffer_chain
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+  //! \brief A pointer to a segment
+  typedef std::shared_ptr<buffer_segment> segment_ptr;
+  //! \brief A slice of a segment
+  struct slice_t
+  {
+    segment_ptr segment;    //!< The segment sliced
+    size_type offset;       //!< The offset of the slice into the segment
+    size_type length;       //!< The length of the slice
+    size_type chain_offset; //!< The offset of the slice within the array of slices
+    //! \brief The address of the start of the slice
+    char *data() const BOOST_NOEXCEPT { return segment->data()+offset; }
+  };
+private:
+  typedef std::vector<slice_t> _slices_t;
+  std::shared_ptr<_slices_t> _slices;
+  size_type _begin, _end;  // the window in bytes from the start of the array
+
+  // The index of the slice containing array byte pos, or the slice ending at pos if at_end
+  size_type _find(size_type pos, bool at_end) const BOOST_NOEXCEPT
+  {
+    const _slices_t &s=*_slices;
+    auto it=std::upper_bound(s.begin(), s.end(), pos, [](size_type p, const slice_t &x) { return p<x.chain_offset; });
+    size_type idx=(size_type)(it-s.begin())-1;
+    if(at_end && idx && s[idx].chain_offset==pos)
+      --idx;
+    return idx;
+  }
+  size_type _array_end() const BOOST_NOEXCEPT { return _slices->empty() ? 0 : _slices->back().chain_offset+_slices->back().length; }
+  // Makes the array unique to this chain and spanning only its window, so it can be pushed onto without pinning trimmed slices
+  void _own()
+  {
+    if(_slices && _slices.use_count()==1 && _end==_array_end() && (_begin==_end ? _slices->empty() : !_find(_begin, false)))
+      return;
+    std::shared_ptr<_slices_t> n(std::make_shared<_slices_t>());
+    if(_begin!=_end)
+    {
+      size_type first=_find(_begin, false), last=_find(_end, true);
+      n->reserve(last-first+1);
+      for(size_type i=first; i<=last; i++)
+      {
+        const slice_t &x=(*_slices)[i];
+        size_type b=std::max(_begin, x.chain_offset), e=std::min(_end, x.chain_offset+x.length);
+        slice_t y={ x.segment, x.offset+(b-x.chain_offset), e-b, b-_begin };
+        n->push_back(std::move(y));
+      }
+    }
+    _slices=std::move(n);
+    _end-=_begin;
+    _begin=0;
+  }
+  buffer_chain(std::shared_ptr<_slices_t> slices, size_type begin, size_type end) : _slices(std::move(slices)), _begin(begin), _end(end) { }
+public:
+  //! \brief Constructs an empty chain
+  buffer_chain() BOOST_NOEXCEPT : _begin(0), _end(0) { }
+  //! \brief Constructs a chain of the \em length bytes at \em offset into \em segment
+  buffer_chain(segment_ptr segment, size_type offset, size_type length) : _begin(0), _end(0)
+  {
+    append(std::move(segment), offset, length);
+  }
+  //! \brief Constructs a chain of the whole of \em segment
+  explicit buffer_chain(segment_ptr segment) : _begin(0), _end(0)
+  {
+    size_type length=segment->size();
+    append(std::move(segment), 0, length);
+  }
+
+  //! \brief Maps the whole of allocation \em a into a new chain
+  static expected<buffer_chain, error_code> make(source::pointer a) BOOST_NOEXCEPT
+  {
+    auto s(buffer_segment::make(std::move(a)));
+    if(!s)
+      return make_unexpected(s.error());
+    try
+    {
+      return buffer_chain(std::move(*s));
+    }
+    catch(...)
+    {
+      return make_unexpected(error_code(ENOMEM, std::system_category()));
+    }
+  }
+  //! \brief Allocates \em bytes from \em src and maps them into a new chain
+  static expected<buffer_chain, error_code> allocate(source &src, size_type bytes) BOOST_NOEXCEPT
+  {
+    auto a(src.allocate(bytes));
+    if(!a)
+      return make_unexpected(a.error());
+    auto ret(make(std::move(*a)));
+    if(ret && ret->length()>bytes)
+      ret->trim_back(ret->length()-bytes);
+    return ret;
+  }
+
+  //! \brief The number of bytes in the chain
+  size_type length() const BOOST_NOEXCEPT { return _end-_begin; }
+  //! \brief True if the chain holds no bytes
+  bool empty() const BOOST_NOEXCEPT { return _end==_begin; }
+  //! \brief The number of slices the chain spans
+  size_type slices() const BOOST_NOEXCEPT { return empty() ? 0 : _find(_end, true)-_find(_begin, false)+1; }
+  //! \brief True if other chains share this chain's array of slices
+  bool is_shared() const BOOST_NOEXCEPT { return _slices && _slices.use_count()>1; }
+
+  //! \brief Returns a chain sharing the bytes of this one, in O(1)
+  buffer_chain clone() const BOOST_NOEXCEPT { return *this; }
+
+  //! \brief Drops the first \em n bytes of the chain
+  void trim_front(size_type n) BOOST_NOEXCEPT { _begin+=std::min(n, length()); }
+  //! \brief Drops the last \em n bytes of the chain
+  void trim_back(size_type n) BOOST_NOEXCEPT { _end-=std::min(n, length()); }
+  //! \brief Removes and returns the first \em n bytes of the chain, leaving the rest in this one
+  buffer_chain split(size_type n) BOOST_NOEXCEPT
+  {
+    n=std::min(n, length());
+    buffer_chain ret(_slices, _begin, _begin+n);
+    _begin+=n;
+    return ret;
+  }
+  //! \brief Returns the \em length bytes at \em offset as a new chain sharing this one's bytes
+  buffer_chain subchain(size_type offset, size_type length) const BOOST_NOEXCEPT
+  {
+    offset=std::min(offset, this->length());
+    length=std::min(length, this->length()-offset);
+    return buffer_chain(_slices, _begin+offset, _begin+offset+length);
+  }
+
+  //! \brief Appends the \em length bytes at \em offset into \em segment
+  void append(segment_ptr segment, size_type offset, size_type length)
+  {
+    if(!length)
+      return;
+    _own();
+    slice_t s={ std::move(segment), offset, length, _end };
+    _slices->push_back(std::move(s));
+    _end+=length;
+  }
+  //! \brief Appends the bytes of \em o, sharing rather than copying them
+  void append(const buffer_chain &o)
+  {
+    if(o.empty())
+      return;
+    if(&o==this)
+    {
+      buffer_chain c(o);
+      append(c);
+      return;
+    }
+    _own();
+    size_type first=o._find(o._begin, false), last=o._find(o._end, true);
+    _slices->reserve(_slices->size()+last-first+1);
+    for(size_type i=first; i<=last; i++)
+    {
+      const slice_t &x=(*o._slices)[i];
+      size_type b=std::max(o._begin, x.chain_offset), e=std::min(o._end, x.chain_offset+x.length);
+      append(x.segment, x.offset+(b-x.chain_offset), e-b);
+    }
+  }
+
+  /*! \brief Calls f(char *data, size_type length) for each contiguous run of bytes in order,
+  stopping early if f returns false.
+  */
+  template<class F> void for_each(F &&f) const
+  {
+    if(empty())
+      return;
+    for(size_type i=_find(_begin, false), last=_find(_end, true); i<=last; i++)
+    {
+      const slice_t &x=(*_slices)[i];
+      size_type b=std::max(_begin, x.chain_offset), e=std::min(_end, x.chain_offset+x.length);
+      if(!f(x.data()+(b-x.chain_offset), e-b))
+        return;
+    }
+  }
+  //! \brief Copies up to \em bytes from \em offset into the chain out to \em dest, returning the number copied
+  size_type copy_to(void *dest, size_type bytes, size_type offset=0) const BOOST_NOEXCEPT
+  {
+    char *d=(char *) dest;
+    size_type done=0;
+    for_each([&](const char *p, size_type n)
+    {
+      if(offset>=n)
+      {
+        offset-=n;
+        return true;
+      }
+      p+=offset;
+      n-=offset;
+      offset=0;
+      n=std::min(n, bytes-done);
+      memcpy(d+done, p, n);
+      done+=n;
+      return done<bytes;
+    });
+    return done;
+  }
+#ifndef WIN32
+  //! \brief Fills up to \em max iovecs describing the chain, returning how many were filled
+  size_type iovecs(struct iovec *out, size_type max) const BOOST_NOEXCEPT
+  {
+    size_type ret=0;
+    for_each([&](char *p, size_type n)
+    {
+      if(ret==max)
+        return false;
+      out[ret].iov_base=p;
+      out[ret].iov_len=n;
+      return ++ret<max;
+    });
+    return ret;
+  }
+  //! \brief Returns iovecs describing the chain, for writev() and friends
+  std::vector<struct iovec> iovecs() const
+  {
+    std::vector<struct iovec> ret(slices());
+    ret.resize(iovecs(ret.data(), ret.size()));
+    return ret;
+  }
+#endif
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
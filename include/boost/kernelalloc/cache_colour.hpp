@@ -0,0 +1,144 @@
+/* cache_colour.hpp
+Cache colouring of page aligned buffers
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_CACHE_COLOUR_HPP
+#define BOOST_KERNELALLOC_CACHE_COLOUR_HPP
+
+#include "page_size.hpp"
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+/*! \file cache_colour.hpp
+ * \brief Provides staggering of buffer start addresses across cache sets
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+//! \brief Returns the size of a level one data cache line, 64 if it cannot be discovered
+inline size_t cache_line_size() BOOST_NOEXCEPT
+{
+#if defined(_SC_LEVEL1_DCACHE_LINESIZE)
+  static const long v=sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+  return v>0 ? (size_t) v : 64;
+#else
+  return 64;
+#endif
+}
+
+/*! \brief Returns the span of addresses covered by one way of the level one data cache, which is
+the distance apart at which addresses fall into the same cache set, the page size if it cannot be discovered.
+*/
+inline size_t cache_way_span() BOOST_NOEXCEPT
+{
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL1_DCACHE_ASSOC)
+  static const long size=sysconf(_SC_LEVEL1_DCACHE_SIZE), assoc=sysconf(_SC_LEVEL1_DCACHE_ASSOC);
+  if(size>0 && assoc>0 && (size_t) size/(size_t) assoc>=cache_line_size())
+    return (size_t) size/(size_t) assoc;
+#endif
+  return page_size();
+}
+
+/*! \class cache_colourer
+ * \brief Staggers the start of successive page aligned buffers so they do not share cache sets.
+ *
+ * Every page aligned buffer starts in the same level one cache set, and as most processing touches
+ * the start of a buffer first, buffers processed in lockstep (such as the buffers of a pipeline,
+ * or the header of every buffer in a pool) compete for the few ways of that one set and evict
+ * each other long before the cache is full. Colouring offsets the usable start of the nth buffer by
+ * a rotating multiple of the cache line, spreading the buffers across every set.
+ *
+ * Optionally whole pages can be rotated as well, which spreads buffers across the sets of physically
+ * indexed caches such as L2, but only where the backing is physically contiguous, as with large pages.
+ *
+ * To colour buffers, allocate padding() extra bytes for each and view each map through apply().
+ */
+class cache_colourer
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+
+  //! \brief Configures colouring
+  struct config_t
+  {
+    size_type line_size;      //!< The cache line size
+    size_type line_colours;   //!< The number of cache line offsets to rotate through
+    size_type page_colours;   //!< The number of page offsets to rotate through, one to leave pages alone
+    config_t() : line_size(cache_line_size()), line_colours(cache_way_span()/cache_line_size()), page_colours(1) { }
+  };
+private:
+  config_t _config;
+  atomic<size_type> _next;
+public:
+  //! \brief Constructs a colourer
+  cache_colourer(config_t config=config_t()) BOOST_NOEXCEPT : _config(config), _next(0)
+  {
+    if(!_config.line_colours)
+      _config.line_colours=1;
+    if(!_config.page_colours)
+      _config.page_colours=1;
+  }
+
+  //! \brief The configuration of this colourer
+  const config_t &config() const BOOST_NOEXCEPT { return _config; }
+
+  //! \brief The extra bytes to allocate for each buffer to leave room for its colour offset
+  size_type padding() const BOOST_NOEXCEPT
+  {
+    return (_config.line_colours-1)*_config.line_size+(_config.page_colours-1)*page_size();
+  }
+
+  //! \brief The colour offset of the nth buffer
+  size_type offset(size_type n) const BOOST_NOEXCEPT
+  {
+    return (n % _config.line_colours)*_config.line_size+((n/_config.line_colours) % _config.page_colours)*page_size();
+  }
+  //! \brief The colour offset for the next buffer, rotating through the colours
+  size_type next() BOOST_NOEXCEPT { return offset(_next.fetch_add(1, memory_order_relaxed)); }
+
+  /*! \brief Returns a view of \em bytes of \em m starting \em offset bytes in. \em m must be at
+  least offset+bytes long, which padding() extra bytes guarantees.
+  */
+  static allocation::map_t apply(const allocation::map_t &m, size_type offset, size_type bytes) BOOST_NOEXCEPT
+  {
+    allocation::map_t ret(m.offset+offset, bytes);
+    ret.addr=m.addr ? (char *) m.addr+offset : nullptr;
+    ret.ec=m.ec;
+    return ret;
+  }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
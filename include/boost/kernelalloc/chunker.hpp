@@ -0,0 +1,237 @@
+/* chunker.hpp
+Content defined chunking of sequences of allocations
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_CHUNKER_HPP
+#define BOOST_KERNELALLOC_CHUNKER_HPP
+
+#include <algorithm>
+#include <cstdint>
+
+/*! \file chunker.hpp
+ * \brief Provides zero copy content defined chunking of sequences of maps
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+namespace detail
+{
+  // The gear table, 256 fixed pseudo random words from splitmix64. Never change this, it would move every chunk boundary.
+  inline const uint64_t *gear_table() BOOST_NOEXCEPT
+  {
+    struct table_t
+    {
+      uint64_t v[256];
+      table_t()
+      {
+        uint64_t x=0;
+        for(int n=0; n<256; n++)
+        {
+          uint64_t z=(x+=0x9E3779B97F4A7C15ULL);
+          z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+          z=(z^(z>>27))*0x94D049BB133111EBULL;
+          v[n]=z^(z>>31);
+        }
+      }
+    };
+    static const table_t table;
+    return table.v;
+  }
+}
+
+/*! \class chunker
+ * \brief Divides a sequence of maps into content defined chunks without copying any data.
+ *
+ * Implements FastCDC: a gear rolling hash is run over the bytes, skipping the first minimum
+ * size bytes of each chunk where no cut may occur, and a cut is made where the top bits of the hash
+ * are zero, using a stricter mask below the average chunk size and a looser one above it so
+ * chunk sizes cluster around the average. Because the cut points depend only on the content,
+ * inserting or removing data only disturbs the chunks around the edit, which is what makes
+ * deduplication of the chunks effective.
+ *
+ * The input is any sequence of maps, from any number of allocations, which is walked in order
+ * as if it were contiguous but without ever being concatenated. Each chunk is reported as the
+ * list of slices of the original maps which make it up, each slice being a map_t whose
+ * address, offset and length point into the original. A chunk may therefore span many maps, and
+ * its slices remain valid for only as long as the maps they came from remain mapped.
+ *
+ * Input may be fed in any number of calls, with a chunk straddling calls being reported when it
+ * completes. Call finish() at the end to report the final chunk.
+ */
+class chunker
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+
+  //! \brief Configures the chunk sizes
+  struct config_t
+  {
+    size_type min_size;   //!< No chunk except the last is smaller than this
+    size_type avg_size;   //!< The size chunks normally cluster around
+    size_type max_size;   //!< No chunk is larger than this
+    config_t() : min_size(2048), avg_size(8192), max_size(65536) { }
+    config_t(size_type min, size_type avg, size_type max) : min_size(min), avg_size(avg), max_size(max) { }
+  };
+
+  //! \brief A chunk returned by chunks()
+  struct chunk_t
+  {
+    std::vector<allocation::map_t> slices;  //!< The slices of the input making up this chunk, in order
+    size_type length;                       //!< The total length of the chunk
+  };
+private:
+  config_t _config;
+  uint64_t _mask_small, _mask_large;
+  std::vector<allocation::map_t> _slices;
+  size_type _length;
+  uint64_t _hash;
+
+  static uint64_t _top_bits(unsigned n) BOOST_NOEXCEPT { return n ? ~0ULL<<(64-n) : 0; }
+  static allocation::map_t _slice(const allocation::map_t &m, size_type begin, size_type end) BOOST_NOEXCEPT
+  {
+    allocation::map_t ret(m.offset+begin, end-begin);
+    ret.addr=(char *) m.addr+begin;
+    return ret;
+  }
+  template<class F> void _emit(F &f)
+  {
+    f((const allocation::map_t *) _slices.data(), (size_type) _slices.size(), _length);
+    _slices.clear();
+    _length=0;
+    _hash=0;
+  }
+public:
+  //! \brief Constructs a chunker. Sizes must satisfy 0<min_size<=avg_size<=max_size.
+  chunker(config_t config=config_t()) : _config(config), _length(0), _hash(0)
+  {
+    unsigned bits=0;
+    while(((size_type) 2<<bits)<=_config.avg_size)
+      ++bits;
+    // Normalised chunking, level two
+    _mask_small=_top_bits(bits+2);
+    _mask_large=_top_bits(bits>2 ? bits-2 : 1);
+  }
+
+  //! \brief The configuration of this chunker
+  const config_t &config() const BOOST_NOEXCEPT { return _config; }
+
+  //! \brief The number of bytes fed which have not yet been reported in a chunk
+  size_type pending() const BOOST_NOEXCEPT { return _length; }
+
+  /*! \brief Feeds \em no maps to the chunker, calling f(const map_t *slices, size_type count, size_type length)
+  for every chunk completed. The maps in any slice reported must stay mapped until the callback returns.
+  */
+  template<class F> void feed(const allocation::map_t *maps, size_type no, F &&f)
+  {
+    const uint64_t *gear=detail::gear_table();
+    for(size_type n=0; n<no; n++)
+    {
+      const allocation::map_t &m=maps[n];
+      const unsigned char *p=(const unsigned char *) m.addr;
+      size_type begin=0, i=0;
+      while(i<m.length)
+      {
+        // No cut can occur before the minimum size, so don't even hash it
+        if(_length<_config.min_size)
+        {
+          size_type skip=_config.min_size-_length;
+          if(skip>m.length-i)
+            skip=m.length-i;
+          i+=skip;
+          _length+=skip;
+          continue;
+        }
+        size_type limit=_config.max_size-_length;
+        if(limit>m.length-i)
+          limit=m.length-i;
+        const size_type end=i+limit;
+        uint64_t hash=_hash;
+        bool cut=false;
+        // Below the average size use the stricter mask
+        for(size_type avg_end=(_length<_config.avg_size) ? i+std::min(end-i, _config.avg_size-_length) : i; i<avg_end && !cut; i++)
+        {
+          hash=(hash<<1)+gear[p[i]];
+          cut=!(hash & _mask_small);
+        }
+        for(; i<end && !cut; i++)
+        {
+          hash=(hash<<1)+gear[p[i]];
+          cut=!(hash & _mask_large);
+        }
+        _length+=limit-(end-i);
+        _hash=hash;
+        if(cut || _length>=_config.max_size)
+        {
+          _slices.push_back(_slice(m, begin, i));
+          _emit(f);
+          begin=i;
+        }
+      }
+      if(begin<m.length)
+        _slices.push_back(_slice(m, begin, m.length));
+    }
+  }
+  //! \brief Feeds a container of maps to the chunker
+  template<class F> void feed(const std::vector<allocation::map_t> &maps, F &&f)
+  {
+    feed(maps.data(), maps.size(), std::forward<F>(f));
+  }
+
+  //! \brief Reports any final partial chunk, and resets the chunker for a new sequence
+  template<class F> void finish(F &&f)
+  {
+    if(_length)
+      _emit(f);
+  }
+
+  //! \brief Convenience function chunking all of a sequence of maps
+  static std::vector<chunk_t> chunks(const std::vector<allocation::map_t> &maps, config_t config=config_t())
+  {
+    std::vector<chunk_t> ret;
+    chunker c(config);
+    auto f=[&ret](const allocation::map_t *slices, size_type count, size_type length)
+    {
+      chunk_t chunk;
+      chunk.slices.assign(slices, slices+count);
+      chunk.length=length;
+      ret.push_back(std::move(chunk));
+    };
+    c.feed(maps, f);
+    c.finish(f);
+    return ret;
+  }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
@@ -0,0 +1,80 @@
+/* parallel_for.hpp
+Runs a loop body over a pool of worker threads
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef BOOST_KERNELALLOC_DETAIL_PARALLEL_FOR_HPP
+#define BOOST_KERNELALLOC_DETAIL_PARALLEL_FOR_HPP
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+namespace detail
+{
+  //! Returns \em threads, or the hardware concurrency if zero, but never more than \em items
+  inline size_t worker_count(size_t threads, size_t items) BOOST_NOEXCEPT
+  {
+    if(!threads)
+      threads=thread::hardware_concurrency();
+    if(!threads)
+      threads=1;
+    return threads<items ? threads : (items ? items : 1);
+  }
+
+  /*! Calls f(n) for every n in [0, items) using up to \em threads threads including the calling
+  thread, which participates. Items are claimed dynamically so uneven items balance out. f must
+  not throw. If worker threads cannot be launched the calling thread does all the work.
+  */
+  template<class F> inline void parallel_for(size_t items, size_t threads, F &&f) BOOST_NOEXCEPT
+  {
+    threads=worker_count(threads, items);
+    atomic<size_t> next(0);
+    auto worker=[&]
+    {
+      for(size_t n; (n=next.fetch_add(1, memory_order_relaxed))<items;)
+        f(n);
+    };
+    std::vector<thread> workers;
+    try
+    {
+      workers.reserve(threads-1);
+      for(size_t n=1; n<threads; n++)
+        workers.push_back(thread(worker));
+    }
+    catch(...)
+    {
+    }
+    worker();
+    for(auto &t : workers)
+      t.join();
+  }
+}
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
@@ -0,0 +1,464 @@
+/* erasure.hpp
+Reed-Solomon erasure coding of sequences of allocations
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_ERASURE_HPP
+#define BOOST_KERNELALLOC_ERASURE_HPP
+
+#include "detail/parallel_for.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#if (defined(__GNUC__) && __GNUC__>=8 || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define BOOST_KERNELALLOC_GF256_X86 1
+#include <immintrin.h>
+#endif
+
+/*! \file erasure.hpp
+ * \brief Provides SIMD Reed-Solomon erasure coding of allocations
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+namespace detail
+{
+  namespace gf256
+  {
+    // GF(2^8) with the AES polynomial x^8+x^4+x^3+x+1, which is the one GFNI implements
+    struct tables_t
+    {
+      uint8_t exp[512], log[256];
+      tables_t()
+      {
+        unsigned x=1;
+        for(int n=0; n<255; n++)
+        {
+          exp[n]=exp[n+255]=(uint8_t) x;
+          log[x]=(uint8_t) n;
+          // Multiply by the generator 3
+          x^=(x<<1) ^ ((x & 0x80) ? 0x11B : 0);
+        }
+        exp[510]=exp[511]=0;
+        log[0]=0;
+      }
+    };
+    inline const tables_t &tables() BOOST_NOEXCEPT
+    {
+      static const tables_t t;
+      return t;
+    }
+    inline uint8_t mul(uint8_t a, uint8_t b) BOOST_NOEXCEPT
+    {
+      if(!a || !b)
+        return 0;
+      const tables_t &t=tables();
+      return t.exp[t.log[a]+t.log[b]];
+    }
+    inline uint8_t inv(uint8_t a) BOOST_NOEXCEPT
+    {
+      const tables_t &t=tables();
+      return t.exp[255-t.log[a]];
+    }
+
+    // A coefficient prepared for every kernel: the coefficient itself plus its low and high nibble product tables
+    struct coeff_t
+    {
+      uint8_t c, lo[16], hi[16];
+      coeff_t(uint8_t _c=0) : c(_c)
+      {
+        for(int n=0; n<16; n++)
+        {
+          lo[n]=mul(c, (uint8_t) n);
+          hi[n]=mul(c, (uint8_t)(n<<4));
+        }
+      }
+    };
+
+    // dst=c*src, or dst^=c*src if add
+    typedef void (*kernel_t)(const coeff_t &c, const uint8_t *src, uint8_t *dst, size_t n, bool add);
+
+    inline void kernel_scalar(const coeff_t &c, const uint8_t *src, uint8_t *dst, size_t n, bool add) BOOST_NOEXCEPT
+    {
+      if(add)
+        for(size_t i=0; i<n; i++)
+          dst[i]^=c.lo[src[i] & 15] ^ c.hi[src[i]>>4];
+      else
+        for(size_t i=0; i<n; i++)
+          dst[i]=c.lo[src[i] & 15] ^ c.hi[src[i]>>4];
+    }
+#ifdef BOOST_KERNELALLOC_GF256_X86
+    __attribute__((target("ssse3"))) inline void kernel_ssse3(const coeff_t &c, const uint8_t *src, uint8_t *dst, size_t n, bool add) BOOST_NOEXCEPT
+    {
+      const __m128i lo=_mm_loadu_si128((const __m128i *) c.lo), hi=_mm_loadu_si128((const __m128i *) c.hi), mask=_mm_set1_epi8(15);
+      size_t i=0;
+      for(; i+16<=n; i+=16)
+      {
+        __m128i s=_mm_loadu_si128((const __m128i *)(src+i));
+        __m128i p=_mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(s, mask)), _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        if(add)
+          p=_mm_xor_si128(p, _mm_loadu_si128((const __m128i *)(dst+i)));
+        _mm_storeu_si128((__m128i *)(dst+i), p);
+      }
+      kernel_scalar(c, src+i, dst+i, n-i, add);
+    }
+    __attribute__((target("avx2"))) inline void kernel_avx2(const coeff_t &c, const uint8_t *src, uint8_t *dst, size_t n, bool add) BOOST_NOEXCEPT
+    {
+      const __m256i lo=_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) c.lo)), hi=_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) c.hi)), mask=_mm256_set1_epi8(15);
+      size_t i=0;
+      for(; i+32<=n; i+=32)
+      {
+        __m256i s=_mm256_loadu_si256((const __m256i *)(src+i));
+        __m256i p=_mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)), _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        if(add)
+          p=_mm256_xor_si256(p, _mm256_loadu_si256((const __m256i *)(dst+i)));
+        _mm256_storeu_si256((__m256i *)(dst+i), p);
+      }
+      kernel_scalar(c, src+i, dst+i, n-i, add);
+    }
+    __attribute__((target("avx2,gfni"))) inline void kernel_gfni(const coeff_t &c, const uint8_t *src, uint8_t *dst, size_t n, bool add) BOOST_NOEXCEPT
+    {
+      const __m256i k=_mm256_set1_epi8((char) c.c);
+      size_t i=0;
+      for(; i+32<=n; i+=32)
+      {
+        __m256i p=_mm256_gf2p8mul_epi8(_mm256_loadu_si256((const __m256i *)(src+i)), k);
+        if(add)
+          p=_mm256_xor_si256(p, _mm256_loadu_si256((const __m256i *)(dst+i)));
+        _mm256_storeu_si256((__m256i *)(dst+i), p);
+      }
+      kernel_scalar(c, src+i, dst+i, n-i, add);
+    }
+    __attribute__((target("avx512f,avx512bw,gfni"))) inline void kernel_avx512_gfni(const coeff_t &c, const uint8_t *src, uint8_t *dst, size_t n, bool add) BOOST_NOEXCEPT
+    {
+      const __m512i k=_mm512_set1_epi8((char) c.c);
+      size_t i=0;
+      for(; i+64<=n; i+=64)
+      {
+        __m512i p=_mm512_gf2p8mul_epi8(_mm512_loadu_si512((const void *)(src+i)), k);
+        if(add)
+          p=_mm512_xor_si512(p, _mm512_loadu_si512((const void *)(dst+i)));
+        _mm512_storeu_si512((void *)(dst+i), p);
+      }
+      kernel_scalar(c, src+i, dst+i, n-i, add);
+    }
+#endif
+  }
+}
+
+/*! \class reed_solomon
+ * \brief Erasure codes k data allocations into m parity allocations, any k of which can rebuild the rest.
+ *
+ * A systematic Reed-Solomon code over GF(2^8) whose parity rows form a Cauchy matrix, so every
+ * k by k submatrix of the generator is invertible and any m shards may be lost. Up to 256 shards
+ * in total are supported. All shards must be of the same length.
+ *
+ * Shards are processed in blocks spread across a pool of worker threads, and within a block
+ * the multiply-accumulate kernel is chosen at runtime from the best the CPU supports: AVX-512
+ * GFNI, AVX2 GFNI, AVX2 or SSSE3 nibble table lookups with PSHUFB, or portable table lookups.
+ * Shards are read and written in place through their maps, so no data is copied.
+ */
+class reed_solomon
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+
+  //! \brief The multiply kernels available
+  enum class kernel_t
+  {
+    automatic=0,    //!< Use the best available
+    scalar,         //!< Portable table lookups
+    ssse3,          //!< 16 byte PSHUFB nibble table lookups
+    avx2,           //!< 32 byte PSHUFB nibble table lookups
+    gfni,           //!< 32 byte GF2P8MULB
+    avx512_gfni     //!< 64 byte GF2P8MULB
+  };
+
+  //! \brief Configures the parallelism and kernel of a coder
+  struct config_t
+  {
+    size_type threads;      //!< The number of threads to use, zero means hardware concurrency
+    size_type block_size;   //!< The bytes of each shard processed as a unit of work
+    kernel_t kernel;        //!< The kernel to use
+    config_t() : threads(0), block_size(64*1024), kernel(kernel_t::automatic) { }
+  };
+private:
+  size_type _k, _m;
+  config_t _config;
+  detail::gf256::kernel_t _kernel;
+  std::vector<uint8_t> _generator;    // (k+m) rows by k columns, identity atop Cauchy
+
+  // Resolves automatic to the best kernel the CPU supports, returning null if one was forced which it does not
+  static detail::gf256::kernel_t _select(kernel_t &kernel) BOOST_NOEXCEPT
+  {
+    using namespace detail::gf256;
+#ifdef BOOST_KERNELALLOC_GF256_X86
+    __builtin_cpu_init();
+    const bool ssse3=!!__builtin_cpu_supports("ssse3"), avx2=!!__builtin_cpu_supports("avx2"), gfni=!!__builtin_cpu_supports("gfni");
+    const bool avx512=__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    if(kernel_t::automatic==kernel)
+    {
+      if(avx512 && gfni)
+        kernel=kernel_t::avx512_gfni;
+      else if(avx2 && gfni)
+        kernel=kernel_t::gfni;
+      else if(avx2)
+        kernel=kernel_t::avx2;
+      else if(ssse3)
+        kernel=kernel_t::ssse3;
+    }
+    switch(kernel)
+    {
+    case kernel_t::ssse3: return ssse3 ? kernel_ssse3 : nullptr;
+    case kernel_t::avx2: return avx2 ? kernel_avx2 : nullptr;
+    case kernel_t::gfni: return (avx2 && gfni) ? kernel_gfni : nullptr;
+    case kernel_t::avx512_gfni: return (avx512 && gfni) ? kernel_avx512_gfni : nullptr;
+    default: break;
+    }
+#else
+    if(kernel_t::automatic!=kernel && kernel_t::scalar!=kernel)
+      return nullptr;
+#endif
+    kernel=kernel_t::scalar;
+    return kernel_scalar;
+  }
+  // Inverts the n by n matrix a in place, returning false if singular
+  static bool _invert(std::vector<uint8_t> &a, size_type n)
+  {
+    using namespace detail::gf256;
+    std::vector<uint8_t> r(n*n, 0);
+    for(size_type i=0; i<n; i++)
+      r[i*n+i]=1;
+    for(size_type col=0; col<n; col++)
+    {
+      size_type pivot=col;
+      while(pivot<n && !a[pivot*n+col])
+        ++pivot;
+      if(pivot==n)
+        return false;
+      for(size_type j=0; j<n; j++)
+      {
+        std::swap(a[col*n+j], a[pivot*n+j]);
+        std::swap(r[col*n+j], r[pivot*n+j]);
+      }
+      uint8_t f=inv(a[col*n+col]);
+      for(size_type j=0; j<n; j++)
+      {
+        a[col*n+j]=mul(a[col*n+j], f);
+        r[col*n+j]=mul(r[col*n+j], f);
+      }
+      for(size_type row=0; row<n; row++)
+        if(row!=col && a[row*n+col])
+        {
+          uint8_t g=a[row*n+col];
+          for(size_type j=0; j<n; j++)
+          {
+            a[row*n+j]^=mul(g, a[col*n+j]);
+            r[row*n+j]^=mul(g, r[col*n+j]);
+          }
+        }
+    }
+    a.swap(r);
+    return true;
+  }
+  /* For each output o, out[o]=sum over i of matrix[o*ins+i]*in[i], every map being of length bytes,
+  processed block by block in parallel.
+  */
+  void _apply(const std::vector<uint8_t> &matrix, const uint8_t *const *in, size_type ins, uint8_t *const *out, size_type outs, size_type bytes) const
+  {
+    std::vector<detail::gf256::coeff_t> coeffs(matrix.begin(), matrix.end());
+    const size_type block=_config.block_size ? _config.block_size : bytes;
+    const size_type blocks=bytes ? (bytes+block-1)/block : 0;
+    detail::parallel_for(blocks*outs, _config.threads, [&](size_t n)
+    {
+      const size_type o=n % outs, offset=(n/outs)*block, len=(bytes-offset<block) ? bytes-offset : block;
+      for(size_type i=0; i<ins; i++)
+        _kernel(coeffs[o*ins+i], in[i]+offset, out[o]+offset, len, i!=0);
+    });
+  }
+public:
+  /*! \brief Constructs a coder of \em k data shards and \em m parity shards, where k+m<=256. If
+  \em config forces a kernel the CPU does not support, encode() and reconstruct() return ENOTSUP.
+  */
+  reed_solomon(size_type k, size_type m, config_t config=config_t()) : _k(k), _m(m), _config(config), _generator((k+m)*k, 0)
+  {
+    if(!k || k+m>256)
+      throw std::invalid_argument("Reed-Solomon needs between 1 and 256 shards");
+    _kernel=_select(_config.kernel);
+    for(size_type i=0; i<k; i++)
+      _generator[i*k+i]=1;
+    for(size_type i=0; i<m; i++)
+      for(size_type j=0; j<k; j++)
+        _generator[(k+i)*k+j]=detail::gf256::inv((uint8_t)((k+i) ^ j));
+  }
+
+  //! \brief The number of data shards
+  size_type data_shards() const BOOST_NOEXCEPT { return _k; }
+  //! \brief The number of parity shards
+  size_type parity_shards() const BOOST_NOEXCEPT { return _m; }
+  //! \brief The configuration of this coder, with the kernel resolved to that actually used
+  const config_t &config() const BOOST_NOEXCEPT { return _config; }
+  //! \brief True if the CPU supports the kernel configured
+  bool supported() const BOOST_NOEXCEPT { return _kernel!=nullptr; }
+
+  /*! \brief Computes parity_shards() parity maps from data_shards() data maps.
+  All maps must be mapped and of the same length.
+  */
+  error_code encode(const allocation::map_t *data, allocation::map_t *parity) const BOOST_NOEXCEPT
+  {
+    if(!_kernel)
+      return error_code(ENOTSUP, std::system_category());
+    const size_type bytes=data[0].length;
+    std::vector<const uint8_t *> in(_k);
+    std::vector<uint8_t *> out(_m);
+    for(size_type i=0; i<_k; i++)
+    {
+      if(data[i].length!=bytes || !data[i].addr)
+        return error_code(EINVAL, std::system_category());
+      in[i]=(const uint8_t *) data[i].addr;
+    }
+    for(size_type i=0; i<_m; i++)
+    {
+      if(parity[i].length!=bytes || !parity[i].addr)
+        return error_code(EINVAL, std::system_category());
+      out[i]=(uint8_t *) parity[i].addr;
+    }
+    try
+    {
+      _apply(std::vector<uint8_t>(_generator.begin()+_k*_k, _generator.end()), in.data(), _k, out.data(), _m, bytes);
+    }
+    catch(...)
+    {
+      return error_code(ENOMEM, std::system_category());
+    }
+    return error_code();
+  }
+
+  /*! \brief Allocates parity_shards() parity allocations from \em src and computes them from
+  data_shards() data maps, returning the parity allocations.
+  */
+  expected<std::vector<source::pointer>, error_code> encode(source &src, const allocation::map_t *data) const BOOST_NOEXCEPT
+  {
+    if(!_kernel)
+      return make_unexpected(error_code(ENOTSUP, std::system_category()));
+    std::vector<size_type> sizes;
+    std::vector<allocation::map_t> parity;
+    try
+    {
+      sizes.assign(_m, data[0].length);
+      parity.assign(_m, allocation::map_t(0, data[0].length));
+    }
+    catch(...)
+    {
+      return make_unexpected(error_code(ENOMEM, std::system_category()));
+    }
+    auto ret(src.allocate(_m, sizes.data()));
+    if(!ret)
+      return ret;
+    error_code ec;
+    size_type mapped=0;
+    for(; mapped<_m; mapped++)
+      if(!(*ret)[mapped]->map(parity[mapped]))
+      {
+        ec=parity[mapped].ec;
+        break;
+      }
+    if(!ec)
+      ec=encode(data, parity.data());
+    for(size_type i=0; i<mapped; i++)
+      (*ret)[i]->unmap(parity[i]);
+    if(ec)
+      return make_unexpected(ec);
+    return ret;
+  }
+
+  /*! \brief Rebuilds missing shards in place. \em shards is all data_shards() data maps followed
+  by all parity_shards() parity maps, and \em present says which hold valid contents. At least
+  data_shards() must be present, and the missing ones must be mapped ready to receive their
+  contents. All maps must be of the same length.
+  */
+  error_code reconstruct(allocation::map_t *shards, const bool *present) const BOOST_NOEXCEPT
+  {
+    if(!_kernel)
+      return error_code(ENOTSUP, std::system_category());
+    const size_type n=_k+_m, bytes=shards[0].length;
+    std::vector<size_type> sources, missing;
+    for(size_type i=0; i<n; i++)
+    {
+      if(shards[i].length!=bytes || !shards[i].addr)
+        return error_code(EINVAL, std::system_category());
+      if(!present[i])
+        missing.push_back(i);
+      else if(sources.size()<_k)
+        sources.push_back(i);
+    }
+    if(sources.size()<_k)
+      return error_code(EINVAL, std::system_category());
+    if(missing.empty())
+      return error_code();
+    try
+    {
+      // Invert the generator rows of the shards we have to get the data from them
+      std::vector<uint8_t> decode(_k*_k);
+      for(size_type r=0; r<_k; r++)
+        memcpy(decode.data()+r*_k, _generator.data()+sources[r]*_k, _k);
+      if(!_invert(decode, _k))
+        return error_code(EINVAL, std::system_category());
+      // Each missing shard is its generator row times the decode matrix applied to the sources
+      std::vector<uint8_t> matrix(missing.size()*_k, 0);
+      for(size_type o=0; o<missing.size(); o++)
+        for(size_type j=0; j<_k; j++)
+        {
+          uint8_t g=_generator[missing[o]*_k+j];
+          if(g)
+            for(size_type i=0; i<_k; i++)
+              matrix[o*_k+i]^=detail::gf256::mul(g, decode[j*_k+i]);
+        }
+      std::vector<const uint8_t *> in;
+      std::vector<uint8_t *> out;
+      for(auto i : sources)
+        in.push_back((const uint8_t *) shards[i].addr);
+      for(auto i : missing)
+        out.push_back((uint8_t *) shards[i].addr);
+      _apply(matrix, in.data(), _k, out.data(), out.size(), bytes);
+    }
+    catch(...)
+    {
+      return error_code(ENOMEM, std::system_category());
+    }
+    return error_code();
+  }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
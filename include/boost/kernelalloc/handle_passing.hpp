@@ -0,0 +1,218 @@
+/* handle_passing.hpp
+Passing persistent allocations between processes
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_HANDLE_PASSING_HPP
+#define BOOST_KERNELALLOC_HANDLE_PASSING_HPP
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+/*! \file handle_passing.hpp
+ * \brief Provides zero copy handoff of the descriptors backing persistent allocations between processes over Unix sockets
+ *
+ * Only the transport is provided: persistent_allocation does not yet expose its backing descriptor,
+ * nor persistent_source a way to adopt one, so the sender fills in a passed_handle itself and the
+ * receiver maps the descriptor it gets back itself.
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+namespace detail
+{
+  // Sent alongside the descriptor. Both ends are the same build on the same machine, so native layout is fine.
+  struct handle_message_t
+  {
+    static const unsigned int magic_value=0x4b414831;  // "KAH1"
+    unsigned int magic;
+    unsigned int reserved;
+    unsigned long long unique_id;
+    unsigned long long offset;
+    unsigned long long size;
+  };
+}
+
+/*! \struct passed_handle
+ * \brief What is passed between processes to hand over a persistent allocation
+ */
+struct passed_handle
+{
+  persistent_allocation::native_handle_type handle;  //!< The descriptor backing the allocation
+  persistent_allocation::unique_id_t unique_id;      //!< The unique id of the allocation
+  unsigned long long offset;                         //!< The offset of the allocation within \em handle
+  unsigned long long size;                           //!< The size of the allocation
+};
+
+/*! \brief Sends \em h over the connected Unix domain \em socket to another process, which receives
+it with receive_handle(). The descriptor is passed with SCM_RIGHTS, so the receiver gets its own
+descriptor for the same object. Datagram and seqpacket sockets send all or nothing. On a stream
+socket a short send is finished without the descriptor, which went with the first byte, so the
+stream stays in step. If a send fails part way through a stream the stream is out of step and
+must be closed.
+*/
+inline error_code send_handle(int socket, const passed_handle &h) BOOST_NOEXCEPT
+{
+#ifdef WIN32
+  (void) socket; (void) h;
+  return error_code(ENOSYS, std::system_category());
+#else
+  if(h.handle<0)
+    return error_code(EBADF, std::system_category());
+  detail::handle_message_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.magic=detail::handle_message_t::magic_value;
+  msg.unique_id=h.unique_id;
+  msg.offset=h.offset;
+  msg.size=h.size;
+  iovec iov;
+  iov.iov_base=&msg;
+  iov.iov_len=sizeof(msg);
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(int))];
+    cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov=&iov;
+  hdr.msg_iovlen=1;
+  hdr.msg_control=control.buf;
+  hdr.msg_controllen=sizeof(control.buf);
+  cmsghdr *c=CMSG_FIRSTHDR(&hdr);
+  c->cmsg_level=SOL_SOCKET;
+  c->cmsg_type=SCM_RIGHTS;
+  c->cmsg_len=CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(c), &h.handle, sizeof(int));
+  ssize_t written;
+  while(-1==(written=::sendmsg(socket, &hdr, MSG_NOSIGNAL)) && EINTR==errno);
+  if(-1==written)
+    return error_code(errno, std::system_category());
+  for(size_t sent=(size_t) written; sent<sizeof(msg); sent+=(size_t) written)
+  {
+    while(-1==(written=::send(socket, (const char *) &msg+sent, sizeof(msg)-sent, MSG_NOSIGNAL)) && EINTR==errno);
+    if(-1==written)
+      return error_code(errno, std::system_category());
+  }
+  return error_code();
+#endif
+}
+
+/*! \brief Receives from the connected Unix domain \em socket a handle sent by send_handle() in
+another process. The caller owns the descriptor returned. On a stream socket a message arriving
+in pieces is read in full. Returns EBADMSG if what arrived was not a handle, in which case any
+descriptor received is closed.
+*/
+inline expected<passed_handle, error_code> receive_handle(int socket) BOOST_NOEXCEPT
+{
+#ifdef WIN32
+  (void) socket;
+  return make_unexpected(error_code(ENOSYS, std::system_category()));
+#else
+  detail::handle_message_t msg;
+  iovec iov;
+  iov.iov_base=&msg;
+  iov.iov_len=sizeof(msg);
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(int))];
+    cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov=&iov;
+  hdr.msg_iovlen=1;
+  hdr.msg_control=control.buf;
+  hdr.msg_controllen=sizeof(control.buf);
+  int flags=0;
+#ifdef MSG_CMSG_CLOEXEC
+  flags|=MSG_CMSG_CLOEXEC;
+#endif
+  ssize_t got;
+  while(-1==(got=::recvmsg(socket, &hdr, flags)) && EINTR==errno);
+  if(-1==got)
+    return make_unexpected(error_code(errno, std::system_category()));
+  int fd=-1;
+  for(cmsghdr *c=CMSG_FIRSTHDR(&hdr); c; c=CMSG_NXTHDR(&hdr, c))
+    if(SOL_SOCKET==c->cmsg_level && SCM_RIGHTS==c->cmsg_type && c->cmsg_len>=CMSG_LEN(sizeof(int)))
+    {
+      // Close any surplus descriptors so they don't leak
+      size_t count=(c->cmsg_len-CMSG_LEN(0))/sizeof(int);
+      for(size_t n=0; n<count; n++)
+      {
+        int _fd;
+        memcpy(&_fd, CMSG_DATA(c)+n*sizeof(int), sizeof(int));
+        if(-1==fd)
+          fd=_fd;
+        else
+          ::close(_fd);
+      }
+    }
+  if(-1==fd)
+    return make_unexpected(error_code(0==got ? ECONNRESET : EBADMSG, std::system_category()));
+#ifndef MSG_CMSG_CLOEXEC
+  ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+  // Only a stream can deliver the rest of a message later, elsewhere a short message is truncated
+  int type=0;
+  socklen_t typelen=sizeof(type);
+  if(got>0 && (size_t) got<sizeof(msg) && !::getsockopt(socket, SOL_SOCKET, SO_TYPE, &type, &typelen) && SOCK_STREAM==type)
+  {
+    for(ssize_t more; (size_t) got<sizeof(msg); got+=more)
+    {
+      while(-1==(more=::recv(socket, (char *) &msg+got, sizeof(msg)-got, 0)) && EINTR==errno);
+      if(more<=0)
+        break;
+    }
+  }
+  if((size_t) got!=sizeof(msg) || (hdr.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) || detail::handle_message_t::magic_value!=msg.magic || !msg.size)
+  {
+    ::close(fd);
+    return make_unexpected(error_code(EBADMSG, std::system_category()));
+  }
+  passed_handle ret;
+  ret.handle=fd;
+  ret.unique_id=msg.unique_id;
+  ret.offset=msg.offset;
+  ret.size=msg.size;
+  return ret;
+#endif
+}
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
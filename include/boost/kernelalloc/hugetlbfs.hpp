@@ -0,0 +1,283 @@
+/* hugetlbfs.hpp
+Discovery and reservation of hugetlbfs huge pages
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_HUGETLBFS_HPP
+#define BOOST_KERNELALLOC_HUGETLBFS_HPP
+
+#include "page_size.hpp"
+#include <cstdio>
+#include <cstdlib>
+
+/*! \file hugetlbfs.hpp
+ * \brief Provides discovery of hugetlbfs mounts and management of the huge page pool
+ *
+ * The hugetlbfs_2mb and hugetlbfs_1gb source flags are reserved for persistent and file sources
+ * storing their allocations in a hugetlbfs mount, but no source honours them yet, so callers use
+ * these functions directly. Huge pages for hugetlbfs come from a pool the kernel sets aside,
+ * which must be reserved in advance, ideally at boot or startup before memory fragments. These
+ * functions let a process find the mounts, reserve the pool and check it has enough free, so it
+ * can fail early with a clear error rather than fault with SIGBUS later.
+ *
+ * Errors are reported as system error codes: ENOENT if no hugetlbfs is mounted with the page size
+ * asked for, EOPNOTSUPP if the kernel does not support that page size at all, EACCES if the pool
+ * cannot be resized without privilege, and ENOMEM if the pool has too few free pages.
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+//! \brief A mounted hugetlbfs
+struct hugetlbfs_mount_t
+{
+  path directory;     //!< Where it is mounted
+  size_t page_size;   //!< The size of its pages
+};
+
+//! \brief The state of the kernel's pool of huge pages of one size
+struct hugepage_pool_t
+{
+  size_t page_size;   //!< The size of the pages in this pool
+  size_t total;       //!< The pages in the pool
+  size_t free;        //!< The pages in the pool not in use
+  size_t reserved;    //!< The free pages promised to mappings which have not yet faulted them in
+  size_t surplus;     //!< The pages beyond total allocated on demand under overcommit
+  //! \brief The pages which could be given to a new mapping
+  size_t available() const BOOST_NOEXCEPT { return free>reserved ? free-reserved : 0; }
+};
+
+namespace detail
+{
+  // Parses a size such as "2M", "1G" or "2097152"
+  inline size_t parse_size(const char *s) BOOST_NOEXCEPT
+  {
+    char *end;
+    unsigned long long v=strtoull(s, &end, 10);
+    switch(*end)
+    {
+    case 'k': case 'K': v<<=10; break;
+    case 'm': case 'M': v<<=20; break;
+    case 'g': case 'G': v<<=30; break;
+    }
+    return (size_t) v;
+  }
+  // /proc/mounts escapes whitespace and backslashes in octal
+  inline std::string unescape_mount(const char *s)
+  {
+    std::string ret;
+    for(; *s; s++)
+    {
+      if('\\'==s[0] && s[1]>='0' && s[1]<='7' && s[2]>='0' && s[2]<='7' && s[3]>='0' && s[3]<='7')
+      {
+        ret.push_back((char)(((s[1]-'0')<<6)|((s[2]-'0')<<3)|(s[3]-'0')));
+        s+=3;
+      }
+      else
+        ret.push_back(*s);
+    }
+    return ret;
+  }
+  // The huge page size used by mounts not specifying one
+  inline size_t default_hugepage_size() BOOST_NOEXCEPT
+  {
+    size_t ret=0;
+#ifdef __linux__
+    if(FILE *f=fopen("/proc/meminfo", "r"))
+    {
+      char line[256];
+      unsigned long kb;
+      while(fgets(line, sizeof(line), f))
+        if(1==sscanf(line, "Hugepagesize: %lu kB", &kb))
+        {
+          ret=(size_t) kb*1024;
+          break;
+        }
+      fclose(f);
+    }
+#endif
+    return ret;
+  }
+  inline bool read_sysfs_count(const std::string &file, size_t &out) BOOST_NOEXCEPT
+  {
+    FILE *f=fopen(file.c_str(), "r");
+    if(!f)
+      return false;
+    unsigned long long v;
+    bool ret=(1==fscanf(f, "%llu", &v));
+    fclose(f);
+    out=(size_t) v;
+    return ret;
+  }
+  inline std::string hugepage_sysfs_dir(size_t page_size)
+  {
+    char buf[96];
+    sprintf(buf, "/sys/kernel/mm/hugepages/hugepages-%llukB/", (unsigned long long) page_size/1024);
+    return buf;
+  }
+  inline bool hugepage_size_supported(size_t page_size) BOOST_NOEXCEPT
+  {
+    for(auto s : page_sizes().huge)
+      if(s==page_size)
+        return true;
+    return false;
+  }
+}
+
+//! \brief Returns every hugetlbfs mounted, read from /proc/mounts
+inline expected<std::vector<hugetlbfs_mount_t>, error_code> hugetlbfs_mounts() BOOST_NOEXCEPT
+{
+#ifdef __linux__
+  try
+  {
+    std::vector<hugetlbfs_mount_t> ret;
+    FILE *f=fopen("/proc/mounts", "r");
+    if(!f)
+      return make_unexpected(error_code(errno, std::system_category()));
+    const size_t default_size=detail::default_hugepage_size();
+    char line[4096], dir[4096], type[64], options[1024];
+    while(fgets(line, sizeof(line), f))
+    {
+      if(3!=sscanf(line, "%*s %4095s %63s %1023s", dir, type, options) || strcmp(type, "hugetlbfs"))
+        continue;
+      hugetlbfs_mount_t m;
+      m.directory=detail::unescape_mount(dir);
+      m.page_size=default_size;
+      for(const char *o=options; o; o=strchr(o, ','))
+      {
+        if(','==*o)
+          ++o;
+        if(!strncmp(o, "pagesize=", 9))
+          m.page_size=detail::parse_size(o+9);
+      }
+      ret.push_back(std::move(m));
+    }
+    fclose(f);
+    return ret;
+  }
+  catch(...)
+  {
+    return make_unexpected(error_code(ENOMEM, std::system_category()));
+  }
+#else
+  return make_unexpected(error_code(ENOSYS, std::system_category()));
+#endif
+}
+
+/*! \brief Returns a hugetlbfs mount with pages of \em page_size bytes, or ENOENT if there is none
+and EOPNOTSUPP if the kernel has no huge pages of that size.
+*/
+inline expected<hugetlbfs_mount_t, error_code> find_hugetlbfs(size_t page_size) BOOST_NOEXCEPT
+{
+  if(!detail::hugepage_size_supported(page_size))
+    return make_unexpected(error_code(EOPNOTSUPP, std::system_category()));
+  auto mounts(hugetlbfs_mounts());
+  if(!mounts)
+    return make_unexpected(mounts.error());
+  for(auto &m : *mounts)
+    if(m.page_size==page_size)
+      return std::move(m);
+  return make_unexpected(error_code(ENOENT, std::system_category()));
+}
+
+//! \brief Returns the state of the pool of huge pages of \em page_size bytes
+inline expected<hugepage_pool_t, error_code> hugepage_pool(size_t page_size) BOOST_NOEXCEPT
+{
+  if(!detail::hugepage_size_supported(page_size))
+    return make_unexpected(error_code(EOPNOTSUPP, std::system_category()));
+  try
+  {
+    const std::string dir(detail::hugepage_sysfs_dir(page_size));
+    hugepage_pool_t ret;
+    ret.page_size=page_size;
+    errno=0;
+    if(!detail::read_sysfs_count(dir+"nr_hugepages", ret.total)
+      || !detail::read_sysfs_count(dir+"free_hugepages", ret.free)
+      || !detail::read_sysfs_count(dir+"resv_hugepages", ret.reserved)
+      || !detail::read_sysfs_count(dir+"surplus_hugepages", ret.surplus))
+      return make_unexpected(error_code(errno ? errno : EIO, std::system_category()));
+    return ret;
+  }
+  catch(...)
+  {
+    return make_unexpected(error_code(ENOMEM, std::system_category()));
+  }
+}
+
+/*! \brief Returns ENOMEM if the pool of huge pages of \em page_size bytes does not have enough
+pages available for a mapping of \em bytes. Call this before mapping anything in a hugetlbfs
+mount, as a mapping the pool cannot back fails with SIGBUS on first touch.
+*/
+inline error_code check_hugepage_pool(size_t page_size, size_t bytes) BOOST_NOEXCEPT
+{
+  auto pool(hugepage_pool(page_size));
+  if(!pool)
+    return pool.error();
+  if(pool->available()<(bytes+page_size-1)/page_size)
+    return error_code(ENOMEM, std::system_category());
+  return error_code();
+}
+
+/*! \brief Grows the pool of huge pages of \em page_size bytes until at least \em pages are free,
+returning the pool afterwards. Call at startup before memory fragments, as the kernel needs
+physically contiguous memory for each page. Needs privilege to write to /sys/kernel/mm/hugepages,
+returning EACCES without it. Returns ENOMEM if the kernel could not find enough contiguous memory,
+having kept whatever pages it did find.
+*/
+inline expected<hugepage_pool_t, error_code> reserve_hugepages(size_t page_size, size_t pages) BOOST_NOEXCEPT
+{
+  auto pool(hugepage_pool(page_size));
+  if(!pool)
+    return pool;
+  if(pool->available()>=pages)
+    return pool;
+  try
+  {
+    FILE *f=fopen((detail::hugepage_sysfs_dir(page_size)+"nr_hugepages").c_str(), "w");
+    if(!f)
+      return make_unexpected(error_code(errno, std::system_category()));
+    int written=fprintf(f, "%llu", (unsigned long long)(pool->total+pages-pool->available()));
+    // The kernel only reports failure to allocate pages through the count it reads back
+    if(EOF==fclose(f) || written<0)
+      return make_unexpected(error_code(errno ? errno : EIO, std::system_category()));
+  }
+  catch(...)
+  {
+    return make_unexpected(error_code(ENOMEM, std::system_category()));
+  }
+  pool=hugepage_pool(page_size);
+  if(pool && pool->available()<pages)
+    return make_unexpected(error_code(ENOMEM, std::system_category()));
+  return pool;
+}
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
@@ -0,0 +1,335 @@
+/* io_range.hpp
+Ranges of maps laid out for vectored I/O
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_IO_RANGE_HPP
+#define BOOST_KERNELALLOC_IO_RANGE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <limits.h>
+#include <unistd.h>
+#endif
+
+/*! \file io_range.hpp
+ * \brief Provides ranges of maps laid out as iovecs, passed straight to vectored I/O
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+//! \brief A mapped range laid out exactly as a struct iovec
+struct io_vec
+{
+  void *iov_base;   //!< The mapped address
+  size_t iov_len;   //!< The length
+};
+#ifndef WIN32
+static_assert(sizeof(io_vec)==sizeof(struct iovec) && offsetof(io_vec, iov_base)==offsetof(struct iovec, iov_base)
+  && offsetof(io_vec, iov_len)==offsetof(struct iovec, iov_len), "io_vec must be laid out as struct iovec");
+#endif
+
+/*! \class io_range
+ * \brief A sequence of mapped ranges whose array is directly usable as an array of struct iovec.
+ *
+ * A std::vector<allocation::map_t> cannot be handed to readv() or writev(), as each entry carries
+ * its offset and error in between the address and length, so every vectored I/O first builds an
+ * iovec array. io_range keeps the addresses and lengths as an array of io_vec, which is laid out
+ * as struct iovec, with the offsets kept in a parallel array and errors in a sparse side table of
+ * (index, error) pairs in index order. iov() may then be passed to readv(), writev(), preadv(),
+ * sendmsg() or an io_uring submission as is, with no conversion and no allocation per I/O.
+ *
+ * map() fills the range straight from an allocation, converting through a small stack buffer
+ * of map_t so the only heap storage is the range's own, which is reused across clear().
+ */
+class io_range
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+  //! \brief An entry of the error side table
+  typedef std::pair<size_type, error_code> error_entry;
+private:
+  std::vector<io_vec> _vecs;
+  std::vector<size_type> _offsets;
+  std::vector<error_entry> _errors;
+public:
+  //! \brief Constructs an empty range
+  io_range() BOOST_NOEXCEPT { }
+  //! \brief Constructs a range from mapped \em maps
+  io_range(const allocation::map_t *maps, size_type no)
+  {
+    reserve(no);
+    for(size_type n=0; n<no; n++)
+    {
+      push_back(maps[n].addr, maps[n].length, maps[n].offset);
+      if(maps[n].ec)
+        set_error(n, maps[n].ec);
+    }
+  }
+  //! \brief Constructs a range from a vector of mapped maps
+  explicit io_range(const std::vector<allocation::map_t> &maps) : io_range(maps.data(), maps.size()) { }
+  //! \brief Constructs a range from a mapped batch
+  explicit io_range(const map_batch &b)
+  {
+    reserve(b.size());
+    for(size_type n=0; n<b.size(); n++)
+      push_back(b.address(n), b.lengths()[n], b.offsets()[n]);
+    _errors=b.errors();
+  }
+
+  //! \brief Reserves space for \em no ranges
+  void reserve(size_type no) { _vecs.reserve(no); _offsets.reserve(no); }
+  /*! \brief Adds the mapped range of \em length bytes at \em addr, which is \em offset into its allocation.
+  A null \em addr is added with zero length, so a failed map is skipped by vectored I/O rather than faulting it.
+  */
+  void push_back(void *addr, size_type length, size_type offset=0)
+  {
+    io_vec v={ addr, addr ? length : 0 };
+    _vecs.push_back(v);
+    _offsets.push_back(offset);
+  }
+  //! \brief Adds a mapped map
+  void push_back(const allocation::map_t &m) { push_back(m.addr, m.length, m.offset); }
+  //! \brief Removes all ranges and errors, keeping the storage
+  void clear() BOOST_NOEXCEPT { _vecs.clear(); _offsets.clear(); _errors.clear(); }
+  //! \brief The number of ranges
+  size_type size() const BOOST_NOEXCEPT { return _vecs.size(); }
+  //! \brief True if there are no ranges
+  bool empty() const BOOST_NOEXCEPT { return _vecs.empty(); }
+  //! \brief The range \em n as a map_t
+  allocation::map_t operator[](size_type n) const BOOST_NOEXCEPT
+  {
+    allocation::map_t ret(_offsets[n], _vecs[n].iov_len);
+    ret.addr=_vecs[n].iov_base;
+    ret.ec=error(n);
+    return ret;
+  }
+  //! \brief The array of ranges
+  io_vec *data() BOOST_NOEXCEPT { return _vecs.data(); }
+  const io_vec *data() const BOOST_NOEXCEPT { return _vecs.data(); }
+  //! \brief The array of offsets into their allocations
+  const size_type *offsets() const BOOST_NOEXCEPT { return _offsets.data(); }
+  //! \brief The total length of all the ranges
+  size_type bytes() const BOOST_NOEXCEPT
+  {
+    size_type ret=0;
+    const io_vec *v=_vecs.data();
+    for(size_type n=0, no=_vecs.size(); n<no; n++)
+      ret+=v[n].iov_len;
+    return ret;
+  }
+#ifndef WIN32
+  //! \brief The array of ranges as iovecs
+  struct iovec *iov() BOOST_NOEXCEPT { return reinterpret_cast<struct iovec *>(_vecs.data()); }
+  const struct iovec *iov() const BOOST_NOEXCEPT { return reinterpret_cast<const struct iovec *>(_vecs.data()); }
+  //! \brief Points \em msg's iovecs at this range
+  void fill(struct msghdr &msg) BOOST_NOEXCEPT
+  {
+    msg.msg_iov=iov();
+    msg.msg_iovlen=_vecs.size();
+  }
+#endif
+
+  //! \brief The sparse table of errors, one entry per range which failed, in index order
+  const std::vector<error_entry> &errors() const BOOST_NOEXCEPT { return _errors; }
+  //! \brief The error for range \em n, empty if it succeeded
+  error_code error(size_type n) const BOOST_NOEXCEPT
+  {
+    auto it=std::lower_bound(_errors.begin(), _errors.end(), n, [](const error_entry &e, size_type i) { return e.first<i; });
+    return (it!=_errors.end() && it->first==n) ? it->second : error_code();
+  }
+  //! \brief Records an error for range \em n. Errors must be recorded in index order.
+  void set_error(size_type n, error_code ec) { _errors.push_back(error_entry(n, ec)); }
+
+  /*! \brief Maps the \em no ranges of \em a described by \em offsets and \em lengths, appending
+  each to this range, returning how many were mapped. Ranges which fail are appended with a null
+  address and zero length, and their error recorded, so iov() stays safe to pass to readv() or writev().
+  */
+  size_type map(allocation &a, const size_type *offsets, const size_type *lengths, size_type no) BOOST_NOEXCEPT
+  {
+    static BOOST_CONSTEXPR_OR_CONST size_type chunk_size=64;
+    allocation::map_t chunk[chunk_size];
+    size_type ret=0;
+    try
+    {
+      reserve(size()+no);
+      for(size_type i=0; i<no; i+=chunk_size)
+      {
+        const size_type n=std::min(no-i, chunk_size);
+        for(size_type j=0; j<n; j++)
+          chunk[j]=allocation::map_t(offsets[i+j], lengths[i+j]);
+        ret+=a.map(chunk, n);
+        for(size_type j=0; j<n; j++)
+        {
+          if(chunk[j].ec)
+            set_error(size(), chunk[j].ec);
+          push_back(chunk[j].addr, chunk[j].length, chunk[j].offset);
+        }
+      }
+    }
+    catch(...)
+    {
+    }
+    return ret;
+  }
+  //! \brief Maps the ranges of batch \em b of allocation \em a, appending each to this range
+  size_type map(allocation &a, const map_batch &b) BOOST_NOEXCEPT
+  {
+    return map(a, b.offsets(), b.lengths(), b.size());
+  }
+  //! \brief Unmaps every mapped range from \em a, returning how many were unmapped
+  size_type unmap(allocation &a) BOOST_NOEXCEPT
+  {
+    static BOOST_CONSTEXPR_OR_CONST size_type chunk_size=64;
+    allocation::map_t chunk[chunk_size];
+    size_type ret=0;
+    for(size_type i=0; i<size(); )
+    {
+      size_type n=0;
+      for(; i<size() && n<chunk_size; i++)
+      {
+        if(!_vecs[i].iov_base)
+          continue;
+        chunk[n]=allocation::map_t(_offsets[i], _vecs[i].iov_len);
+        chunk[n++].addr=_vecs[i].iov_base;
+      }
+      ret+=a.unmap(chunk, n);
+    }
+    return ret;
+  }
+};
+
+#ifndef WIN32
+namespace detail
+{
+#ifdef IOV_MAX
+  static const size_t io_range_iov_max=IOV_MAX;
+#else
+  static const size_t io_range_iov_max=1024;
+#endif
+  // Runs op over the iovecs of r at most IOV_MAX at a time until all are transferred, resuming part
+  // way through an iovec after a short transfer by adjusting it in place and restoring it afterwards
+  template<class Op> inline expected<size_t, error_code> io_range_transfer(io_range &r, Op &&op) BOOST_NOEXCEPT
+  {
+    struct iovec *v=r.iov(), saved;
+    const size_t no=r.size(), none=(size_t) -1;
+    size_t idx=0, done=0, saved_idx=none;
+    int err=0;
+    while(idx<no)
+    {
+      ssize_t bytes=op(v+idx, std::min(no-idx, io_range_iov_max), done);
+      if(bytes<0)
+      {
+        if(errno==EINTR)
+          continue;
+        err=errno;
+        break;
+      }
+      if(!bytes)
+        break;
+      done+=(size_t) bytes;
+      size_t left=(size_t) bytes;
+      while(idx<no && left>=v[idx].iov_len)
+      {
+        left-=v[idx].iov_len;
+        if(idx==saved_idx)
+        {
+          v[idx]=saved;
+          saved_idx=none;
+        }
+        ++idx;
+      }
+      if(left)
+      {
+        if(saved_idx!=idx)
+        {
+          saved=v[idx];
+          saved_idx=idx;
+        }
+        v[idx].iov_base=(char *) v[idx].iov_base+left;
+        v[idx].iov_len-=left;
+      }
+    }
+    if(saved_idx!=none)
+      v[saved_idx]=saved;
+    if(err && !done)
+      return make_unexpected(error_code(err, std::system_category()));
+    return done;
+  }
+}
+
+/*! \brief Reads from \em fd into every range of \em r with as few readv() calls as possible, returning
+the bytes read, which is short only at end of file or on an error after some bytes were read.
+*/
+inline expected<size_t, error_code> readv(int fd, io_range &r) BOOST_NOEXCEPT
+{
+  return detail::io_range_transfer(r, [fd](struct iovec *v, size_t no, size_t) { return ::readv(fd, v, (int) no); });
+}
+//! \brief Writes every range of \em r to \em fd with as few writev() calls as possible, returning the bytes written
+inline expected<size_t, error_code> writev(int fd, io_range &r) BOOST_NOEXCEPT
+{
+  return detail::io_range_transfer(r, [fd](struct iovec *v, size_t no, size_t) { return ::writev(fd, v, (int) no); });
+}
+//! \brief Sends every range of \em r over \em socket with as few sendmsg() calls as possible, returning the bytes sent
+inline expected<size_t, error_code> sendmsg(int socket, io_range &r, int flags=0) BOOST_NOEXCEPT
+{
+  return detail::io_range_transfer(r, [socket, flags](struct iovec *v, size_t no, size_t)
+  {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov=v;
+    msg.msg_iovlen=no;
+    return ::sendmsg(socket, &msg, flags);
+  });
+}
+#ifdef __linux__
+//! \brief Reads from \em fd at \em offset into every range of \em r with as few preadv() calls as possible
+inline expected<size_t, error_code> preadv(int fd, io_range &r, off_t offset) BOOST_NOEXCEPT
+{
+  return detail::io_range_transfer(r, [fd, offset](struct iovec *v, size_t no, size_t done) { return ::preadv(fd, v, (int) no, offset+(off_t) done); });
+}
+//! \brief Writes every range of \em r to \em fd at \em offset with as few pwritev() calls as possible
+inline expected<size_t, error_code> pwritev(int fd, io_range &r, off_t offset) BOOST_NOEXCEPT
+{
+  return detail::io_range_transfer(r, [fd, offset](struct iovec *v, size_t no, size_t done) { return ::pwritev(fd, v, (int) no, offset+(off_t) done); });
+}
+#endif
+#endif
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
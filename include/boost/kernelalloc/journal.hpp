@@ -0,0 +1,351 @@
+/* journal.hpp
+An append only journal with group commit
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_JOURNAL_HPP
+#define BOOST_KERNELALLOC_JOURNAL_HPP
+
+#include "page_size.hpp"
+#include <cstdint>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*! \file journal.hpp
+ * \brief Provides a write ahead log appended to lock free in mapped file storage, made durable in batches
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+/*! \class journal
+ * \brief An append only journal of records in a mapped file allocation, with group commit.
+ *
+ * Appending a record reserves space for it with a single atomic add on the tail offset, then copies
+ * the record straight into the mapped file and publishes its header with a release store. No lock
+ * is taken and no syscall made. The value returned is the record's log sequence number (LSN), the
+ * offset just past its end.
+ *
+ * A committer thread scans forward from the last durable offset over published headers, stopping
+ * at the first record still being written, then makes everything scanned durable with a single
+ * fdatasync() of the file (or msync() of just the new range if no file handle was given), and wakes
+ * every thread waiting in wait_durable() for an LSN now covered. Records appended while one sync is
+ * in progress are all made durable by the next, so under load each sync covers many records.
+ *
+ * Each record is an eight byte header holding its length and a checksum of its contents, followed
+ * by the contents padded to eight bytes. When a journal is opened over an allocation which already
+ * holds records, they are scanned and checksummed, appending continues after the last intact one,
+ * and anything after that, such as a record torn by a crash, is destroyed.
+ */
+class journal
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+  //! \brief A log sequence number, the offset just past the end of a record
+  typedef unsigned long long lsn_t;
+  //! \brief A pointer to a journal
+  typedef std::shared_ptr<journal> pointer;
+  //! \brief A native handle type
+  typedef file_source::native_handle_type native_handle_type;
+
+  //! \brief Configures a journal
+  struct config_t
+  {
+    chrono::steady_clock::duration max_delay;   //!< Records are made durable within this even if nobody waits
+    config_t() : max_delay(chrono::milliseconds(10)) { }
+  };
+private:
+  static BOOST_CONSTEXPR_OR_CONST size_type _header_size=8;
+
+  config_t _config;
+  source::pointer _a;
+  allocation::map_t _m;
+  native_handle_type _fd;
+  char *_base;
+  lsn_t _capacity;
+  atomic<lsn_t> _tail, _durable;
+  lsn_t _scanned, _wanted;
+  error_code _ec;
+  mutex _lock, _commit_lock;
+  condition_variable _changed, _committed;
+  bool _done;
+  thread _thread;
+
+  journal(config_t config) : _config(std::move(config)), _fd((native_handle_type) -1), _base(nullptr), _capacity(0), _tail(0), _durable(0), _scanned(0), _wanted(0), _done(false) { }
+
+  static size_type _record_size(size_type bytes) BOOST_NOEXCEPT { return _header_size+((bytes+7) & ~(size_type) 7); }
+  // A word at a time checksum over the padded contents, forced odd so a header is never zero
+  static uint32_t _checksum(const char *p, size_type bytes) BOOST_NOEXCEPT
+  {
+    uint64_t h=0xcbf29ce484222325ULL ^ bytes;
+    for(size_type n=0; n<bytes; n+=8)
+    {
+      uint64_t w;
+      memcpy(&w, p+n, 8);
+      h=(h ^ w)*0x100000001b3ULL;
+      h^=h>>29;
+    }
+    return (uint32_t)(h>>32) | 1;
+  }
+  atomic<uint64_t> *_header(lsn_t offset) const BOOST_NOEXCEPT
+  {
+    return reinterpret_cast<atomic<uint64_t> *>(_base+offset);
+  }
+  // Returns the size of the published record at offset, or zero if there is none yet
+  size_type _published(lsn_t offset) const BOOST_NOEXCEPT
+  {
+    if(offset+_header_size>_capacity)
+      return 0;
+    uint64_t h=_header(offset)->load(memory_order_acquire);
+    if(!h)
+      return 0;
+    size_type ret=_record_size((uint32_t) h);
+    return offset+ret<=_capacity ? ret : 0;
+  }
+  error_code _sync(lsn_t begin, lsn_t end) BOOST_NOEXCEPT
+  {
+#ifdef WIN32
+    (void) begin; (void) end;
+    return error_code(ENOSYS, std::system_category());
+#else
+    if(_fd!=(native_handle_type) -1)
+      return -1==::fdatasync(_fd) ? error_code(errno, std::system_category()) : error_code();
+    char *from=(char *) page_round_down((size_t)(_base+begin));
+    if(-1==::msync(from, (size_t)(_base+end-from), MS_SYNC))
+      return error_code(errno, std::system_category());
+    return error_code();
+#endif
+  }
+  // Scans and checksums any existing records, and destroys whatever follows the last intact one
+  void _recover() BOOST_NOEXCEPT
+  {
+    lsn_t offset=0;
+    while(size_type size=_published(offset))
+    {
+      uint64_t h=_header(offset)->load(memory_order_relaxed);
+      if((uint32_t)(h>>32)!=_checksum(_base+offset+_header_size, size-_header_size))
+        break;
+      offset+=size;
+    }
+    _tail=_durable=_scanned=_wanted=offset;
+    lsn_t boundary=page_round_up((size_t) offset);
+    if(boundary>_capacity)
+      boundary=_capacity;
+    memset(_base+offset, 0, (size_t)(boundary-offset));
+    if(boundary<_capacity)
+    {
+      allocation::map_t d(_m.offset+(size_type) boundary, (size_type)(_capacity-boundary));
+      d.addr=_base+boundary;
+      _a->destroy(d);
+    }
+  }
+public:
+  /*! \brief Opens a journal over the whole of allocation \em a, recovering any records already in
+  it. \em fd is the file backing \em a, used to make records durable with fdatasync(), or -1 to
+  use msync() instead. A committer thread is started.
+  */
+  static expected<pointer, error_code> make(source::pointer a, native_handle_type fd, config_t config=config_t()) BOOST_NOEXCEPT
+  {
+    if(!a || a->size()<_header_size)
+      return make_unexpected(error_code(EINVAL, std::system_category()));
+    pointer ret;
+    try
+    {
+      ret=pointer(new journal(std::move(config)));
+    }
+    catch(...)
+    {
+      return make_unexpected(error_code(ENOMEM, std::system_category()));
+    }
+    ret->_a=std::move(a);
+    ret->_m=ret->_a->map();
+    if(!ret->_m.addr)
+      return make_unexpected(ret->_m.ec);
+    ret->_fd=fd;
+    ret->_base=(char *) ret->_m.addr;
+    ret->_capacity=ret->_m.length & ~(size_type) 7;
+    ret->_recover();
+    try
+    {
+      journal *j=ret.get();
+      ret->_thread=thread([j]
+      {
+        unique_lock<mutex> g(j->_lock);
+        while(!j->_done)
+        {
+          // After a failed sync, retry no sooner than max_delay
+          j->_changed.wait_for(g, j->_config.max_delay, [j] { return j->_done || (j->_wanted>j->_durable.load(memory_order_relaxed) && !j->_ec); });
+          g.unlock();
+          j->commit();
+          g.lock();
+        }
+      });
+    }
+    catch(...)
+    {
+      return make_unexpected(error_code(EAGAIN, std::system_category()));
+    }
+    return ret;
+  }
+  //! \brief Opens a journal over allocation \em a from file source \em src
+  static expected<pointer, error_code> make(file_source &src, source::pointer a, config_t config=config_t()) BOOST_NOEXCEPT
+  {
+    return make(std::move(a), src.native_handle(), std::move(config));
+  }
+  journal(const journal &)=delete;
+  journal &operator=(const journal &)=delete;
+  //! \brief Stops the committer, making everything appended durable first
+  ~journal()
+  {
+    {
+      lock_guard<mutex> g(_lock);
+      _done=true;
+    }
+    _changed.notify_all();
+    if(_thread.joinable())
+      _thread.join();
+    if(_base)
+    {
+      commit();
+      _a->unmap(_m);
+    }
+  }
+
+  //! \brief The configuration of this journal
+  const config_t &config() const BOOST_NOEXCEPT { return _config; }
+  //! \brief The bytes of storage in the journal
+  lsn_t capacity() const BOOST_NOEXCEPT { return _capacity; }
+  //! \brief The LSN just past the last record reserved
+  lsn_t tail() const BOOST_NOEXCEPT { lsn_t t=_tail.load(memory_order_relaxed); return t<_capacity ? t : _capacity; }
+  //! \brief Every record before this LSN is durable
+  lsn_t durable() const BOOST_NOEXCEPT { return _durable.load(memory_order_acquire); }
+
+  /*! \brief Appends a record of \em bytes bytes, calling \em fill with a pointer to where its contents
+  go in the mapped file, and returns its LSN. Returns ENOSPC if the journal is full. \em fill must not throw.
+  */
+  template<class F> expected<lsn_t, error_code> append(size_type bytes, F &&fill) BOOST_NOEXCEPT
+  {
+    // Reject records which could never fit before reserving, so they don't use up the journal
+    if(bytes>0xffffffff || _record_size(bytes)>_capacity)
+      return make_unexpected(error_code(EMSGSIZE, std::system_category()));
+    const size_type size=_record_size(bytes);
+    lsn_t offset=_tail.fetch_add(size, memory_order_relaxed);
+    if(offset+size>_capacity)
+      return make_unexpected(error_code(ENOSPC, std::system_category()));
+    char *p=_base+offset+_header_size;
+    fill(p);
+    memset(p+bytes, 0, size-_header_size-bytes);
+    _header(offset)->store((uint64_t) _checksum(p, size-_header_size)<<32 | bytes, memory_order_release);
+    return offset+size;
+  }
+  //! \brief Appends a copy of \em bytes bytes at \em data, returning its LSN
+  expected<lsn_t, error_code> append(const void *data, size_type bytes) BOOST_NOEXCEPT
+  {
+    return append(bytes, [data, bytes](char *p) { memcpy(p, data, bytes); });
+  }
+
+  /*! \brief Blocks until every record up to \em lsn is durable, returning any error which prevented
+  it. Wakes the committer rather than waiting for config().max_delay.
+  */
+  error_code wait_durable(lsn_t lsn) BOOST_NOEXCEPT
+  {
+    if(_durable.load(memory_order_acquire)>=lsn)
+      return error_code();
+    unique_lock<mutex> g(_lock);
+    if(lsn>_wanted)
+      _wanted=lsn;
+    _changed.notify_all();
+    _committed.wait(g, [&] { return _durable.load(memory_order_relaxed)>=lsn || _ec || _done; });
+    if(_durable.load(memory_order_relaxed)>=lsn)
+      return error_code();
+    return _ec ? _ec : error_code(ECANCELED, std::system_category());
+  }
+  //! \brief Appends a copy of \em bytes bytes at \em data and waits until it is durable
+  expected<lsn_t, error_code> append_durable(const void *data, size_type bytes) BOOST_NOEXCEPT
+  {
+    auto ret(append(data, bytes));
+    if(ret)
+    {
+      error_code ec(wait_durable(*ret));
+      if(ec)
+        return make_unexpected(ec);
+    }
+    return ret;
+  }
+
+  /*! \brief Makes every record completely written so far durable with a single sync, and wakes
+  anyone waiting for them. The committer thread calls this, but it may be called directly.
+  Returns the durable LSN.
+  */
+  lsn_t commit() BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> c(_commit_lock);
+    lsn_t begin=_durable.load(memory_order_relaxed), end=_scanned;
+    while(size_type size=_published(end))
+      end+=size;
+    _scanned=end;
+    if(end==begin)
+      return end;
+    error_code ec(_sync(begin, end));
+    {
+      lock_guard<mutex> g(_lock);
+      if(ec)
+        _ec=ec;
+      else
+      {
+        _ec.clear();
+        _durable.store(end, memory_order_release);
+      }
+    }
+    _committed.notify_all();
+    return _durable.load(memory_order_relaxed);
+  }
+
+  /*! \brief Calls f(const char *data, size_type bytes) for every durable record in order. Records
+  remain valid for the lifetime of the journal.
+  */
+  template<class F> void for_each(F &&f) const
+  {
+    const lsn_t end=durable();
+    for(lsn_t offset=0; offset<end;)
+    {
+      size_type size=_published(offset);
+      f((const char *)(_base+offset+_header_size), (size_type)(uint32_t) _header(offset)->load(memory_order_relaxed));
+      offset+=size;
+    }
+  }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
@@ -30,9 +30,21 @@ DEALINGS IN THE SOFTWARE.
 */
 
 #include "config.hpp"
+#include <algorithm>
+#include <map>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+// Older glibc headers predate Linux 4.5
+#ifndef MADV_FREE
+#define MADV_FREE 8
+#endif
+#endif
 
 #ifdef BOOST_KERNELALLOC_NEED_DEFINE
 
+#include "page_size.hpp"
+
 /*! \file kernel_alloc.hpp
  * \brief Defines the functionality provided by Boost.KernelAlloc
  */
@@ -47,6 +59,342 @@ namespace detail
 
 class source;
 typedef std::shared_ptr<source> source_ptr;
+class allocation;
+
+/*! \struct allocation_tag
+ * \brief A small tag attributing allocations to a subsystem, so one source can be shared by many
+ * subsystems whilst still accounting for each separately.
+ * 
+ * A tag is either a small integer below user_tags chosen by the caller, or an interned string.
+ * Interned strings are given the tags from user_tags up to max_tags, so the two never collide.
+ * Tag zero means untagged, and is accounted like any other: every allocation is accounted under it
+ * from construction until it is given a tag.
+ */
+struct BOOST_KERNELALLOC_DECL allocation_tag
+{
+  //! \brief The maximum number of distinct tags
+  static BOOST_CONSTEXPR_OR_CONST unsigned short max_tags=256;
+  //! \brief The number of tags callers may choose as integers, the rest being for interned strings
+  static BOOST_CONSTEXPR_OR_CONST unsigned short user_tags=128;
+  //! \brief The value of this tag
+  unsigned short value;
+  //! \brief Constructs the untagged tag
+  BOOST_CONSTEXPR allocation_tag() : value(0) { }
+  //! \brief Constructs a tag from a small integer less than user_tags. Anything larger is untagged.
+  explicit BOOST_CONSTEXPR allocation_tag(unsigned short v) : value(v<user_tags ? v : 0) { }
+  /*! \brief Interns \em name, returning the same tag for the same string every time. If the table
+  is full, returns the untagged tag.
+  */
+  static allocation_tag intern(const char *name) BOOST_NOEXCEPT
+  {
+    _names_t &names=_names();
+    lock_guard<mutex> g(names.lock);
+    for(unsigned short n=user_tags; n<names.next; n++)
+      if(!strcmp(names.v[n].load(memory_order_relaxed), name))
+        return allocation_tag(n, _interned());
+    if(names.next>=max_tags)
+      return allocation_tag();
+    size_t len=strlen(name);
+    char *copy=(char *) malloc(len+1);
+    if(!copy)
+      return allocation_tag();
+    memcpy(copy, name, len+1);
+    names.v[names.next].store(copy, memory_order_release);
+    return allocation_tag(names.next++, _interned());
+  }
+  //! \brief The interned name of this tag, or null if it was not interned
+  const char *name() const BOOST_NOEXCEPT { return value<max_tags ? _names().v[value].load(memory_order_acquire) : nullptr; }
+  bool operator==(allocation_tag o) const BOOST_NOEXCEPT { return value==o.value; }
+  bool operator!=(allocation_tag o) const BOOST_NOEXCEPT { return value!=o.value; }
+
+  //! \brief Statistics for a tag at the time of snapshot()
+  struct statistics_t
+  {
+    unsigned short tag;         //!< The tag
+    const char *name;           //!< The interned name of the tag, or null
+    size_t live_bytes;          //!< The bytes allocated under this tag not yet freed
+    size_t peak_bytes;          //!< The highest live_bytes has ever been
+    size_t allocations;         //!< The allocations under this tag not yet freed
+    size_t total_allocations;   //!< The allocations ever made under this tag
+    size_t resident_bytes;      //!< The bytes of maps of allocations under this tag registered in this process
+  };
+  /*! \brief Returns the statistics of every tag ever used. Each counter is read atomically but the
+  set is not a consistent cut across counters, which is fine for attribution.
+  */
+  static std::vector<statistics_t> snapshot()
+  {
+    std::vector<statistics_t> ret;
+    for(unsigned short n=0; n<max_tags; n++)
+    {
+      const _counters_t &c=_counters()[n];
+      if(!c.total_allocations.load(memory_order_relaxed))
+        continue;
+      statistics_t s;
+      s.tag=n;
+      s.name=_names().v[n].load(memory_order_acquire);
+      s.live_bytes=c.live_bytes.load(memory_order_relaxed);
+      s.peak_bytes=c.peak_bytes.load(memory_order_relaxed);
+      s.allocations=c.allocations.load(memory_order_relaxed);
+      s.total_allocations=c.total_allocations.load(memory_order_relaxed);
+      s.resident_bytes=c.resident_bytes.load(memory_order_relaxed);
+      ret.push_back(s);
+    }
+    return ret;
+  }
+private:
+  friend class allocation;
+  struct _interned { };
+  BOOST_CONSTEXPR allocation_tag(unsigned short v, _interned) : value(v) { }
+  // Each tag's counters get their own cache line so subsystems on different cores don't contend
+  struct alignas(64) _counters_t
+  {
+    atomic<size_t> live_bytes, peak_bytes, allocations, total_allocations, resident_bytes;
+  };
+  struct _names_t
+  {
+    mutex lock;
+    unsigned short next;
+    atomic<const char *> v[max_tags];
+    _names_t() : next(user_tags) { for(auto &i : v) i.store(nullptr, memory_order_relaxed); }
+  };
+  static _counters_t *_counters() BOOST_NOEXCEPT
+  {
+    static _counters_t counters[max_tags];
+    return counters;
+  }
+  static _names_t &_names() BOOST_NOEXCEPT
+  {
+    static _names_t names;
+    return names;
+  }
+  void _add(size_t bytes) const BOOST_NOEXCEPT
+  {
+    _counters_t &c=_counters()[value];
+    size_t live=c.live_bytes.fetch_add(bytes, memory_order_relaxed)+bytes;
+    for(size_t peak=c.peak_bytes.load(memory_order_relaxed); peak<live && !c.peak_bytes.compare_exchange_weak(peak, live, memory_order_relaxed););
+    c.allocations.fetch_add(1, memory_order_relaxed);
+    c.total_allocations.fetch_add(1, memory_order_relaxed);
+  }
+  void _resize(size_t oldbytes, size_t newbytes) const BOOST_NOEXCEPT
+  {
+    _counters_t &c=_counters()[value];
+    size_t live=c.live_bytes.fetch_add(newbytes-oldbytes, memory_order_relaxed)+(newbytes-oldbytes);
+    for(size_t peak=c.peak_bytes.load(memory_order_relaxed); peak<live && !c.peak_bytes.compare_exchange_weak(peak, live, memory_order_relaxed););
+  }
+  void _remove(size_t bytes) const BOOST_NOEXCEPT
+  {
+    _counters_t &c=_counters()[value];
+    c.live_bytes.fetch_sub(bytes, memory_order_relaxed);
+    c.allocations.fetch_sub(1, memory_order_relaxed);
+  }
+  // Undoes _add() entirely, for an allocation tagged straight after construction
+  void _withdraw(size_t bytes) const BOOST_NOEXCEPT
+  {
+    _remove(bytes);
+    _counters()[value].total_allocations.fetch_sub(1, memory_order_relaxed);
+  }
+  void _mapped(size_t bytes, bool mapped) const BOOST_NOEXCEPT
+  {
+    _counters_t &c=_counters()[value];
+    if(mapped)
+      c.resident_bytes.fetch_add(bytes, memory_order_relaxed);
+    else
+      c.resident_bytes.fetch_sub(bytes, memory_order_relaxed);
+  }
+};
+
+/*! \class map_batch
+ * \brief A compact batch of ranges of one allocation to map, unmap, discard or destroy in a single call.
+ * 
+ * A batch of allocation::map_t spends forty bytes per range, mostly on an error_code which is
+ * almost always empty. A map_batch keeps the offsets and lengths in two parallel arrays, sixteen
+ * bytes per range, with addresses kept only once mapped and errors kept in a sparse side table of
+ * (index, error) pairs in index order. Loops over the plain arrays, such as bytes() and the
+ * conversions done by the default batch implementations in allocation, vectorise.
+ * 
+ * Ranges of an allocation mapped once in whole, as nonpersistent allocations are, need no
+ * addresses: set_base() with the whole map and each range's address is computed from its offset.
+ */
+class map_batch
+{
+public:
+  //! \brief A pointer to a map
+  typedef void *pointer;
+  //! \brief A size_t
+  typedef size_t size_type;
+  //! \brief An entry of the error side table
+  typedef std::pair<size_type, error_code> error_entry;
+private:
+  std::vector<size_type> _offsets, _lengths;
+  std::vector<pointer> _addrs;
+  std::vector<error_entry> _errors;
+  pointer _base;
+  size_type _base_offset;
+public:
+  //! \brief Constructs an empty batch
+  map_batch() BOOST_NOEXCEPT : _base(nullptr), _base_offset(0) { }
+  
+  //! \brief Reserves space for \em no ranges
+  void reserve(size_type no) { _offsets.reserve(no); _lengths.reserve(no); }
+  //! \brief Adds the range of \em length bytes at \em offset
+  void push_back(size_type offset, size_type length) { _offsets.push_back(offset); _lengths.push_back(length); }
+  //! \brief Removes all ranges, addresses and errors
+  void clear() BOOST_NOEXCEPT { _offsets.clear(); _lengths.clear(); _addrs.clear(); _errors.clear(); }
+  //! \brief The number of ranges
+  size_type size() const BOOST_NOEXCEPT { return _offsets.size(); }
+  //! \brief True if there are no ranges
+  bool empty() const BOOST_NOEXCEPT { return _offsets.empty(); }
+  //! \brief The array of offsets
+  size_type *offsets() BOOST_NOEXCEPT { return _offsets.data(); }
+  const size_type *offsets() const BOOST_NOEXCEPT { return _offsets.data(); }
+  //! \brief The array of lengths
+  size_type *lengths() BOOST_NOEXCEPT { return _lengths.data(); }
+  const size_type *lengths() const BOOST_NOEXCEPT { return _lengths.data(); }
+  //! \brief The total length of all the ranges
+  size_type bytes() const BOOST_NOEXCEPT
+  {
+    size_type ret=0;
+    const size_type *l=_lengths.data();
+    for(size_type n=0, no=_lengths.size(); n<no; n++)
+      ret+=l[n];
+    return ret;
+  }
+  
+  //! \brief Sets the address at which offset \em offset of the allocation is mapped, from which the addresses of unmapped ranges are computed
+  void set_base(pointer addr, size_type offset=0) BOOST_NOEXCEPT { _base=addr; _base_offset=offset; }
+  //! \brief The address of range \em n, either as mapped or as computed from the base, or null if neither is known
+  pointer address(size_type n) const BOOST_NOEXCEPT
+  {
+    if(!_addrs.empty())
+      return _addrs[n];
+    return _base ? (char *) _base+(_offsets[n]-_base_offset) : nullptr;
+  }
+  //! \brief Records that range \em n was mapped at \em addr, allocating the address array on first use
+  void set_address(size_type n, pointer addr)
+  {
+    if(_addrs.empty())
+    {
+      _addrs.resize(_offsets.size());
+      for(size_type i=0; i<_offsets.size(); i++)
+        _addrs[i]=_base ? (char *) _base+(_offsets[i]-_base_offset) : nullptr;
+    }
+    _addrs[n]=addr;
+  }
+  
+  //! \brief The sparse table of errors, one entry per range which failed, in index order
+  const std::vector<error_entry> &errors() const BOOST_NOEXCEPT { return _errors; }
+  //! \brief The error for range \em n, empty if it succeeded
+  error_code error(size_type n) const BOOST_NOEXCEPT
+  {
+    auto it=std::lower_bound(_errors.begin(), _errors.end(), n, [](const error_entry &e, size_type i) { return e.first<i; });
+    return (it!=_errors.end() && it->first==n) ? it->second : error_code();
+  }
+  //! \brief Records an error for range \em n. Errors must be recorded in index order.
+  void set_error(size_type n, error_code ec) { _errors.push_back(error_entry(n, ec)); }
+  //! \brief Forgets all errors
+  void clear_errors() BOOST_NOEXCEPT { _errors.clear(); }
+  
+  /*! \brief Sorts the ranges by offset and merges any which overlap or abut, returning how many
+  ranges were removed. Cuts the syscalls of discarding many small neighbouring ranges. Addresses
+  and errors are forgotten.
+   */
+  size_type coalesce()
+  {
+    const size_type no=_offsets.size();
+    std::vector<std::pair<size_type, size_type>> r(no);
+    for(size_type n=0; n<no; n++)
+      r[n]=std::make_pair(_offsets[n], _lengths[n]);
+    std::sort(r.begin(), r.end());
+    size_type out=0;
+    for(size_type n=0; n<no; n++)
+    {
+      if(out && r[n].first<=_offsets[out-1]+_lengths[out-1])
+      {
+        size_type end=r[n].first+r[n].second;
+        if(end>_offsets[out-1]+_lengths[out-1])
+          _lengths[out-1]=end-_offsets[out-1];
+        continue;
+      }
+      _offsets[out]=r[n].first;
+      _lengths[out]=r[n].second;
+      ++out;
+    }
+    _offsets.resize(out);
+    _lengths.resize(out);
+    _addrs.clear();
+    _errors.clear();
+    return no-out;
+  }
+};
+
+namespace detail
+{
+  // A set of disjoint [begin, end) ranges kept sorted, for the known zero ranges of an allocation
+  class range_set
+  {
+    std::vector<std::pair<size_t, size_t>> _ranges;
+  public:
+    bool empty() const BOOST_NOEXCEPT { return _ranges.empty(); }
+    void clear() BOOST_NOEXCEPT { _ranges.clear(); }
+    bool contains(size_t begin, size_t end) const BOOST_NOEXCEPT
+    {
+      if(begin>=end)
+        return true;
+      auto it=std::upper_bound(_ranges.begin(), _ranges.end(), std::make_pair(begin, (size_t) -1));
+      return it!=_ranges.begin() && (--it)->second>=end;
+    }
+    void add(size_t begin, size_t end)
+    {
+      if(begin>=end)
+        return;
+      // Find every range overlapping or touching [begin, end) and replace them all with their union
+      auto first=std::lower_bound(_ranges.begin(), _ranges.end(), begin, [](const std::pair<size_t, size_t> &r, size_t b) { return r.second<b; });
+      auto last=first;
+      while(last!=_ranges.end() && last->first<=end)
+      {
+        begin=std::min(begin, last->first);
+        end=std::max(end, last->second);
+        ++last;
+      }
+      if(first==last)
+        _ranges.insert(first, std::make_pair(begin, end));
+      else
+      {
+        *first=std::make_pair(begin, end);
+        _ranges.erase(first+1, last);
+      }
+    }
+    void remove(size_t begin, size_t end)
+    {
+      if(begin>=end)
+        return;
+      std::vector<std::pair<size_t, size_t>> out;
+      out.reserve(_ranges.size()+1);
+      for(auto &r : _ranges)
+      {
+        if(r.second<=begin || r.first>=end)
+          out.push_back(r);
+        else
+        {
+          if(r.first<begin)
+            out.push_back(std::make_pair(r.first, begin));
+          if(r.second>end)
+            out.push_back(std::make_pair(end, r.second));
+        }
+      }
+      _ranges.swap(out);
+    }
+  };
+}
+
+/*! \brief How allocation::discard() gives memory back to the kernel
+ */
+enum class discard_policy
+{
+  source_default,   //!< As the source's lazy_discard flag says
+  immediate,        //!< The source's own discard, on Linux MADV_DONTNEED: pages go at once and refault as zero
+  lazy              //!< MADV_FREE: pages go only if the kernel needs them, reading back as zero if it took them and unchanged if not
+};
 
 /*! \class allocation
  * \brief An allocation of memory in the kernel.
@@ -80,25 +428,227 @@ public:
     map_t(size_type _offset, size_type _length) : addr(nullptr), offset(_offset), length(_length) { }
   };
 private:
+  friend class source;
   source *_source;
+  allocation_tag _tag;
+  bool _tagged;
+  size_type _tagged_bytes;
+  mutable mutex _zero_lock;
+  detail::range_set _zero;
+  mutable mutex _maps_lock;
+  std::vector<map_t> _maps;
+  // Runs a batch through op in chunks of map_t, so sources without a native batch implementation still accept one
+  size_type _batch(map_batch &b, size_type (allocation::*op)(map_t *, size_type), bool mapping) BOOST_NOEXCEPT
+  {
+    static BOOST_CONSTEXPR_OR_CONST size_type chunk_size=256;
+    map_t chunk[chunk_size];
+    size_type ret=0;
+    const size_type *offsets=b.offsets(), *lengths=b.lengths();
+    try
+    {
+      for(size_type i=0, no=b.size(); i<no; i+=chunk_size)
+      {
+        const size_type n=(no-i<chunk_size) ? no-i : chunk_size;
+        for(size_type j=0; j<n; j++)
+        {
+          chunk[j].offset=offsets[i+j];
+          chunk[j].length=lengths[i+j];
+          chunk[j].addr=mapping ? nullptr : b.address(i+j);
+          chunk[j].ec.clear();
+        }
+        ret+=(this->*op)(chunk, n);
+        for(size_type j=0; j<n; j++)
+        {
+          if(mapping && chunk[j].addr)
+            b.set_address(i+j, chunk[j].addr);
+          if(chunk[j].ec)
+            b.set_error(i+j, chunk[j].ec);
+        }
+      }
+    }
+    catch(...)
+    {
+    }
+    return ret;
+  }
+  void _set_tag(allocation_tag tag) BOOST_NOEXCEPT
+  {
+    // Under the maps lock so the resident bytes of any maps move to the new tag in step with them
+    lock_guard<mutex> g(_maps_lock);
+    size_type resident=0;
+    for(auto &m : _maps)
+      resident+=m.length;
+    // The first tag given takes over the untagged accounting made on construction
+    if(_tagged)
+      _tag._remove(_tagged_bytes);
+    else
+      _tag._withdraw(_tagged_bytes);
+    _tag._mapped(resident, false);
+    _tag=tag;
+    _tagged=true;
+    _tagged_bytes=_size;
+    _tag._add(_tagged_bytes);
+    _tag._mapped(resident, true);
+  }
+  // Called by source::_register_map() and source::_register_unmap()
+  void _map_registered(const map_t &m)
+  {
+    touch();
+    // Writes through a map cannot be seen, so a writable map counts as written from the start
+    mark_written(m.offset, m.length);
+    lock_guard<mutex> g(_maps_lock);
+    _maps.push_back(m);
+    _tag._mapped(m.length, true);
+  }
+  void _map_unregistered(const map_t &m) BOOST_NOEXCEPT
+  {
+    touch();
+    lock_guard<mutex> g(_maps_lock);
+    for(auto it=_maps.begin(); it!=_maps.end(); ++it)
+      if(it->addr==m.addr)
+      {
+        _tag._mapped(it->length, false);
+        _maps.erase(it);
+        break;
+      }
+  }
 protected:
   size_type _size, _actualsize;
-  allocation(source *p, size_type size) : _source(p), _size(size) { }
+  atomic<chrono::steady_clock::rep> _last_used;
+  // Marks the allocation known zero if its source's fresh_allocations_zero() is true
+  allocation(source *p, size_type size);
+  //! \brief Sources call this after a relocating resize() so the tag accounting follows the new size.
+  void _tag_resized() BOOST_NOEXCEPT
+  {
+    if(_tagged_bytes!=_size)
+    {
+      _tag._resize(_tagged_bytes, _size);
+      _tagged_bytes=_size;
+    }
+  }
+  /*! \brief Sources call this after destroy(), and for fresh allocations if their
+  fresh_allocations_zero() is false but they know some ranges read as zero, so
+  ensure_zero() can skip clearing them. Whole pages discarded by a source whose discard_zeroes()
+  is true are marked by discard() with a policy, and lazy discards change nothing.
+  */
+  void _mark_zero(size_type offset, size_type length) BOOST_NOEXCEPT { mark_zero(offset, length); }
+  // Marks the whole pages of m known zero after a successful discard by a source whose discard zeroes
+  void _discarded_zero(const map_t &m) BOOST_NOEXCEPT;
+  // Clears mapped m, with destroy() if large, then forgets it is zero as it is being handed out for writing
+  void _clear(map_t &m) BOOST_NOEXCEPT
+  {
+    if(m.length<destroy_threshold || !destroy(m))
+      memset(m.addr, 0, m.length);
+    m.ec.clear();
+    mark_written(m.offset, m.length);
+  }
 public:
-  virtual ~allocation() {}
+  virtual ~allocation();
   
 
   //! \brief The source for this allocation
   source *source() const BOOST_NOEXCEPT { return _source; }
   
+  /*! \name allocation_known_zero
+   * \brief Tracks which ranges of the allocation are known to read as zero.
+   * 
+   * A range is known zero from when it was freshly allocated by a source whose
+   * fresh_allocations_zero() is true, destroyed, or discarded by a source whose discard zeroes,
+   * until it is mapped, handed out for writing by ensure_zero() or allocate_zeroed(), or
+   * mark_written() is called. The library cannot see writes through a map, so it takes mapping
+   * as the first write, and a range mapped and unmapped unwritten costs one needless clear. For
+   * the same reason code writing through a map it already holds after discarding or destroying
+   * it must call mark_written() first or ensure_zero() will trust stale knowledge.
+   */
+  //@{
+  //! \brief Records that the \em length bytes at \em offset read as zero
+  void mark_zero(size_type offset, size_type length) BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> g(_zero_lock);
+    try
+    {
+      _zero.add(offset, offset+length);
+    }
+    catch(...)
+    {
+      // Forgetting is always safe
+    }
+  }
+  //! \brief Records that the \em length bytes at \em offset may no longer be zero
+  void mark_written(size_type offset, size_type length) BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> g(_zero_lock);
+    try
+    {
+      _zero.remove(offset, offset+length);
+    }
+    catch(...)
+    {
+      _zero.clear();
+    }
+  }
+  //! \brief True if the \em length bytes at \em offset are known to read as zero
+  bool is_known_zero(size_type offset, size_type length) const BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> g(_zero_lock);
+    return _zero.contains(offset, offset+length);
+  }
+  //! \brief Maps above this size are zeroed with destroy() rather than memset() by ensure_zero()
+  static BOOST_CONSTEXPR_OR_CONST size_type destroy_threshold=256*1024;
+  /*! \brief Makes mapped \em m read as zero, returning the bytes which had to be cleared, which is
+  zero if they were all known zero already. Otherwise small maps are cleared with memset(), and
+  large ones with destroy() which lets the source swap in fresh zero pages instead of writing
+  every byte, falling back to memset() if it fails. Either way \em m is then handed out for
+  writing, so no longer known zero.
+  */
+  expected<size_type, error_code> ensure_zero(map_t &m) BOOST_NOEXCEPT
+  {
+    if(!m.addr)
+      return make_unexpected(error_code(EINVAL, std::system_category()));
+    if(is_known_zero(m.offset, m.length))
+    {
+      mark_written(m.offset, m.length);
+      return 0;
+    }
+    // Forgotten after clearing, as destroy() marks what it clears known zero again
+    _clear(m);
+    return m.length;
+  }
+  //@}
+  
   //! \brief The size of the allocation
   size_type size() const BOOST_NOEXCEPT { return _size; }
   
   //! \brief The actual size of the allocation, you can resize to this without relocation.
   size_type actual_size() const BOOST_NOEXCEPT { return _actualsize; }
   
-  //! \brief The maps of this allocation into the current process
-  std::vector<map_t> maps() const BOOST_NOEXCEPT;
+  //! \brief The tag this allocation is accounted under
+  allocation_tag tag() const BOOST_NOEXCEPT { return _tag; }
+  
+  //! \brief When this allocation was last mapped or touched, used to estimate how idle it is.
+  chrono::steady_clock::time_point last_used() const BOOST_NOEXCEPT
+  {
+    return chrono::steady_clock::time_point(chrono::steady_clock::duration(_last_used.load(memory_order_relaxed)));
+  }
+  
+  /*! \brief Marks this allocation as just used. Every map and unmap registered by its source does
+  this, so call it only to mark use of maps held for a long time.
+  */
+  void touch() BOOST_NOEXCEPT { _last_used.store(chrono::steady_clock::now().time_since_epoch().count(), memory_order_relaxed); }
+  
+  //! \brief The maps of this allocation into the current process, as registered by its source
+  std::vector<map_t> maps() const BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> g(_maps_lock);
+    try
+    {
+      return _maps;
+    }
+    catch(...)
+    {
+      return std::vector<map_t>();
+    }
+  }
   
   //! \brief Tries to resize the allocation to \em newsize without relocation (and therefore maps are not disturbed), returning true if successful.
   virtual bool try_resize(size_type newsize) BOOST_NOEXCEPT
@@ -106,6 +656,7 @@ public:
     if(newsize<=_actualsize)
     {
       _size=newsize;
+      _tag_resized();
       return true;
     }
     return false;
@@ -141,6 +692,11 @@ public:
   {
     return map(c.data(), c.size());
   }
+  //! \brief Maps every range of a batch, recording their addresses in it, returning how many succeeded. Errors go in the batch's side table. Sources may override this with a native batch implementation.
+  virtual size_type map(map_batch &b) BOOST_NOEXCEPT
+  {
+    return _batch(b, static_cast<size_type (allocation::*)(map_t *, size_type)>(&allocation::map), true);
+  }
   //! \brief Maps all of the allocation into the calling process
   map_t map() BOOST_NOEXCEPT
   {
@@ -183,6 +739,11 @@ public:
   {
     return map_prefault(c.data(), c.size());
   }
+  //! \brief Maps and prefaults every range of a batch, recording their addresses in it, returning how many succeeded. Errors go in the batch's side table. Sources may override this with a native batch implementation.
+  virtual size_type map_prefault(map_batch &b) BOOST_NOEXCEPT
+  {
+    return _batch(b, static_cast<size_type (allocation::*)(map_t *, size_type)>(&allocation::map_prefault), true);
+  }
   //! \brief Maps all of the allocation into the calling process
   map_t map_prefault() BOOST_NOEXCEPT
   {
@@ -218,6 +779,11 @@ public:
   {
     return unmap(c.data(), c.size());
   }
+  //! \brief Unmaps every range of a batch, returning how many succeeded. Errors go in the batch's side table. Sources may override this with a native batch implementation.
+  virtual size_type unmap(map_batch &b) BOOST_NOEXCEPT
+  {
+    return _batch(b, static_cast<size_type (allocation::*)(map_t *, size_type)>(&allocation::unmap), false);
+  }
   //@}
   
   /*! \name allocation_discard
@@ -233,6 +799,10 @@ public:
    */
   //@{
   virtual size_type discard(map_t *m, size_type no) BOOST_NOEXCEPT=0;
+  /*! \brief True if the whole pages of a successful discard() are guaranteed to then read as zero,
+  as with MADV_DONTNEED on private anonymous memory, so discard() with a policy marks them known zero.
+  */
+  virtual bool discard_zeroes() const BOOST_NOEXCEPT { return false; }
   //! \brief Optimisation for a single map_t
   bool discard(map_t &m) BOOST_NOEXCEPT { return 1==discard(&m, 1); }
   //! \brief For a range of dereferenceable pointers or iterators
@@ -253,6 +823,41 @@ public:
   {
     return discard(c.data(), c.size());
   }
+  //! \brief Discards every range of a batch, returning how many succeeded. Errors go in the batch's side table. Sources may override this with a native batch implementation.
+  virtual size_type discard(map_batch &b) BOOST_NOEXCEPT
+  {
+    return _batch(b, static_cast<size_type (allocation::*)(map_t *, size_type)>(&allocation::discard), false);
+  }
+  /*! \brief Discards with \em policy, returning how many maps were discarded.
+  
+  A lazy discard costs nothing while memory is plentiful, as the pages stay in place until the
+  kernel wants them and writing to a page cancels its discard. Only the whole pages of anonymous
+  private maps can be lazily discarded: the partial pages at either end keep their contents, and
+  other maps, or kernels without MADV_FREE, get the source's own discard instead. If \em lazily is
+  not null, lazily[n] is set to whether map n was lazily discarded. For those which were,
+  reclaimed() tells how much the kernel has since taken, and zero_unreclaimed() zeroes only what it
+  did not.
+  */
+  size_type discard(map_t *m, size_type no, discard_policy policy, bool *lazily=nullptr) BOOST_NOEXCEPT;
+  //! \brief Optimisation for a single map_t
+  bool discard(map_t &m, discard_policy policy, bool *lazily=nullptr) BOOST_NOEXCEPT { return 1==discard(&m, 1, policy, lazily); }
+  
+  //! \brief The whole pages of a map, and how many of them the kernel has reclaimed since a lazy discard
+  struct reclaim_t
+  {
+    size_type pages;      //!< Whole pages in the map
+    size_type reclaimed;  //!< Pages no longer resident, which read back as zero
+  };
+  /*! \brief Counts the pages of \em m the kernel has reclaimed since it was lazily discarded, using
+  mincore(). Only meaningful for maps lazily discarded and not written since.
+  */
+  static expected<reclaim_t, error_code> reclaimed(const map_t &m) BOOST_NOEXCEPT;
+  /*! \brief Makes all of lazily discarded \em m read as zero by zeroing only the pages the kernel did
+  not reclaim, and the partial pages at its ends, returning the bytes zeroed. When the kernel took
+  everything nothing is written, so nothing is faulted back in. Only valid for maps lazily
+  discarded and not written since.
+  */
+  static expected<size_type, error_code> zero_unreclaimed(const map_t &m) BOOST_NOEXCEPT;
   //@}
 
   /*! \name allocation_destroy
@@ -285,10 +890,213 @@ public:
   {
     return destroy(c.data(), c.size());
   }
+  //! \brief Destroys every range of a batch, returning how many succeeded. Errors go in the batch's side table. Sources may override this with a native batch implementation.
+  virtual size_type destroy(map_batch &b) BOOST_NOEXCEPT
+  {
+    return _batch(b, static_cast<size_type (allocation::*)(map_t *, size_type)>(&allocation::destroy), false);
+  }
   //@}
 
 };
 
+namespace detail
+{
+  /* A per thread cache of the last few ranges found by source::locate_addr(), so repeated lookups
+  into the same maps cost a few compares and touch no shared memory.
+  
+  Every unmap of a registered map bumps a global generation and records the range unmapped in a
+  small ring indexed by generation, each slot published seqlock style. A thread whose cache is
+  behind the global generation replays the ring since it last looked, dropping only the entries
+  which overlap a range unmapped, so frees elsewhere don't flush it. If it fell too far behind, or
+  a slot was overwritten or half written, it drops everything. While nothing is unmapped the check
+  is one load of a cache line which is only ever read.
+  
+  Entries hold weak pointers, so a hit on an allocation freed since can never be dereferenced.
+  */
+  struct locate_cache
+  {
+    static BOOST_CONSTEXPR_OR_CONST size_t entries=4, log_size=64;
+    struct stats_t
+    {
+      unsigned long long hits;      //!< Lookups answered from the cache
+      unsigned long long misses;    //!< Lookups which went to locate_addr()
+      unsigned long long flushes;   //!< Times the whole cache was dropped
+    };
+    typedef std::tuple<source_ptr, std::shared_ptr<allocation>, allocation::map_t> result_t;
+    struct entry_t
+    {
+      const char *begin, *end;
+      std::weak_ptr<source> src;
+      std::weak_ptr<allocation> alloc;
+      allocation::map_t map;
+    };
+    
+    static void unmapped(const void *addr, size_t length) BOOST_NOEXCEPT
+    {
+      shared_t &sh=_shared();
+      unsigned long long g=sh.generation.fetch_add(1, memory_order_acq_rel)+1;
+      slot_t &slot=sh.log[g % log_size];
+      slot.generation.store(0, memory_order_relaxed);
+      atomic_thread_fence(memory_order_release);
+      slot.begin.store((size_t) addr, memory_order_relaxed);
+      slot.end.store((size_t) addr+length, memory_order_relaxed);
+      slot.generation.store(g, memory_order_release);
+    }
+    static locate_cache &mine() BOOST_NOEXCEPT
+    {
+      static thread_local locate_cache c;
+      return c;
+    }
+    
+    // Fills ret from the entry containing addr if its allocation still lives, else counts a miss
+    bool find(const void *addr, result_t &ret) BOOST_NOEXCEPT
+    {
+      _sync();
+      const char *p=(const char *) addr;
+      for(size_t n=0; n<_count; n++)
+        if(p>=_entry[n].begin && p<_entry[n].end)
+        {
+          std::shared_ptr<allocation> a(_entry[n].alloc.lock());
+          if(!a)
+          {
+            _drop(n);
+            break;
+          }
+          ret=result_t(_entry[n].src.lock(), std::move(a), _entry[n].map);
+          ++_stats.hits;
+          return true;
+        }
+      ++_stats.misses;
+      return false;
+    }
+    // The generation this cache is valid for. Only insert results looked up while it was current.
+    unsigned long long generation() const BOOST_NOEXCEPT { return _generation; }
+    bool current(unsigned long long g) const BOOST_NOEXCEPT { return _shared().generation.load(memory_order_acquire)==g; }
+    void insert(const result_t &found) BOOST_NOEXCEPT
+    {
+      const allocation::map_t &map=std::get<2>(found);
+      entry_t &e=_entry[_next++ % entries];
+      e.begin=(const char *) map.addr;
+      e.end=e.begin+map.length;
+      e.src=std::get<0>(found);
+      e.alloc=std::get<1>(found);
+      e.map=map;
+      if(_count<entries)
+        ++_count;
+    }
+    const stats_t &stats() const BOOST_NOEXCEPT { return _stats; }
+  private:
+    struct slot_t
+    {
+      atomic<unsigned long long> generation;
+      atomic<size_t> begin, end;
+    };
+    struct shared_t
+    {
+      alignas(64) atomic<unsigned long long> generation;
+      alignas(64) slot_t log[log_size];
+      shared_t() : generation(0)
+      {
+        for(size_t n=0; n<log_size; n++)
+          log[n].generation.store(0, memory_order_relaxed);
+      }
+    };
+    static shared_t &_shared() BOOST_NOEXCEPT
+    {
+      static shared_t s;
+      return s;
+    }
+    entry_t _entry[entries];
+    size_t _count, _next;
+    unsigned long long _generation;
+    stats_t _stats;
+    
+    locate_cache() BOOST_NOEXCEPT : _count(0), _next(0), _generation(_shared().generation.load(memory_order_acquire))
+    {
+      _stats.hits=_stats.misses=_stats.flushes=0;
+    }
+    void _drop(size_t n) BOOST_NOEXCEPT
+    {
+      if(n!=--_count)
+        _entry[n]=std::move(_entry[_count]);
+      _entry[_count].src.reset();
+      _entry[_count].alloc.reset();
+    }
+    void _flush(unsigned long long g) BOOST_NOEXCEPT
+    {
+      if(_count)
+        ++_stats.flushes;
+      while(_count)
+        _drop(_count-1);
+      _generation=g;
+    }
+    void _sync() BOOST_NOEXCEPT
+    {
+      shared_t &sh=_shared();
+      const unsigned long long g=sh.generation.load(memory_order_acquire);
+      if(g==_generation)
+        return;
+      if(!_count || g-_generation>log_size)
+        return _flush(g);
+      for(unsigned long long k=_generation+1; k<=g; k++)
+      {
+        slot_t &slot=sh.log[k % log_size];
+        unsigned long long g1=slot.generation.load(memory_order_acquire);
+        const char *b=(const char *) slot.begin.load(memory_order_relaxed), *e=(const char *) slot.end.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if(g1!=k || slot.generation.load(memory_order_relaxed)!=k)
+          return _flush(g);
+        for(size_t n=0; n<_count; )
+          if(_entry[n].begin<e && b<_entry[n].end)
+            _drop(n);
+          else
+            ++n;
+      }
+      _generation=g;
+    }
+  };
+  
+  /* Every map registered by a source, keyed by address, for source::locate_addr(). Entries hold
+  plain pointers, only dereferenced under the lock, and are removed by source::_register_unmap()
+  or at the latest by ~allocation(), so an allocation being destroyed is found but fails
+  shared_from_this() and one destroyed is not found at all.
+  */
+  class map_registry
+  {
+  public:
+    struct entry_t
+    {
+      const char *end;
+      source *src;
+      allocation *alloc;
+      allocation::map_t map;
+    };
+    mutex lock;
+    std::map<const char *, entry_t> maps;
+    
+    static map_registry &get() BOOST_NOEXCEPT
+    {
+      static map_registry r;
+      return r;
+    }
+    void add(source *src, allocation *alloc, const allocation::map_t &map)
+    {
+      entry_t e;
+      e.end=(const char *) map.addr+map.length;
+      e.src=src;
+      e.alloc=alloc;
+      e.map=map;
+      lock_guard<mutex> g(lock);
+      maps[(const char *) map.addr]=e;
+    }
+    void remove(const void *addr) BOOST_NOEXCEPT
+    {
+      lock_guard<mutex> g(lock);
+      maps.erase((const char *) addr);
+    }
+  };
+}
+
 /*! \class source
  * \brief A source of kernel memory
  * 
@@ -321,18 +1129,27 @@ public:
     discard_on_free=1,          //!< Issue a discard() when an allocation is about to be freed
     destroy_on_free=2,          //!< Issue a destroy() when an allocation is about to be freed
     top_down=(1<<16),           //!< Allocate from the top of memory going downwards (e.g. stacks)
-    large_pages=(1<<17)         //!< Use large TLB entries where possible.
+    large_pages=(1<<17),        //!< Use large TLB entries where possible.
+    hugetlbfs_2mb=(1<<18),      //!< Reserved for persistent and file sources storing in a 2Mb page hugetlbfs mount. Not yet honoured (see hugetlbfs.hpp)
+    hugetlbfs_1gb=(1<<19),      //!< Reserved for persistent and file sources storing in a 1Gb page hugetlbfs mount. Not yet honoured (see hugetlbfs.hpp)
+    lazy_discard=(1<<21)        //!< Discards with discard_policy::source_default are lazy, with MADV_FREE where possible
   };
 protected:
+  flags_t _flags;
   bool _using_remaining;
   size_type _maximum;
   atomic<size_type> _allocated, _remaining;
-  source(flags_t flags, size_type maximum, size_type remaining) : _using_remaining((remaining!=(size_type)-1)), _maximum(maximum), _remaining(remaining) { }
+  source(flags_t flags, size_type maximum, size_type remaining) : _flags(flags), _using_remaining((remaining!=(size_type)-1)), _maximum(maximum), _remaining(remaining) { }
   
+  //! \brief Sources call this for every map they hand out, so locate_addr() finds it and allocation::maps() lists it.
   void _register_map(allocation *a, allocation::map_t &map);
-  void _register_unmap(allocation *a, allocation::map_t &map);
+  //! \brief Sources call this for every map they unmap, before the range can be reused, so neither locate_addr() nor locate_addr_cached() can find it.
+  void _register_unmap(allocation *a, allocation::map_t &map) BOOST_NOEXCEPT;
 public:
   
+  //! \brief The flags this source was created with
+  flags_t flags() const BOOST_NOEXCEPT { return _flags; }
+  
   //! \brief The maximum amount of memory this source can allocate
   size_type maximum() const BOOST_NOEXCEPT { return _maximum; }
   
@@ -345,6 +1162,12 @@ public:
   //! \brief The name of this source, suitable for printing etc.
   virtual const char *name() BOOST_NOEXCEPT=0;
   
+  /*! \brief True if every allocation from this source starts out reading as zero, as fresh
+  anonymous memory does, so allocations record themselves known zero when constructed and
+  allocate_zeroed() need not clear them. False if allocations may reuse earlier contents.
+   */
+  virtual bool fresh_allocations_zero() const BOOST_NOEXCEPT { return false; }
+  
   /*! \brief Allocates at least \em bytes from the source.
    */
   virtual expected<pointer, error_code> allocate(size_type bytes) BOOST_NOEXCEPT=0;
@@ -353,11 +1176,275 @@ public:
    */
   virtual expected<std::vector<pointer>, error_code> allocate(size_type no, size_type *bytes) BOOST_NOEXCEPT=0;
   
+  /*! \brief Allocates at least \em bytes from the source, accounting the allocation under \em tag
+  for as long as it lives.
+   */
+  expected<pointer, error_code> allocate(size_type bytes, allocation_tag tag) BOOST_NOEXCEPT
+  {
+    auto ret(allocate(bytes));
+    if(ret)
+      (*ret)->_set_tag(tag);
+    return ret;
+  }
+  
+  /*! \brief Allocates a set of different sized allocations from the source in a single go, accounting
+  them all under \em tag.
+   */
+  expected<std::vector<pointer>, error_code> allocate(size_type no, size_type *bytes, allocation_tag tag) BOOST_NOEXCEPT
+  {
+    auto ret(allocate(no, bytes));
+    if(ret)
+      for(auto &a : *ret)
+        a->_set_tag(tag);
+    return ret;
+  }
+  
+  /*! \brief Allocates and maps at least \em bytes which read as zero, clearing them only if the
+  source could not vouch that they already do, for example if it recycled them.
+   */
+  expected<std::pair<pointer, allocation::map_t>, error_code> allocate_zeroed(size_type bytes) BOOST_NOEXCEPT
+  {
+    auto a(allocate(bytes));
+    if(!a)
+      return make_unexpected(a.error());
+    // Asked before mapping, as registering the map forgets what was known zero
+    const bool known=(*a)->is_known_zero(0, (*a)->size());
+    allocation::map_t m(0, (*a)->size());
+    if(!(*a)->map(m))
+      return make_unexpected(m.ec);
+    if(!known)
+      (*a)->_clear(m);
+    return std::make_pair(std::move(*a), m);
+  }
+  
   /*! \brief Returns the source and allocation associated with mapped address \em addr
    */
   static std::tuple<source_ptr, pointer, allocation::map_t> locate_addr(void *addr) BOOST_NOEXCEPT;
+  
+  /*! \brief As locate_addr(), but first asks a small per thread cache of recent results which
+  unmaps elsewhere only invalidate if they overlap. Lookups into the same few maps in a row, as
+  frees usually are, then cost a few compares.
+   */
+  static std::tuple<source_ptr, pointer, allocation::map_t> locate_addr_cached(void *addr) BOOST_NOEXCEPT
+  {
+    detail::locate_cache &c=detail::locate_cache::mine();
+    detail::locate_cache::result_t ret;
+    if(c.find(addr, ret))
+      return ret;
+    const unsigned long long g=c.generation();
+    ret=locate_addr(addr);
+    if(std::get<1>(ret) && c.current(g))
+      c.insert(ret);
+    return ret;
+  }
+  
+  //! \brief The statistics of this thread's locate_addr_cached() cache
+  static detail::locate_cache::stats_t locate_cache_stats() BOOST_NOEXCEPT { return detail::locate_cache::mine().stats(); }
 };
 
+inline allocation::allocation(class source *p, size_type size) : _source(p), _tagged(false), _tagged_bytes(size), _size(size), _last_used(chrono::steady_clock::now().time_since_epoch().count())
+{
+  _tag._add(_tagged_bytes);
+  if(p && p->fresh_allocations_zero())
+    mark_zero(0, size);
+}
+
+inline allocation::~allocation()
+{
+  // A source which left maps registered must not leave them findable once this is gone
+  for(auto &m : _maps)
+  {
+    detail::map_registry::get().remove(m.addr);
+    detail::locate_cache::unmapped(m.addr, m.length);
+    _tag._mapped(m.length, false);
+  }
+  _tag._remove(_tagged_bytes);
+}
+
+inline void source::_register_map(allocation *a, allocation::map_t &map)
+{
+  a->_map_registered(map);
+  try
+  {
+    detail::map_registry::get().add(this, a, map);
+  }
+  catch(...)
+  {
+    a->_map_unregistered(map);
+    throw;
+  }
+}
+
+inline void source::_register_unmap(allocation *a, allocation::map_t &map) BOOST_NOEXCEPT
+{
+  detail::map_registry::get().remove(map.addr);
+  // Only after it can no longer be found, so a lookup racing this can't cache what it found
+  detail::locate_cache::unmapped(map.addr, map.length);
+  a->_map_unregistered(map);
+}
+
+inline std::tuple<source_ptr, source::pointer, allocation::map_t> source::locate_addr(void *addr) BOOST_NOEXCEPT
+{
+  std::tuple<source_ptr, pointer, allocation::map_t> ret;
+  detail::map_registry &r=detail::map_registry::get();
+  lock_guard<mutex> g(r.lock);
+  auto it=r.maps.upper_bound((const char *) addr);
+  if(it==r.maps.begin() || (const char *) addr>=(--it)->second.end)
+    return ret;
+  try
+  {
+    std::get<1>(ret)=it->second.alloc->shared_from_this();
+  }
+  catch(...)
+  {
+    // Being destroyed
+    return ret;
+  }
+  try
+  {
+    std::get<0>(ret)=it->second.src->shared_from_this();
+  }
+  catch(...)
+  {
+    // A source not owned by a shared_ptr
+  }
+  std::get<2>(ret)=it->second.map;
+  return ret;
+}
+
+namespace detail
+{
+  // The whole pages within a map, as [begin, end)
+  inline std::pair<char *, char *> discard_whole_pages(const allocation::map_t &m) BOOST_NOEXCEPT
+  {
+    char *begin=(char *) page_round_up((size_t) m.addr), *end=(char *) page_round_down((size_t) m.addr+m.length);
+    return end>begin ? std::make_pair(begin, end) : std::make_pair(begin, begin);
+  }
+  inline bool discards_lazily(const source *s) BOOST_NOEXCEPT
+  {
+    return s && !!((int) s->flags() & (int) source::flags_t::lazy_discard);
+  }
+}
+
+inline allocation::size_type allocation::discard(map_t *m, size_type no, discard_policy policy, bool *lazily) BOOST_NOEXCEPT
+{
+  if(policy==discard_policy::source_default)
+    policy=detail::discards_lazily(_source) ? discard_policy::lazy : discard_policy::immediate;
+  if(lazily)
+    for(size_type n=0; n<no; n++)
+      lazily[n]=false;
+  if(policy==discard_policy::immediate)
+  {
+    size_type ret=discard(m, no);
+    if(discard_zeroes())
+      for(size_type n=0; n<no; n++)
+        _discarded_zero(m[n]);
+    return ret;
+  }
+  size_type ret=0;
+  for(size_type n=0; n<no; n++)
+  {
+#ifdef __linux__
+    auto pages(detail::discard_whole_pages(m[n]));
+    if(pages.first==pages.second)
+    {
+      ++ret;
+      if(lazily)
+        lazily[n]=true;
+      continue;
+    }
+    if(-1!=madvise(pages.first, pages.second-pages.first, MADV_FREE))
+    {
+      ++ret;
+      if(lazily)
+        lazily[n]=true;
+      continue;
+    }
+    // EINVAL means a shared or file backed map, or a kernel before 4.5
+    if(errno!=EINVAL)
+    {
+      m[n].ec=error_code(errno, std::system_category());
+      continue;
+    }
+#endif
+    if(discard(m+n, 1))
+    {
+      ++ret;
+      if(discard_zeroes())
+        _discarded_zero(m[n]);
+    }
+  }
+  return ret;
+}
+
+inline void allocation::_discarded_zero(const map_t &m) BOOST_NOEXCEPT
+{
+  if(!m.addr || m.ec)
+    return;
+  auto pages(detail::discard_whole_pages(m));
+  if(pages.second>pages.first)
+    _mark_zero(m.offset+(size_type)(pages.first-(char *) m.addr), (size_type)(pages.second-pages.first));
+}
+
+inline expected<allocation::reclaim_t, error_code> allocation::reclaimed(const map_t &m) BOOST_NOEXCEPT
+{
+  reclaim_t ret={ 0, 0 };
+#ifdef __linux__
+  auto pages(detail::discard_whole_pages(m));
+  const size_t page_bytes=page_size();
+  unsigned char vec[1024];
+  for(char *p=pages.first; p<pages.second; )
+  {
+    size_t no=std::min((size_t)(pages.second-p)/page_bytes, sizeof(vec));
+    if(-1==mincore(p, no*page_bytes, vec))
+      return make_unexpected(error_code(errno, std::system_category()));
+    for(size_t n=0; n<no; n++)
+      ret.reclaimed+=!(vec[n] & 1);
+    ret.pages+=no;
+    p+=no*page_bytes;
+  }
+  return ret;
+#else
+  (void) m;
+  return make_unexpected(error_code(ENOSYS, std::system_category()));
+#endif
+}
+
+inline expected<allocation::size_type, error_code> allocation::zero_unreclaimed(const map_t &m) BOOST_NOEXCEPT
+{
+  size_type ret=0;
+  auto pages(detail::discard_whole_pages(m));
+  char *begin=(char *) m.addr, *end=begin+m.length;
+  // The partial pages at the ends were never discarded
+  if(pages.first==pages.second)
+    pages=std::make_pair(end, end);
+  memset(begin, 0, pages.first-begin);
+  memset(pages.second, 0, end-pages.second);
+  ret+=(pages.first-begin)+(end-pages.second);
+#ifdef __linux__
+  const size_t page_bytes=page_size();
+  unsigned char vec[1024];
+  for(char *p=pages.first; p<pages.second; )
+  {
+    size_t no=std::min((size_t)(pages.second-p)/page_bytes, sizeof(vec));
+    if(-1==mincore(p, no*page_bytes, vec))
+      return make_unexpected(error_code(errno, std::system_category()));
+    // Pages the kernel took read as zero, and racing it here only means zeroing a fresh zero page
+    for(size_t n=0; n<no; n++)
+      if(vec[n] & 1)
+      {
+        memset(p+n*page_bytes, 0, page_bytes);
+        ret+=page_bytes;
+      }
+    p+=no*page_bytes;
+  }
+#else
+  memset(pages.first, 0, pages.second-pages.first);
+  ret+=pages.second-pages.first;
+#endif
+  return ret;
+}
+
 /*! \class nonpersistent_allocation
  * \brief An allocation of non persistent memory in the kernel.
  * 
@@ -381,6 +1468,10 @@ public:
   virtual size_type map_prefault(map_t *m, size_type no) BOOST_NOEXCEPT override final;
   virtual size_type unmap(map_t *m, size_type no) BOOST_NOEXCEPT override final;
   virtual size_type discard(map_t *m, size_type no) BOOST_NOEXCEPT override final;
+#ifdef __linux__
+  //! \brief Discard is MADV_DONTNEED on private anonymous memory, so discarded pages read as zero
+  virtual bool discard_zeroes() const BOOST_NOEXCEPT override final { return true; }
+#endif
   virtual size_type destroy(map_t *m, size_type no) BOOST_NOEXCEPT override final;
 };
 
@@ -394,6 +1485,7 @@ public:
   typedef rebind_pointer<nonpersistent_allocation> pointer;
   //! \brief A const pointer to an allocation
   typedef const pointer const_pointer;
+  using source::allocate;
   
   //! \brief Constructs a source of non persistent kernel memory.
   nonpersistent_source(flags_t flags=flags_t::normal, size_type maximum=(size_type)-1, size_type remaining=(size_type)-1) : source(flags, maximum, remaining) { }
@@ -401,6 +1493,9 @@ public:
   //! \brief The name of this source, suitable for printing etc.
   virtual const char *name() BOOST_NOEXCEPT override final { return "non-persistent"; }
   
+  //! \brief True, as fresh anonymous memory always reads as zero
+  virtual bool fresh_allocations_zero() const BOOST_NOEXCEPT override final { return true; }
+  
   /*! \brief Allocates at least \em bytes from the source.
    */
   virtual expected<pointer, error_code> allocate(size_type bytes) BOOST_NOEXCEPT override final;
@@ -436,6 +1531,7 @@ public:
   typedef rebind_pointer<opencl_allocation> pointer;
   //! \brief A const pointer to an allocation
   typedef const pointer const_pointer;
+  using source::allocate;
   
   //! \brief Constructs a source of non persistent kernel memory.
   opencl_source(flags_t flags=flags_t::normal, size_type maximum=(size_type)-1, size_type remaining=(size_type)-1) : source(flags, maximum, remaining) { }
@@ -474,6 +1570,12 @@ class BOOST_KERNELALLOC_DECL persistent_allocation : public allocation
 public:
   //! \brief The type of a unique allocation id
   typedef unsigned long long unique_id_t;
+  //! \brief A native handle type
+#ifdef WIN32
+  typedef void *native_handle_type;
+#else
+  typedef int native_handle_type;
+#endif
 protected:
   unique_id_t _unique_id;
   persistent_allocation(nonpersistent_source *p, size_type bytes);
@@ -495,6 +1597,9 @@ public:
 
 /*! \class persistent_source
  * \brief A persistent source of kernel memory, usually the temporary file system cache.
+ *
+ * The hugetlbfs_2mb and hugetlbfs_1gb flags are not yet honoured. To back a segment with huge
+ * pages, find a mount with find_hugetlbfs() and check the pool with check_hugepage_pool() yourself.
  */
 class BOOST_KERNELALLOC_DECL persistent_source : public source
 {
@@ -503,6 +1608,7 @@ public:
   typedef rebind_pointer<persistent_allocation> pointer;
   //! \brief A const pointer to an allocation
   typedef const pointer const_pointer;
+  using source::allocate;
   
   //! \brief Constructs a source of optionally named persistent kernel memory.
   persistent_source(path name=path(), flags_t flags=flags_t::normal, size_type maximum=(size_type)-1, size_type remaining=(size_type)-1) : source(maximum, remaining) { }
@@ -578,6 +1684,10 @@ public:
 
 /*! \class file_source
  * \brief A source of kernel memory stored in a file on the filing system.
+ *
+ * The hugetlbfs_2mb and hugetlbfs_1gb flags are not yet honoured. A file opened on a hugetlbfs
+ * mount is backed by huge pages regardless, in which case allocations should be huge page multiples
+ * and checked against the pool with check_hugepage_pool() first.
  */
 class BOOST_KERNELALLOC_DECL file_source : public source
 {
@@ -586,6 +1696,7 @@ public:
   typedef rebind_pointer<file_allocation> pointer;
   //! \brief A const pointer to an allocation
   typedef const pointer const_pointer;
+  using source::allocate;
   //! \brief A native handle type
 #ifdef WIN32
   typedef void *native_handle_type;
@@ -611,7 +1722,7 @@ public:
   
   //! \brief Detaches the native handle of the file backing this source from this source. The handle will no longer be used or closed on destruction.
   native_handle_type detach() BOOST_NOEXCEPT;
-  
+
   /*! \brief Returns the allocation associated with unique id \em id
    */
   std::pair<pointer, allocation::map_t> id_to_pointer(persistent_allocation::unique_id_t id, size_type size) BOOST_NOEXCEPT;
@@ -666,7 +1777,7 @@ public:
     source_ptr source_;
     typename source::pointer allocation_;
     allocation::map_t map_;
-    std::tie(source_, allocation_, map_)=source::locate_addr(p);
+    std::tie(source_, allocation_, map_)=source::locate_addr_cached(p);
     if(!allocation_) throw std::invalid_argument("Address not found");
     allocation_->unmap(map_);
     if(map_.ec) throw std::system_error(m.ec, "Failed to unmap allocation");
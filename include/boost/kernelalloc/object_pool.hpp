@@ -0,0 +1,346 @@
+/* object_pool.hpp
+Pools of constructed objects in slabs of allocations
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_OBJECT_POOL_HPP
+#define BOOST_KERNELALLOC_OBJECT_POOL_HPP
+
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <type_traits>
+
+/*! \file object_pool.hpp
+ * \brief Provides a lock free pool of objects kept constructed across reuse
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+/*! \class object_pool
+ * \brief A pool of T kept constructed in slabs allocated from a source, with lock free acquire and release.
+ *
+ * Objects are default constructed a slab at a time, and thereafter are handed out and taken back
+ * without being destroyed, so an object which is expensive to construct is only ever constructed
+ * once per slab. An optional reset hook is called on each object as it is released, to return it
+ * to a reusable state. Objects sit next to one another in each slab, so recently used objects
+ * tend to share cache lines and pages.
+ *
+ * Free objects are kept on a Treiber stack, so both acquire() and release() are a single
+ * compare and swap in the common case. The head of the stack packs a 32 bit object index with a
+ * 32 bit generation count to defeat ABA. Only growing the pool by a slab, and trim(), take a lock.
+ *
+ * trim() returns to the kernel the RAM of every slab whose objects are all free: it destroys them
+ * and discards the slab, keeping the allocation mapped so it can be reconstructed later without
+ * any syscalls other than page faults.
+ */
+template<class T> class object_pool
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+  //! \brief The type of object pooled
+  typedef T value_type;
+  //! \brief Called on each object as it is released
+  typedef std::function<void(T &)> reset_type;
+
+  //! \brief Configures a pool
+  struct config_t
+  {
+    size_type slab_bytes;   //!< The size of each slab, rounded up to fit at least one object
+    size_type max_slabs;    //!< The most slabs the pool can grow to
+    config_t() : slab_bytes(2*1024*1024), max_slabs(4096) { }
+  };
+
+  //! \brief Releases an object back to its pool, for use with std::unique_ptr
+  struct releaser
+  {
+    object_pool *pool;
+    void operator()(T *p) const BOOST_NOEXCEPT { pool->release(p); }
+  };
+  //! \brief An object which is released to the pool on destruction
+  typedef std::unique_ptr<T, releaser> unique_ptr;
+private:
+  // The object comes first so a T * is also a node_t *
+  struct node_t
+  {
+    alignas(T) unsigned char storage[sizeof(T)];
+    atomic<uint32_t> next;  // One plus the index of the next free node, zero ends the list
+    uint32_t index;
+  };
+  struct slab_t
+  {
+    source::pointer a;
+    allocation::map_t m;
+    bool constructed;
+  };
+  static BOOST_CONSTEXPR_OR_CONST uint64_t _index_mask=0xffffffff;
+
+  source &_source;
+  config_t _config;
+  reset_type _reset;
+  size_type _per_slab;
+  std::unique_ptr<atomic<node_t *>[]> _bases;
+  std::vector<slab_t> _slabs;
+  mutex _lock;
+  atomic<uint64_t> _head;
+  atomic<size_type> _in_use;
+  error_code _ec;
+
+  node_t *_node(uint32_t index) const BOOST_NOEXCEPT
+  {
+    return _bases[index/_per_slab].load(memory_order_acquire)+index % _per_slab;
+  }
+  node_t *_pop() BOOST_NOEXCEPT
+  {
+    uint64_t h=_head.load(memory_order_acquire);
+    while(uint32_t idx=(uint32_t)(h & _index_mask))
+    {
+      node_t *n=_node(idx-1);
+      uint64_t next=((h>>32)+1)<<32 | n->next.load(memory_order_relaxed);
+      if(_head.compare_exchange_weak(h, next, memory_order_acquire, memory_order_acquire))
+        return n;
+    }
+    return nullptr;
+  }
+  void _push(node_t *first, node_t *last) BOOST_NOEXCEPT
+  {
+    uint64_t h=_head.load(memory_order_relaxed), next;
+    do
+    {
+      last->next.store((uint32_t)(h & _index_mask), memory_order_relaxed);
+      next=((h>>32)+1)<<32 | (first->index+1);
+    } while(!_head.compare_exchange_weak(h, next, memory_order_release, memory_order_relaxed));
+  }
+  // Constructs every object in slab s and pushes them all. Call with _lock held.
+  bool _construct(size_type s) BOOST_NOEXCEPT
+  {
+    node_t *base=(node_t *) _slabs[s].m.addr;
+    size_type n=0;
+    try
+    {
+      for(; n<_per_slab; n++)
+        new(&base[n].storage) T();
+    }
+    catch(...)
+    {
+      while(n--)
+        reinterpret_cast<T *>(&base[n].storage)->~T();
+      _ec=error_code(ECANCELED, std::system_category());
+      return false;
+    }
+    for(n=0; n<_per_slab; n++)
+    {
+      base[n].index=(uint32_t)(s*_per_slab+n);
+      base[n].next.store(n+1<_per_slab ? base[n].index+2 : 0, memory_order_relaxed);
+    }
+    _slabs[s].constructed=true;
+    _push(base, base+_per_slab-1);
+    return true;
+  }
+  // Adds a slab of free objects, reusing a trimmed slab if there is one. Call with _lock held.
+  bool _grow() BOOST_NOEXCEPT
+  {
+    for(size_type s=0; s<_slabs.size(); s++)
+      if(!_slabs[s].constructed)
+        return _construct(s);
+    if(_slabs.size()>=_config.max_slabs)
+    {
+      _ec=error_code(ENOMEM, std::system_category());
+      return false;
+    }
+    try
+    {
+      auto a(_source.allocate(_per_slab*sizeof(node_t)));
+      if(!a)
+      {
+        _ec=a.error();
+        return false;
+      }
+      slab_t slab;
+      slab.a=std::move(*a);
+      slab.m=slab.a->map();
+      slab.constructed=false;
+      if(!slab.m.addr)
+      {
+        _ec=slab.m.ec;
+        return false;
+      }
+      _slabs.push_back(std::move(slab));
+    }
+    catch(...)
+    {
+      _ec=error_code(ENOMEM, std::system_category());
+      return false;
+    }
+    _bases[_slabs.size()-1].store((node_t *) _slabs.back().m.addr, memory_order_release);
+    return _construct(_slabs.size()-1);
+  }
+public:
+  /*! \brief Constructs a pool drawing slabs from \em src, which must outlive it, calling \em reset
+  on each object released if set. No memory is allocated until first use.
+  */
+  explicit object_pool(source &src, config_t config=config_t(), reset_type reset=reset_type()) : _source(src), _config(config), _reset(std::move(reset)),
+    _per_slab(config.slab_bytes/sizeof(node_t) ? config.slab_bytes/sizeof(node_t) : 1), _head(0), _in_use(0)
+  {
+    if(_config.max_slabs>(size_type) 0xfffffffe/_per_slab)
+      _config.max_slabs=(size_type) 0xfffffffe/_per_slab;
+    _bases.reset(new atomic<node_t *>[_config.max_slabs]);
+    for(size_type n=0; n<_config.max_slabs; n++)
+      _bases[n].store(nullptr, memory_order_relaxed);
+    _slabs.reserve(_config.max_slabs<64 ? _config.max_slabs : 64);
+  }
+  object_pool(const object_pool &)=delete;
+  object_pool &operator=(const object_pool &)=delete;
+  //! \brief Destroys all objects, which must all have been released
+  ~object_pool()
+  {
+    for(auto &s : _slabs)
+    {
+      if(s.constructed)
+        for(size_type n=0; n<_per_slab; n++)
+          reinterpret_cast<T *>(&((node_t *) s.m.addr)[n].storage)->~T();
+      s.a->unmap(s.m);
+    }
+  }
+
+  //! \brief The configuration of this pool
+  const config_t &config() const BOOST_NOEXCEPT { return _config; }
+  //! \brief The number of objects in each slab
+  size_type objects_per_slab() const BOOST_NOEXCEPT { return _per_slab; }
+  //! \brief The number of objects currently acquired
+  size_type in_use() const BOOST_NOEXCEPT { return _in_use.load(memory_order_relaxed); }
+  //! \brief The error which caused the last failed acquire
+  error_code last_error() const BOOST_NOEXCEPT { return _ec; }
+
+  /*! \brief Returns a free object, adding a slab if none is free. Returns null if the pool could
+  not grow, in which case last_error() says why.
+  */
+  T *acquire() BOOST_NOEXCEPT
+  {
+    for(;;)
+    {
+      if(node_t *n=_pop())
+      {
+        _in_use.fetch_add(1, memory_order_relaxed);
+        return reinterpret_cast<T *>(&n->storage);
+      }
+      lock_guard<mutex> g(_lock);
+      // Another thread may have grown the pool while we waited
+      if(_head.load(memory_order_acquire) & _index_mask)
+        continue;
+      if(!_grow())
+        return nullptr;
+    }
+  }
+  //! \brief As acquire(), but returning a pointer which releases the object when destroyed
+  unique_ptr acquire_unique() BOOST_NOEXCEPT
+  {
+    releaser r={ this };
+    return unique_ptr(acquire(), r);
+  }
+
+  //! \brief Returns \em p, which must have come from acquire() on this pool, to the pool
+  void release(T *p) BOOST_NOEXCEPT
+  {
+    if(!p)
+      return;
+    if(_reset)
+    {
+      try
+      {
+        _reset(*p);
+      }
+      catch(...)
+      {
+      }
+    }
+    node_t *n=reinterpret_cast<node_t *>(p);
+    _in_use.fetch_sub(1, memory_order_relaxed);
+    _push(n, n);
+  }
+
+  /*! \brief Destroys the objects of every slab whose objects are all free and discards the slab,
+  releasing its RAM. Returns the number of bytes discarded. Concurrent acquires wait on the lock
+  for the duration.
+  */
+  size_type trim() BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> g(_lock);
+    std::vector<size_type> free_counts;
+    try
+    {
+      free_counts.resize(_slabs.size());
+    }
+    catch(...)
+    {
+      return 0;
+    }
+    // Take the entire free list so nothing can be acquired from a slab while it is being trimmed
+    uint64_t h=_head.load(memory_order_acquire);
+    while(!_head.compare_exchange_weak(h, ((h>>32)+1)<<32, memory_order_acquire, memory_order_acquire));
+    for(uint32_t idx=(uint32_t)(h & _index_mask); idx; idx=_node(idx-1)->next.load(memory_order_relaxed))
+      free_counts[(idx-1)/_per_slab]++;
+    // Relink the free nodes of slabs being kept
+    node_t *first=nullptr, *last=nullptr;
+    for(uint32_t idx=(uint32_t)(h & _index_mask); idx;)
+    {
+      node_t *n=_node(idx-1);
+      idx=n->next.load(memory_order_relaxed);
+      if(free_counts[n->index/_per_slab]==_per_slab)
+        continue;
+      if(last)
+        last->next.store(n->index+1, memory_order_relaxed);
+      else
+        first=n;
+      last=n;
+    }
+    size_type ret=0;
+    for(size_type s=0; s<_slabs.size(); s++)
+      if(_slabs[s].constructed && free_counts[s]==_per_slab)
+      {
+        node_t *base=(node_t *) _slabs[s].m.addr;
+        for(size_type n=0; n<_per_slab; n++)
+          reinterpret_cast<T *>(&base[n].storage)->~T();
+        _slabs[s].constructed=false;
+        allocation::map_t d(_slabs[s].m);
+        if(_slabs[s].a->discard(d))
+          ret+=d.length;
+      }
+    if(first)
+      _push(first, last);
+    return ret;
+  }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
@@ -0,0 +1,210 @@
+/* page_size.hpp
+Page size discovery and page arithmetic
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_PAGE_SIZE_HPP
+#define BOOST_KERNELALLOC_PAGE_SIZE_HPP
+
+#include <algorithm>
+#include <cstdio>
+#ifndef WIN32
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+/*! \file page_size.hpp
+ * \brief Provides discovery of the page sizes of the running system, and page arithmetic specialised for the common ones
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+//! \brief The page sizes available on the running system
+struct page_sizes_t
+{
+  size_t base;              //!< The base page size
+  std::vector<size_t> huge; //!< The huge page sizes configured in the kernel, smallest first
+};
+
+/*! \brief Returns the page sizes of the running system, discovered on first call. The base page
+size comes from sysconf(), and the huge page sizes from the entries of /sys/kernel/mm/hugepages.
+*/
+inline const page_sizes_t &page_sizes() BOOST_NOEXCEPT
+{
+  struct discovered : page_sizes_t
+  {
+    discovered()
+    {
+#ifdef WIN32
+      base=4096;
+#else
+      long v=sysconf(_SC_PAGESIZE);
+      base=v>0 ? (size_t) v : 4096;
+      try
+      {
+        if(DIR *d=opendir("/sys/kernel/mm/hugepages"))
+        {
+          while(dirent *e=readdir(d))
+          {
+            unsigned long kb;
+            if(1==sscanf(e->d_name, "hugepages-%lukB", &kb) && kb)
+              huge.push_back((size_t) kb*1024);
+          }
+          closedir(d);
+          std::sort(huge.begin(), huge.end());
+        }
+      }
+      catch(...)
+      {
+        huge.clear();
+      }
+#endif
+    }
+  };
+  static const discovered ret;
+  return ret;
+}
+
+//! \brief Returns the base page size of the running system
+inline size_t page_size() BOOST_NOEXCEPT
+{
+  static const size_t ret=page_sizes().base;
+  return ret;
+}
+
+namespace detail
+{
+  BOOST_CONSTEXPR inline unsigned log2_pow2(size_t v) BOOST_NOEXCEPT { return v<=1 ? 0 : 1+log2_pow2(v>>1); }
+}
+
+/*! \struct page_math
+ * \brief Page rounding, alignment and index arithmetic for a page size of \em PageSize bytes.
+ *
+ * For a nonzero \em PageSize all of these are constexpr and compile to shifts and masks.
+ * page_math<0> is the generic fallback, holding the page size as a run time value. Use
+ * with_page_math() to run code specialised for the page size of the running system.
+ */
+template<size_t PageSize> struct page_math
+{
+  static_assert(PageSize && !(PageSize & (PageSize-1)), "page size must be a power of two");
+  //! \brief log2 of the page size
+  static BOOST_CONSTEXPR_OR_CONST unsigned shift=detail::log2_pow2(PageSize);
+  //! \brief The page size
+  BOOST_CONSTEXPR size_t size() const BOOST_NOEXCEPT { return PageSize; }
+  //! \brief The mask of the offset within a page
+  BOOST_CONSTEXPR size_t mask() const BOOST_NOEXCEPT { return PageSize-1; }
+  //! \brief Rounds \em v down to a page boundary
+  BOOST_CONSTEXPR size_t round_down(size_t v) const BOOST_NOEXCEPT { return v & ~(PageSize-1); }
+  //! \brief Rounds \em v up to a page boundary
+  BOOST_CONSTEXPR size_t round_up(size_t v) const BOOST_NOEXCEPT { return (v+PageSize-1) & ~(PageSize-1); }
+  //! \brief The index of the page containing \em v
+  BOOST_CONSTEXPR size_t index(size_t v) const BOOST_NOEXCEPT { return v>>shift; }
+  //! \brief The offset of \em v within its page
+  BOOST_CONSTEXPR size_t offset(size_t v) const BOOST_NOEXCEPT { return v & (PageSize-1); }
+  //! \brief True if \em v is on a page boundary
+  BOOST_CONSTEXPR bool is_aligned(size_t v) const BOOST_NOEXCEPT { return !(v & (PageSize-1)); }
+};
+//! \brief The generic fallback, for a page size known only at run time
+template<> struct page_math<0>
+{
+  size_t _size;
+  unsigned shift;
+  //! \brief Constructs arithmetic for \em pagesize, which must be a power of two
+  explicit page_math(size_t pagesize=page_size()) BOOST_NOEXCEPT : _size(pagesize), shift(0)
+  {
+    while(((size_t) 1<<shift)<pagesize)
+      ++shift;
+  }
+  size_t size() const BOOST_NOEXCEPT { return _size; }
+  size_t mask() const BOOST_NOEXCEPT { return _size-1; }
+  size_t round_down(size_t v) const BOOST_NOEXCEPT { return v & ~(_size-1); }
+  size_t round_up(size_t v) const BOOST_NOEXCEPT { return (v+_size-1) & ~(_size-1); }
+  size_t index(size_t v) const BOOST_NOEXCEPT { return v>>shift; }
+  size_t offset(size_t v) const BOOST_NOEXCEPT { return v & (_size-1); }
+  bool is_aligned(size_t v) const BOOST_NOEXCEPT { return !(v & (_size-1)); }
+};
+//! \brief Page arithmetic for 4Kb pages, as on x86 and most ARM
+typedef page_math<4096> page_math_4k;
+//! \brief Page arithmetic for 16Kb pages, as on Apple Silicon and some ARM kernels
+typedef page_math<16384> page_math_16k;
+//! \brief Page arithmetic for 64Kb pages, as on some ARM and POWER kernels
+typedef page_math<65536> page_math_64k;
+
+/*! \brief Calls \em f with the page_math for the base page size of the running system, returning
+what it returns. \em f is a generic callable, instantiated for 4Kb, 16Kb and 64Kb pages and
+the generic fallback, so any loop within it has its page arithmetic reduced to constants.
+*/
+template<class F> inline auto with_page_math(F &&f) -> decltype(f(page_math_4k()))
+{
+  switch(page_size())
+  {
+  case 4096:
+    return f(page_math_4k());
+  case 16384:
+    return f(page_math_16k());
+  case 65536:
+    return f(page_math_64k());
+  default:
+    return f(page_math<0>());
+  }
+}
+
+namespace detail
+{
+  struct page_round_up_t
+  {
+    size_t v;
+    template<class PM> size_t operator()(PM pm) const BOOST_NOEXCEPT { return pm.round_up(v); }
+  };
+  struct page_round_down_t
+  {
+    size_t v;
+    template<class PM> size_t operator()(PM pm) const BOOST_NOEXCEPT { return pm.round_down(v); }
+  };
+}
+
+//! \brief Rounds \em v up to a base page boundary of the running system, specialised as by with_page_math()
+inline size_t page_round_up(size_t v) BOOST_NOEXCEPT
+{
+  detail::page_round_up_t f={ v };
+  return with_page_math(f);
+}
+
+//! \brief Rounds \em v down to a base page boundary of the running system, specialised as by with_page_math()
+inline size_t page_round_down(size_t v) BOOST_NOEXCEPT
+{
+  detail::page_round_down_t f={ v };
+  return with_page_math(f);
+}
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
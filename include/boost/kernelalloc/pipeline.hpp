@@ -0,0 +1,313 @@
+/* pipeline.hpp
+Rotates a fixed set of allocations through pipeline stages
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_PIPELINE_HPP
+#define BOOST_KERNELALLOC_PIPELINE_HPP
+
+#include "cache_colour.hpp"
+#include <climits>
+#include <cstdint>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*! \file pipeline.hpp
+ * \brief Provides double and triple buffering of allocations between pipeline stages
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+namespace detail
+{
+  // Blocks while *addr==expected, or until woken. May return spuriously.
+  inline void futex_wait(atomic<uint32_t> *addr, uint32_t expected) BOOST_NOEXCEPT
+  {
+#ifdef __linux__
+    static_assert(sizeof(atomic<uint32_t>)==sizeof(uint32_t), "atomic<uint32_t> cannot be used as a futex word");
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+    if(addr->load(memory_order_acquire)==expected)
+      this_thread::yield();
+#endif
+  }
+  // Wakes all threads blocked in futex_wait() on addr
+  inline void futex_wake_all(atomic<uint32_t> *addr) BOOST_NOEXCEPT
+  {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+    (void) addr;
+#endif
+  }
+}
+
+/*! \class allocation_pipeline
+ * \brief Owns a fixed set of allocations and rotates them through the stages of a pipeline.
+ *
+ * Rather than allocating a fresh buffer for every cycle of a producer/consumer pipeline, allocate
+ * K buffers once (K=2 for double buffering, K=3 for triple buffering etc) and pass them round and
+ * round through each stage in turn. With the default three stages a buffer goes fill, then
+ * process, then drain, then back to fill. Any number of threads may work each stage: every
+ * acquire takes a ticket, and tickets of a stage visit the buffers strictly in order, so a
+ * buffer is always processed in the same order it was filled.
+ *
+ * State transitions are a single atomic store per buffer, and a thread which must wait for a
+ * buffer to reach its stage sleeps on that buffer's state word as a futex (a yield loop on
+ * anything other than Linux). Optionally each buffer can be discarded after being drained so its
+ * RAM is released while it waits, and prefaulted before being handed to the fill stage so the
+ * producer does not page fault.
+ */
+class allocation_pipeline
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+  //! \brief A pointer to a pipeline
+  typedef std::shared_ptr<allocation_pipeline> pointer;
+
+  //! \brief Flags for a pipeline
+  enum class flags_t
+  {
+    normal=0,                     //!< No special behaviour
+    discard_after_drain=1,        //!< Issue a discard() on a buffer once it leaves the last stage
+    prefault_before_fill=2,       //!< Prefault a buffer for writing before it enters the first stage
+    colour_buffers=4              //!< Stagger the start of each buffer by a different multiple of the cache line (see cache_colourer)
+  };
+
+  /*! \class handle
+   * \brief Exclusive access to one buffer during one stage. Destroying the handle passes the buffer to the next stage.
+   */
+  class handle
+  {
+    friend class allocation_pipeline;
+    allocation_pipeline *_parent;
+    size_type _stage;
+    unsigned long long _ticket;
+    handle(allocation_pipeline *parent, size_type stage, unsigned long long ticket) BOOST_NOEXCEPT : _parent(parent), _stage(stage), _ticket(ticket) { }
+  public:
+    //! \brief Constructs an empty handle
+    handle() BOOST_NOEXCEPT : _parent(nullptr), _stage(0), _ticket(0) { }
+    handle(handle &&o) BOOST_NOEXCEPT : _parent(o._parent), _stage(o._stage), _ticket(o._ticket) { o._parent=nullptr; }
+    handle &operator=(handle &&o) BOOST_NOEXCEPT
+    {
+      release();
+      _parent=o._parent;
+      _stage=o._stage;
+      _ticket=o._ticket;
+      o._parent=nullptr;
+      return *this;
+    }
+    ~handle() { release(); }
+    //! \brief True if this handle refers to a buffer. Acquires return an empty handle once the pipeline is closed.
+    explicit operator bool() const BOOST_NOEXCEPT { return _parent!=nullptr; }
+    //! \brief The stage this buffer is in
+    size_type stage() const BOOST_NOEXCEPT { return _stage; }
+    //! \brief The zero based number of the cycle of the pipeline this buffer is in
+    unsigned long long sequence() const BOOST_NOEXCEPT { return _ticket; }
+    //! \brief The index of the buffer within the pipeline
+    size_type index() const BOOST_NOEXCEPT { return (size_type)(_ticket % _parent->_slots.size()); }
+    //! \brief The allocation for this buffer
+    allocation &alloc() const BOOST_NOEXCEPT { return *_parent->_slots[index()].a; }
+    //! \brief The map of this buffer into the current process
+    const allocation::map_t &map() const BOOST_NOEXCEPT { return _parent->_slots[index()].view; }
+    //! \brief The address of this buffer
+    void *data() const BOOST_NOEXCEPT { return map().addr; }
+    //! \brief The size of this buffer
+    size_type size() const BOOST_NOEXCEPT { return map().length; }
+    //! \brief Passes the buffer to the next stage
+    void release() BOOST_NOEXCEPT
+    {
+      if(_parent)
+      {
+        _parent->_advance(_stage, _ticket);
+        _parent=nullptr;
+      }
+    }
+  };
+private:
+  struct slot_t
+  {
+    source::pointer a;
+    allocation::map_t m, view;  // view is m less any colour offset and padding
+    atomic<uint32_t> state;   // (cycle*stages+stage) ready for, top bit set once closed
+    slot_t() : state(0) { }
+  };
+  static BOOST_CONSTEXPR_OR_CONST uint32_t _closed_bit=0x80000000U;
+  flags_t _flags;
+  size_type _stages;
+  std::vector<slot_t> _slots;
+  std::vector<atomic<unsigned long long>> _tickets;
+
+  allocation_pipeline(flags_t flags, size_type buffers, size_type stages) : _flags(flags), _stages(stages), _slots(buffers), _tickets(stages)
+  {
+    for(auto &t : _tickets)
+      t.store(0, memory_order_relaxed);
+  }
+  uint32_t _state_for(size_type stage, unsigned long long ticket) const BOOST_NOEXCEPT
+  {
+    return (uint32_t)((ticket/_slots.size())*_stages+stage) & ~_closed_bit;
+  }
+  // Rewriting a byte per page faults it in for writing without changing its contents
+  struct _prefaulter
+  {
+    volatile char *p;
+    size_type length;
+    template<class PM> void operator()(PM pm) const BOOST_NOEXCEPT
+    {
+      for(size_type n=0; n<length; n+=pm.size())
+        p[n]=p[n];
+    }
+  };
+  void _prefault(slot_t &s) BOOST_NOEXCEPT
+  {
+#if defined(__linux__) && defined(MADV_POPULATE_WRITE)
+    if(-1!=madvise(s.m.addr, s.m.length, MADV_POPULATE_WRITE))
+      return;
+#endif
+    _prefaulter f={ (volatile char *) s.m.addr, s.m.length };
+    with_page_math(f);
+  }
+  void _advance(size_type stage, unsigned long long ticket) BOOST_NOEXCEPT
+  {
+    slot_t &s=_slots[ticket % _slots.size()];
+    if(stage==_stages-1)
+    {
+      if(!!((int) _flags & (int) flags_t::discard_after_drain))
+        s.a->discard(s.m);
+    }
+    // After the last stage the buffer is next due to the ticket one cycle on entering stage zero
+    const uint32_t next=(stage==_stages-1) ? _state_for(0, ticket+_slots.size()) : _state_for(stage+1, ticket);
+    uint32_t state=s.state.load(memory_order_relaxed);
+    while(!s.state.compare_exchange_weak(state, next|(state & _closed_bit), memory_order_release, memory_order_relaxed));
+    detail::futex_wake_all(&s.state);
+  }
+public:
+  /*! \brief Allocates and maps \em buffers allocations of \em bytes each from \em src for a pipeline of \em stages stages.
+   */
+  static expected<pointer, error_code> make(source &src, size_type buffers, size_type bytes, size_type stages=3, flags_t flags=flags_t::normal) BOOST_NOEXCEPT
+  {
+    if(buffers<1 || stages<2)
+      return make_unexpected(error_code(EINVAL, std::system_category()));
+    pointer ret;
+    try
+    {
+      ret=pointer(new allocation_pipeline(flags, buffers, stages));
+    }
+    catch(...)
+    {
+      return make_unexpected(error_code(ENOMEM, std::system_category()));
+    }
+    const bool colour=!!((int) flags & (int) flags_t::colour_buffers);
+    cache_colourer colourer;
+    std::vector<size_type> sizes(buffers, colour ? bytes+colourer.padding() : bytes);
+    auto as(src.allocate(buffers, sizes.data()));
+    if(!as)
+      return make_unexpected(as.error());
+    for(size_type n=0; n<buffers; n++)
+    {
+      slot_t &s=ret->_slots[n];
+      s.a=std::move((*as)[n]);
+      s.m=s.a->map();
+      if(!s.m.addr)
+        return make_unexpected(s.m.ec);
+      s.view=colour ? cache_colourer::apply(s.m, colourer.offset(n), bytes) : s.m;
+      if(!!((int) flags & (int) flags_t::prefault_before_fill))
+        ret->_prefault(s);
+    }
+    return ret;
+  }
+  allocation_pipeline(const allocation_pipeline &)=delete;
+  allocation_pipeline &operator=(const allocation_pipeline &)=delete;
+  ~allocation_pipeline()
+  {
+    for(auto &s : _slots)
+      if(s.m.addr)
+        s.a->unmap(s.m);
+  }
+
+  //! \brief The number of buffers in the pipeline
+  size_type buffers() const BOOST_NOEXCEPT { return _slots.size(); }
+  //! \brief The number of stages in the pipeline
+  size_type stages() const BOOST_NOEXCEPT { return _stages; }
+
+  /*! \brief Waits for the next buffer due to enter \em stage, returning exclusive access to it.
+  Returns an empty handle if the pipeline is closed, or if \em stage is not one of its stages.
+  */
+  handle acquire(size_type stage) BOOST_NOEXCEPT
+  {
+    if(stage>=_stages)
+      return handle();
+    unsigned long long ticket=_tickets[stage].fetch_add(1, memory_order_relaxed);
+    slot_t &s=_slots[ticket % _slots.size()];
+    const uint32_t want=_state_for(stage, ticket);
+    for(;;)
+    {
+      uint32_t state=s.state.load(memory_order_acquire);
+      if((state & ~_closed_bit)==want)
+        break;
+      if(state & _closed_bit)
+        return handle();
+      detail::futex_wait(&s.state, state);
+    }
+    if(0==stage && !!((int) _flags & (int) flags_t::prefault_before_fill) && ticket>=_slots.size())
+      _prefault(s);
+    return handle(this, stage, ticket);
+  }
+  //! \brief Waits for the next buffer to fill
+  handle acquire_fill() BOOST_NOEXCEPT { return acquire(0); }
+  //! \brief Waits for the next buffer to process. Only valid for pipelines of three or more stages.
+  handle acquire_process() BOOST_NOEXCEPT { return acquire(1); }
+  //! \brief Waits for the next buffer to drain
+  handle acquire_drain() BOOST_NOEXCEPT { return acquire(_stages-1); }
+
+  /*! \brief Closes the pipeline, causing all current and future waits to return an empty handle.
+  Buffers currently acquired remain valid until their handles are destroyed.
+  */
+  void close() BOOST_NOEXCEPT
+  {
+    for(auto &s : _slots)
+    {
+      s.state.fetch_or(_closed_bit, memory_order_release);
+      detail::futex_wake_all(&s.state);
+    }
+  }
+  //! \brief True if the pipeline has been closed
+  bool is_closed() const BOOST_NOEXCEPT { return !!(_slots.front().state.load(memory_order_acquire) & _closed_bit); }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
@@ -0,0 +1,382 @@
+/* prewarm.hpp
+A source of pre-mapped, prefaulted allocations refilled in the background
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_PREWARM_HPP
+#define BOOST_KERNELALLOC_PREWARM_HPP
+
+#include <algorithm>
+
+/*! \file prewarm.hpp
+ * \brief Provides a source handing out allocations mapped and prefaulted ahead of time
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+/*! \class prewarmed_source
+ * \brief Keeps allocations of each of a set of size classes mapped, prefaulted and ready, so
+ * acquire() on a latency critical path never enters the kernel.
+ *
+ * acquire() is the hot path API. It pops the most recently readied allocation of the smallest
+ * class which fits and hands back its prefaulted map along with it, as recycler::acquire() does,
+ * so the caller uses it without a syscall or a page fault and unmaps it when done. allocate()
+ * exists so this can stand in for any other source, but as a source's allocations are returned
+ * unmapped it must munmap the prefaulted map, which costs a syscall and throws the prefaulting
+ * away. Don't call it on a latency critical path.
+ *
+ * A background thread allocates from an upstream source, maps and prefaults each allocation
+ * with map_prefault(), and keeps up to a configured number of them ready per size class. Once a
+ * class falls to its low watermark the thread is woken, once, and refills it at no more than the
+ * configured rate, so the upstream source isn't hammered during a burst. While upstream keeps
+ * failing the pause between refills doubles, up to max_backoff.
+ *
+ * If a class runs dry the exhaustion policy decides: allocate from upstream on the caller's
+ * thread, wait a bounded time for the refiller, or fail with ENOMEM. Requests larger than every
+ * class always go straight upstream. Allocations handed out belong to the upstream source, and
+ * are at least the requested size, being their class's size.
+ */
+class prewarmed_source : public source
+{
+public:
+  //! \brief A pointer to a prewarmed source
+  typedef std::shared_ptr<prewarmed_source> source_pointer;
+  //! \brief The clock used for waits and refill pacing
+  typedef chrono::steady_clock clock_type;
+
+  //! \brief What to do when a size class has nothing ready
+  enum class exhausted_policy
+  {
+    fallback,   //!< Allocate and map from upstream on the calling thread
+    wait,       //!< Wait up to max_wait for the refiller, then fall back
+    fail        //!< Fail with ENOMEM
+  };
+
+  //! \brief Configures a prewarmed source
+  struct config_t
+  {
+    std::vector<size_type> size_classes;  //!< The sizes kept ready
+    size_type ready;                      //!< How many allocations to keep ready per class
+    size_type low_watermark;              //!< Wake the refiller when a class falls to this many, -1 means half of ready
+    size_type refill_batch;               //!< The most allocations made per refill_interval, so the refill rate
+    clock_type::duration refill_interval; //!< The pause between refill batches while a class is below ready
+    exhausted_policy on_exhausted;        //!< What to do when a class is empty
+    clock_type::duration max_wait;        //!< How long exhausted_policy::wait waits
+    clock_type::duration max_backoff;     //!< The longest pause between refills while upstream is failing
+    bool prefault;                        //!< Prefault allocations before readying them
+    config_t() : ready(16), low_watermark((size_type) -1), refill_batch(64), refill_interval(chrono::milliseconds(1)),
+      on_exhausted(exhausted_policy::fallback), max_wait(chrono::milliseconds(10)), max_backoff(chrono::seconds(1)), prefault(true) { }
+  };
+
+  //! \brief Counts of how allocations were satisfied
+  struct stats_t
+  {
+    size_type hits;         //!< Allocations popped from a ready queue
+    size_type fallbacks;    //!< Allocations made upstream by the caller, either too big or on exhaustion
+    size_type waits;        //!< Times a caller waited for the refiller
+    size_type failures;     //!< Allocations failed by exhaustion
+    size_type refilled;     //!< Allocations readied by the refiller
+    size_type refill_errors; //!< Times the refiller got an error from upstream
+    error_code last_error;  //!< The last error the refiller got from upstream
+    stats_t() : hits(0), fallbacks(0), waits(0), failures(0), refilled(0), refill_errors(0) { }
+  };
+private:
+  typedef std::pair<source::pointer, allocation::map_t> ready_t;
+  struct class_t
+  {
+    size_type bytes;
+    std::vector<ready_t> ready;
+  };
+  source_ptr _upstream;
+  config_t _config;
+  std::vector<class_t> _classes;
+  mutex _lock;
+  condition_variable _wanted, _refilled;
+  bool _done, _wake_pending, _idle;
+  clock_type::duration _delay;
+  stats_t _stats;
+  thread _thread;
+
+  prewarmed_source(source_ptr upstream, config_t config) : source(flags_t::normal, upstream->maximum(), (size_type) -1),
+    _upstream(std::move(upstream)), _config(std::move(config)), _done(false), _wake_pending(false), _idle(false), _delay(_config.refill_interval)
+  {
+    std::sort(_config.size_classes.begin(), _config.size_classes.end());
+    _config.size_classes.erase(std::unique(_config.size_classes.begin(), _config.size_classes.end()), _config.size_classes.end());
+    if(_config.low_watermark==(size_type) -1)
+      _config.low_watermark=_config.ready/2;
+    _classes.resize(_config.size_classes.size());
+    for(size_type n=0; n<_classes.size(); n++)
+    {
+      _classes[n].bytes=_config.size_classes[n];
+      _classes[n].ready.reserve(_config.ready);
+    }
+  }
+  // Allocates and maps one allocation of bytes from upstream
+  expected<ready_t, error_code> _make(size_type bytes) BOOST_NOEXCEPT
+  {
+    auto a(_upstream->allocate(bytes));
+    if(!a)
+      return make_unexpected(a.error());
+    allocation::map_t m(_config.prefault ? (*a)->map_prefault() : (*a)->map());
+    if(!m.addr)
+      return make_unexpected(m.ec);
+    return ready_t(std::move(*a), m);
+  }
+  // Tops up each class by at most refill_batch in all, returning true if any is still short
+  bool _refill(unique_lock<mutex> &g) BOOST_NOEXCEPT
+  {
+    size_type made=0;
+    bool short_=false;
+    for(auto &c : _classes)
+    {
+      while(c.ready.size()<_config.ready && made<_config.refill_batch && !_done)
+      {
+        const size_type bytes=c.bytes;
+        g.unlock();
+        auto r(_make(bytes));
+        g.lock();
+        ++made;
+        if(!r)
+        {
+          ++_stats.refill_errors;
+          _stats.last_error=r.error();
+          _delay=std::max(_config.refill_interval, std::min(_delay*2, _config.max_backoff));
+          return true;
+        }
+        _delay=_config.refill_interval;
+        // ready was reserved up front, so this never allocates or throws
+        c.ready.push_back(std::move(*r));
+        ++_stats.refilled;
+        _refilled.notify_all();
+      }
+      if(c.ready.size()<_config.ready)
+        short_=true;
+    }
+    return short_;
+  }
+  void _run() BOOST_NOEXCEPT
+  {
+    unique_lock<mutex> g(_lock);
+    while(!_done)
+    {
+      _wake_pending=false;
+      _idle=false;
+      // While short, pace refills at refill_batch per refill_interval, or slower while upstream is failing, else sleep until woken
+      if(_refill(g))
+        _wanted.wait_for(g, _delay, [this] { return _done; });
+      else
+      {
+        _idle=true;
+        _refilled.notify_all();
+        _wanted.wait(g, [this] { return _done || _wake_pending; });
+      }
+    }
+  }
+  // Pops an allocation of the class fitting bytes. Allocations made on the calling thread are mapped only if map is set, popped ones are always returned with their map.
+  expected<ready_t, error_code> _pop(size_type bytes, bool map) BOOST_NOEXCEPT
+  {
+    size_type idx=0;
+    while(idx<_classes.size() && _classes[idx].bytes<bytes)
+      ++idx;
+    unique_lock<mutex> g(_lock);
+    if(idx<_classes.size())
+    {
+      class_t &c=_classes[idx];
+      if(c.ready.empty() && _config.on_exhausted!=exhausted_policy::fallback)
+      {
+        if(_config.on_exhausted==exhausted_policy::fail)
+        {
+          ++_stats.failures;
+          return make_unexpected(error_code(ENOMEM, std::system_category()));
+        }
+        ++_stats.waits;
+        _wake_pending=true;
+        _wanted.notify_one();
+        _refilled.wait_for(g, _config.max_wait, [this, &c] { return _done || !c.ready.empty(); });
+      }
+      if(!c.ready.empty())
+      {
+        ready_t ret(std::move(c.ready.back()));
+        c.ready.pop_back();
+        ++_stats.hits;
+        // Only the first drop to the watermark wakes the refiller, so the hot path rarely makes a syscall
+        if(c.ready.size()<=_config.low_watermark && !_wake_pending)
+        {
+          _wake_pending=true;
+          _wanted.notify_one();
+        }
+        return ret;
+      }
+      if(!_wake_pending)
+      {
+        _wake_pending=true;
+        _wanted.notify_one();
+      }
+      bytes=c.bytes;
+    }
+    ++_stats.fallbacks;
+    g.unlock();
+    if(map)
+      return _make(bytes);
+    auto a(_upstream->allocate(bytes));
+    if(!a)
+      return make_unexpected(a.error());
+    return ready_t(std::move(*a), allocation::map_t());
+  }
+public:
+  using source::allocate;
+
+  /*! \brief Creates a prewarmed source over \em upstream and starts its refiller, which begins by
+  filling every class.
+  */
+  static expected<source_pointer, error_code> make(source_ptr upstream, config_t config) BOOST_NOEXCEPT
+  {
+    if(!upstream || config.size_classes.empty() || !config.refill_batch)
+      return make_unexpected(error_code(EINVAL, std::system_category()));
+    source_pointer ret;
+    try
+    {
+      ret=source_pointer(new prewarmed_source(std::move(upstream), std::move(config)));
+    }
+    catch(...)
+    {
+      return make_unexpected(error_code(ENOMEM, std::system_category()));
+    }
+    try
+    {
+      prewarmed_source *s=ret.get();
+      ret->_thread=thread([s] { s->_run(); });
+    }
+    catch(...)
+    {
+      return make_unexpected(error_code(EAGAIN, std::system_category()));
+    }
+    return ret;
+  }
+  prewarmed_source(const prewarmed_source &)=delete;
+  prewarmed_source &operator=(const prewarmed_source &)=delete;
+  //! \brief Stops the refiller and releases every allocation still ready
+  ~prewarmed_source()
+  {
+    {
+      lock_guard<mutex> g(_lock);
+      _done=true;
+    }
+    _wanted.notify_all();
+    _refilled.notify_all();
+    if(_thread.joinable())
+      _thread.join();
+    for(auto &c : _classes)
+      for(auto &r : c.ready)
+        r.first->unmap(r.second);
+  }
+
+  //! \brief The configuration of this source
+  const config_t &config() const BOOST_NOEXCEPT { return _config; }
+  //! \brief The source allocations are made from
+  const source_ptr &upstream() const BOOST_NOEXCEPT { return _upstream; }
+  //! \brief The counts of how allocations were satisfied
+  stats_t stats() BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> g(_lock);
+    return _stats;
+  }
+  //! \brief How many allocations are ready in the class which would satisfy \em bytes
+  size_type ready(size_type bytes) BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> g(_lock);
+    for(auto &c : _classes)
+      if(c.bytes>=bytes)
+        return c.ready.size();
+    return 0;
+  }
+  /*! \brief Blocks until the refiller has caught up or \em timeout passes, returning true if it
+  caught up. Just after make() that means every class is full, thereafter that every class is
+  full or has not fallen to its low watermark since it last was.
+  */
+  bool wait_ready(clock_type::duration timeout) BOOST_NOEXCEPT
+  {
+    unique_lock<mutex> g(_lock);
+    return _refilled.wait_for(g, timeout, [this] { return _idle && !_wake_pending; });
+  }
+
+  virtual const char *name() BOOST_NOEXCEPT override { return "prewarmed"; }
+
+  /*! \brief Pops a ready allocation of the smallest class which fits \em bytes along with its map,
+  prefaulted, which the caller must unmap() when done. Sizes above every class, and exhaustion
+  under exhausted_policy::fallback, allocate and map upstream on the calling thread.
+   */
+  expected<std::pair<pointer, allocation::map_t>, error_code> acquire(size_type bytes) BOOST_NOEXCEPT
+  {
+    return _pop(bytes, true);
+  }
+
+  /*! \brief Pops a ready allocation of the smallest class which fits \em bytes, unmapping it before
+  returning it as a source's allocations are returned unmapped. The munmap is a syscall, so use
+  acquire() on a latency critical path to keep the prefaulted map. Sizes above every class are allocated upstream.
+   */
+  virtual expected<pointer, error_code> allocate(size_type bytes) BOOST_NOEXCEPT override
+  {
+    auto r(_pop(bytes, false));
+    if(!r)
+      return make_unexpected(r.error());
+    if(r->second.addr)
+      r->first->unmap(r->second);
+    return std::move(r->first);
+  }
+
+  //! \brief Allocates each of \em no sizes as allocate() does
+  virtual expected<std::vector<pointer>, error_code> allocate(size_type no, size_type *bytes) BOOST_NOEXCEPT override
+  {
+    std::vector<pointer> ret;
+    try
+    {
+      ret.reserve(no);
+    }
+    catch(...)
+    {
+      return make_unexpected(error_code(ENOMEM, std::system_category()));
+    }
+    for(size_type n=0; n<no; n++)
+    {
+      auto a(allocate(bytes[n]));
+      if(!a)
+        return make_unexpected(a.error());
+      ret.push_back(std::move(*a));
+    }
+    return ret;
+  }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
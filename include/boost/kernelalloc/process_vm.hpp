@@ -0,0 +1,191 @@
+/* process_vm.hpp
+Copying between allocations and other processes
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_PROCESS_VM_HPP
+#define BOOST_KERNELALLOC_PROCESS_VM_HPP
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
+#endif
+
+/*! \file process_vm.hpp
+ * \brief Provides single copy gather and scatter between local maps and another process's memory
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+//! \brief A range of addresses in another process
+struct remote_range
+{
+  unsigned long long addr;  //!< The address in the remote process
+  size_t length;            //!< The number of bytes
+  remote_range() : addr(0), length(0) { }
+  remote_range(unsigned long long _addr, size_t _length) : addr(_addr), length(_length) { }
+};
+
+namespace detail
+{
+#ifdef __linux__
+#ifdef IOV_MAX
+  static const size_t process_vm_iov_max=IOV_MAX;
+#else
+  static const size_t process_vm_iov_max=1024;
+#endif
+  // Walks an array of ranges, handing out iovecs from a byte position which may be part way through one
+  template<class T> struct iov_cursor
+  {
+    const T *ranges;
+    size_t no, idx, offset;
+    iov_cursor(const T *_ranges, size_t _no) : ranges(_ranges), no(_no), idx(0), offset(0)
+    {
+      skip_empty();
+    }
+    void skip_empty() BOOST_NOEXCEPT
+    {
+      while(idx<no && offset==ranges[idx].length)
+      {
+        ++idx;
+        offset=0;
+      }
+    }
+    bool done() const BOOST_NOEXCEPT { return idx>=no; }
+    static char *base(const allocation::map_t &r) BOOST_NOEXCEPT { return (char *) r.addr; }
+    static char *base(const remote_range &r) BOOST_NOEXCEPT { return (char *)(uintptr_t) r.addr; }
+    // Fills up to max iovecs and returns how many
+    size_t fill(iovec *iov, size_t max) const BOOST_NOEXCEPT
+    {
+      size_t n=0;
+      for(size_t i=idx, o=offset; i<no && n<max; i++, o=0)
+      {
+        if(o==ranges[i].length)
+          continue;
+        iov[n].iov_base=base(ranges[i])+o;
+        iov[n].iov_len=ranges[i].length-o;
+        ++n;
+      }
+      return n;
+    }
+    void advance(size_t bytes) BOOST_NOEXCEPT
+    {
+      while(bytes && idx<no)
+      {
+        size_t left=ranges[idx].length-offset;
+        if(bytes<left)
+        {
+          offset+=bytes;
+          return;
+        }
+        bytes-=left;
+        ++idx;
+        offset=0;
+      }
+      skip_empty();
+    }
+  };
+  template<bool is_write> inline expected<size_t, error_code> process_vm_copy(pid_t pid, const allocation::map_t *local, size_t localno, const remote_range *remote, size_t remoteno) BOOST_NOEXCEPT
+  {
+    iov_cursor<allocation::map_t> l(local, localno);
+    iov_cursor<remote_range> r(remote, remoteno);
+    iovec liov[process_vm_iov_max], riov[process_vm_iov_max];
+    const size_t max=process_vm_iov_max;
+    size_t ret=0;
+    while(!l.done() && !r.done())
+    {
+      size_t ln=l.fill(liov, max), rn=r.fill(riov, max);
+      ssize_t done;
+      while(-1==(done=is_write ? ::process_vm_writev(pid, liov, ln, riov, rn, 0) : ::process_vm_readv(pid, liov, ln, riov, rn, 0)) && EINTR==errno);
+      if(-1==done)
+      {
+        if(ret)
+          break;
+        return make_unexpected(error_code(errno, std::system_category()));
+      }
+      // Partial transfers stop at a remote iovec which could not be accessed, so stop there
+      if(!done)
+        break;
+      l.advance((size_t) done);
+      r.advance((size_t) done);
+      ret+=(size_t) done;
+    }
+    return ret;
+  }
+#endif
+}
+
+/*! \brief Copies the remote ranges of process \em pid, taken in order as one sequence, into the
+local maps taken in order as one sequence, until either runs out. The data crosses between the
+processes once, with no intermediate buffer, and as few syscalls as possible are made by passing up to
+IOV_MAX ranges at a time. The caller needs permission to ptrace \em pid.
+
+Returns the number of bytes copied. If part of the remote ranges turns out to be inaccessible,
+copying stops there and the short count is returned; an error is returned only if nothing could be
+copied. ENOSYS is returned on platforms without process_vm_readv.
+*/
+inline expected<size_t, error_code> gather_from_process(int pid, const allocation::map_t *local, size_t localno, const remote_range *remote, size_t remoteno) BOOST_NOEXCEPT
+{
+#ifdef __linux__
+  return detail::process_vm_copy<false>((pid_t) pid, local, localno, remote, remoteno);
+#else
+  (void) pid; (void) local; (void) localno; (void) remote; (void) remoteno;
+  return make_unexpected(error_code(ENOSYS, std::system_category()));
+#endif
+}
+//! \brief Gathers a container of remote ranges into a container of local maps
+inline expected<size_t, error_code> gather_from_process(int pid, const std::vector<allocation::map_t> &local, const std::vector<remote_range> &remote) BOOST_NOEXCEPT
+{
+  return gather_from_process(pid, local.data(), local.size(), remote.data(), remote.size());
+}
+
+/*! \brief Copies the local maps, taken in order as one sequence, into the remote ranges of process
+\em pid taken in order as one sequence, until either runs out. Otherwise behaves as gather_from_process().
+*/
+inline expected<size_t, error_code> scatter_to_process(int pid, const allocation::map_t *local, size_t localno, const remote_range *remote, size_t remoteno) BOOST_NOEXCEPT
+{
+#ifdef __linux__
+  return detail::process_vm_copy<true>((pid_t) pid, local, localno, remote, remoteno);
+#else
+  (void) pid; (void) local; (void) localno; (void) remote; (void) remoteno;
+  return make_unexpected(error_code(ENOSYS, std::system_category()));
+#endif
+}
+//! \brief Scatters a container of local maps into a container of remote ranges
+inline expected<size_t, error_code> scatter_to_process(int pid, const std::vector<allocation::map_t> &local, const std::vector<remote_range> &remote) BOOST_NOEXCEPT
+{
+  return scatter_to_process(pid, local.data(), local.size(), remote.data(), remote.size());
+}
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
@@ -0,0 +1,226 @@
+/* purgeable.hpp
+Allocations the kernel may purge while unpinned, with detection on repin
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_PURGEABLE_HPP
+#define BOOST_KERNELALLOC_PURGEABLE_HPP
+
+/*! \file purgeable.hpp
+ * \brief Provides allocations whose contents the kernel may throw away while they are unpinned
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+/*! \class purgeable
+ * \brief A mapped allocation whose pages the kernel may reclaim while it is unpinned, which on
+ * being pinned again reports whether its contents survived.
+ *
+ * Caches of things which can be recreated, decoded images say, can then use any spare memory
+ * without an eviction policy of their own: unpin what isn't in use, and the kernel takes it back
+ * under memory pressure, which is the sort of volatile range other kernels provide directly.
+ *
+ * Unpinning saves the first word of every whole page, replaces it with a sentinel, and lazily
+ * discards the pages with MADV_FREE. A page the kernel reclaims reads back as zero, so losing the
+ * sentinel. Pinning compares and swaps each page's sentinel back to its saved word: a successful
+ * swap writes to the page, which cancels the lazy discard so the kernel can no longer take it, while
+ * a failed one means the page went. There is no window between checking a page and keeping it.
+ * It costs one word per page to unpin, and one atomic operation per page to pin.
+ *
+ * Only private anonymous memory, such as from nonpersistent_source, can be purged. Anything else,
+ * the partial pages at either end, and anything on kernels without MADV_FREE, is simply never
+ * purged, which is always safe. Contents are only usable while pinned. A purgeable starts pinned.
+ */
+class purgeable
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+  //! \brief What pin() found
+  struct pin_result_t
+  {
+    size_type pages;    //!< Whole pages checked
+    size_type purged;   //!< Pages the kernel reclaimed while unpinned
+    //! \brief True if the contents survived intact
+    bool survived() const BOOST_NOEXCEPT { return !purged; }
+  };
+private:
+  typedef unsigned long long word_type;
+  source::pointer _a;
+  allocation::map_t _m;
+  std::vector<word_type> _saved;
+  word_type _sentinel;
+  bool _pinned, _lazy;
+
+  std::pair<char *, char *> _pages() const BOOST_NOEXCEPT { return detail::discard_whole_pages(_m); }
+  static bool _cas(word_type *p, word_type expected, word_type desired) BOOST_NOEXCEPT
+  {
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#else
+    // Nothing is ever purged without MADV_FREE, so the sentinel is always still there
+    if(*p!=expected)
+      return false;
+    *p=desired;
+    return true;
+#endif
+  }
+  purgeable(source::pointer a, allocation::map_t m, std::vector<word_type> saved) BOOST_NOEXCEPT : _a(std::move(a)), _m(m), _saved(std::move(saved)), _pinned(true), _lazy(true)
+  {
+    // Any non-zero value works, as reclaimed pages read as zero. Vary it so stale data can't match.
+    _sentinel=((word_type)(size_t) _m.addr*0x9E3779B97F4A7C15ULL) | 1;
+  }
+public:
+  //! \brief Constructs an empty purgeable
+  purgeable() BOOST_NOEXCEPT : _sentinel(0), _pinned(false), _lazy(false) { }
+  purgeable(purgeable &&o) BOOST_NOEXCEPT : _a(std::move(o._a)), _m(o._m), _saved(std::move(o._saved)), _sentinel(o._sentinel), _pinned(o._pinned), _lazy(o._lazy)
+  {
+    o._m=allocation::map_t();
+  }
+  purgeable &operator=(purgeable &&o) BOOST_NOEXCEPT
+  {
+    std::swap(_a, o._a);
+    std::swap(_m, o._m);
+    std::swap(_saved, o._saved);
+    std::swap(_sentinel, o._sentinel);
+    std::swap(_pinned, o._pinned);
+    std::swap(_lazy, o._lazy);
+    return *this;
+  }
+  purgeable(const purgeable &)=delete;
+  purgeable &operator=(const purgeable &)=delete;
+  ~purgeable()
+  {
+    if(_a && _m.addr)
+      _a->unmap(_m);
+  }
+
+  //! \brief Makes the whole of \em a purgeable, mapping it. Its contents start pinned.
+  static expected<purgeable, error_code> make(source::pointer a) BOOST_NOEXCEPT
+  {
+    if(!a)
+      return make_unexpected(error_code(EINVAL, std::system_category()));
+    allocation::map_t m(0, a->size());
+    if(!a->map(m))
+      return make_unexpected(m.ec);
+    std::vector<word_type> saved;
+    try
+    {
+      auto pages(detail::discard_whole_pages(m));
+      saved.resize((size_type)(pages.second-pages.first)/page_size());
+    }
+    catch(...)
+    {
+      a->unmap(m);
+      return make_unexpected(error_code(ENOMEM, std::system_category()));
+    }
+    return purgeable(std::move(a), m, std::move(saved));
+  }
+  //! \brief Allocates at least \em bytes from \em src as a pinned purgeable
+  static expected<purgeable, error_code> allocate(source &src, size_type bytes) BOOST_NOEXCEPT
+  {
+    auto a(src.allocate(bytes));
+    if(!a)
+      return make_unexpected(a.error());
+    return make(std::move(*a));
+  }
+
+  //! \brief The allocation
+  const source::pointer &get_allocation() const BOOST_NOEXCEPT { return _a; }
+  //! \brief The map of the allocation, whose contents are only usable while pinned
+  const allocation::map_t &map() const BOOST_NOEXCEPT { return _m; }
+  //! \brief The mapped address
+  void *data() const BOOST_NOEXCEPT { return _m.addr; }
+  //! \brief The mapped length
+  size_type size() const BOOST_NOEXCEPT { return _m.length; }
+  //! \brief True if the contents are pinned
+  bool pinned() const BOOST_NOEXCEPT { return _pinned; }
+
+  /*! \brief Lets the kernel reclaim the contents under memory pressure until pin() is called. The
+  contents must not be touched meanwhile.
+  */
+  error_code unpin() BOOST_NOEXCEPT
+  {
+    if(!_m.addr || !_pinned)
+      return error_code(EINVAL, std::system_category());
+    auto pages(_pages());
+    const size_type page_bytes=page_size();
+    word_type *saved=_saved.data();
+    for(char *p=pages.first; p<pages.second; p+=page_bytes, ++saved)
+    {
+      *saved=*(word_type *) p;
+      *(word_type *) p=_sentinel;
+    }
+    _pinned=false;
+    if(!_lazy || pages.first==pages.second)
+      return error_code();
+#ifdef __linux__
+    if(-1==madvise(pages.first, pages.second-pages.first, MADV_FREE))
+    {
+      // Not private anonymous memory, or no MADV_FREE, so it will just never be purged
+      if(errno==EINVAL)
+      {
+        _lazy=false;
+        return error_code();
+      }
+      return error_code(errno, std::system_category());
+    }
+#endif
+    return error_code();
+  }
+
+  /*! \brief Pins the contents again, returning how many pages the kernel reclaimed while they were
+  unpinned. If any were, the contents are lost and should be recreated: pages reclaimed read as
+  zero, the rest as before.
+  */
+  expected<pin_result_t, error_code> pin() BOOST_NOEXCEPT
+  {
+    if(!_m.addr || _pinned)
+      return make_unexpected(error_code(EINVAL, std::system_category()));
+    pin_result_t ret={ 0, 0 };
+    auto pages(_pages());
+    const size_type page_bytes=page_size();
+    const word_type *saved=_saved.data();
+    for(char *p=pages.first; p<pages.second; p+=page_bytes, ++saved, ++ret.pages)
+    {
+      // Writing the page, as a successful swap does, stops the kernel taking it from here on
+      if(!_cas((word_type *) p, _sentinel, *saved))
+        ++ret.purged;
+    }
+    _pinned=true;
+    return ret;
+  }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
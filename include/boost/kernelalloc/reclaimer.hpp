@@ -0,0 +1,302 @@
+/* reclaimer.hpp
+Proactively pages out idle allocations
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_RECLAIMER_HPP
+#define BOOST_KERNELALLOC_RECLAIMER_HPP
+
+#include "page_size.hpp"
+#include <algorithm>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+// Older glibc headers predate Linux 5.4
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+#endif
+
+/*! \file reclaimer.hpp
+ * \brief Provides a background reclaimer of idle allocations
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+/*! \class reclaimer
+ * \brief Pushes the least recently used allocations out of RAM before the kernel has to.
+ *
+ * When the system comes under memory pressure the kernel's own reclaim runs in the context of
+ * whichever thread happened to page fault, which is quite often a latency critical one. A reclaimer
+ * tracks a set of allocations, ranks them by how long ago they were last mapped or touched, and
+ * every pass advises the kernel about the coldest of them: idle allocations are marked `MADV_COLD`
+ * so they are first in line for reclaim, and very idle allocations are `MADV_PAGEOUT`-ed to swap
+ * or writeback immediately. The amount of work done per pass is bounded, so reclaim becomes
+ * controlled background work instead of a stall.
+ *
+ * An allocation which has been advised is not advised again until it has been touched since.
+ * Only maps currently present in this process can be advised. On anything other than Linux 5.4
+ * or later each pass does nothing and reports `ENOSYS` or `EINVAL` respectively.
+ */
+class reclaimer
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+  //! \brief The clock used to measure idleness
+  typedef chrono::steady_clock clock_type;
+
+  //! \brief Configures how aggressive a reclaimer is
+  struct config_t
+  {
+    clock_type::duration cold_after;      //!< Allocations idle for longer than this are marked cold
+    clock_type::duration pageout_after;   //!< Allocations idle for longer than this are paged out
+    size_type max_bytes_per_pass;         //!< The maximum bytes advised in a single pass
+    size_type max_allocations_per_pass;   //!< The maximum allocations advised in a single pass
+    clock_type::duration interval;        //!< How often the background thread runs a pass
+    config_t() : cold_after(chrono::seconds(30)), pageout_after(chrono::seconds(300)),
+      max_bytes_per_pass(64*1024*1024), max_allocations_per_pass(256), interval(chrono::seconds(1)) { }
+  };
+
+  //! \brief What a single pass did
+  struct pass_t
+  {
+    size_type cold_bytes;         //!< Bytes marked cold
+    size_type pageout_bytes;      //!< Bytes paged out
+    size_type allocations;        //!< Allocations advised
+    size_type expired;            //!< Tracked allocations found to no longer exist
+    error_code ec;                //!< The first error which occurred during the pass
+    pass_t() : cold_bytes(0), pageout_bytes(0), allocations(0), expired(0) { }
+  };
+private:
+  struct entry_t
+  {
+    std::weak_ptr<allocation> a;
+    clock_type::rep advised_at;  // the last_used() seen when last advised, or zero
+    entry_t(std::weak_ptr<allocation> _a) : a(std::move(_a)), advised_at(0) { }
+  };
+  struct candidate_t
+  {
+    std::shared_ptr<allocation> a;
+    size_type index;              // of its entry when found, which untrack() may since have moved
+    clock_type::rep last_used;
+    clock_type::duration idle;
+    bool operator<(const candidate_t &o) const BOOST_NOEXCEPT { return idle>o.idle; }
+  };
+  config_t _config;
+  mutex _lock;
+  std::vector<entry_t> _entries;
+  bool _done;
+  condition_variable _changed;
+  thread _thread;
+
+  // Advises the whole pages within each map of a, clipped to at most budget bytes in total,
+  // returning bytes advised
+  static size_type _advise(allocation &a, bool pageout, size_type budget, error_code &ec) BOOST_NOEXCEPT
+  {
+    size_type bytes=0;
+    budget=page_round_down(budget);
+#ifdef __linux__
+    for(auto &m : a.maps())
+    {
+      if(bytes>=budget)
+        break;
+      if(!m.addr)
+        continue;
+      size_type begin=page_round_up((size_type) m.addr);
+      size_type end=page_round_down((size_type) m.addr+m.length);
+      if(end<=begin)
+        continue;
+      if(end-begin>budget-bytes)
+        end=begin+(budget-bytes);
+      if(-1==madvise((void *) begin, end-begin, pageout ? MADV_PAGEOUT : MADV_COLD))
+      {
+        if(!ec)
+          ec=error_code(errno, std::system_category());
+        continue;
+      }
+      bytes+=end-begin;
+    }
+#else
+    (void) a; (void) pageout; (void) budget;
+    if(!ec)
+      ec=error_code(ENOSYS, std::system_category());
+#endif
+    return bytes;
+  }
+public:
+  //! \brief Constructs a reclaimer. No background thread runs until start() is called.
+  reclaimer(config_t config=config_t()) : _config(std::move(config)), _done(false) { }
+  reclaimer(const reclaimer &)=delete;
+  reclaimer &operator=(const reclaimer &)=delete;
+  ~reclaimer() { stop(); }
+
+  //! \brief The configuration of this reclaimer
+  const config_t &config() const BOOST_NOEXCEPT { return _config; }
+
+  //! \brief Starts tracking \em a. The reclaimer does not keep \em a alive.
+  void track(const std::shared_ptr<allocation> &a)
+  {
+    lock_guard<mutex> g(_lock);
+    _entries.push_back(entry_t(a));
+  }
+
+  //! \brief Stops tracking \em a
+  void untrack(const allocation *a) BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> g(_lock);
+    _entries.erase(std::remove_if(_entries.begin(), _entries.end(), [a](const entry_t &e)
+    {
+      auto p(e.a.lock());
+      return !p || p.get()==a;
+    }), _entries.end());
+  }
+
+  //! \brief The number of allocations being tracked, including any which have since expired
+  size_type tracked() BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> g(_lock);
+    return _entries.size();
+  }
+
+  /*! \brief Runs a single pass, advising the coldest allocations first until the per pass budget
+  is exhausted. The allocation which exhausts the byte budget is advised only up to it, and the
+  rest of it is left until it has been touched and gone cold again. Expired allocations are forgotten. The candidates are chosen under the lock, but
+  advised with it released, so track() and untrack() never wait on the kernel.
+  */
+  pass_t reclaim_once() BOOST_NOEXCEPT
+  {
+    pass_t ret;
+    const clock_type::time_point now(clock_type::now());
+    std::vector<candidate_t> candidates;
+    try
+    {
+      lock_guard<mutex> g(_lock);
+      candidates.reserve(_entries.size());
+      for(size_type n=0; n<_entries.size(); n++)
+      {
+        entry_t &e=_entries[n];
+        candidate_t c;
+        c.a=e.a.lock();
+        if(!c.a)
+        {
+          ++ret.expired;
+          continue;
+        }
+        c.index=n;
+        c.last_used=c.a->last_used().time_since_epoch().count();
+        if(e.advised_at==c.last_used)
+          continue;
+        c.idle=now-clock_type::time_point(clock_type::duration(c.last_used));
+        if(c.idle>=_config.cold_after)
+          candidates.push_back(std::move(c));
+      }
+      if(ret.expired)
+        _entries.erase(std::remove_if(_entries.begin(), _entries.end(), [](const entry_t &e) { return e.a.expired(); }), _entries.end());
+    }
+    catch(...)
+    {
+      ret.ec=error_code(ENOMEM, std::system_category());
+      return ret;
+    }
+    // Coldest first
+    std::sort(candidates.begin(), candidates.end());
+    size_type advised=0;
+    for(auto &c : candidates)
+    {
+      const size_type spent=ret.cold_bytes+ret.pageout_bytes;
+      // Not even a page left to advise
+      if(ret.allocations>=_config.max_allocations_per_pass || spent+page_size()>_config.max_bytes_per_pass)
+        break;
+      bool pageout=c.idle>=_config.pageout_after;
+      size_type bytes=_advise(*c.a, pageout, _config.max_bytes_per_pass-spent, ret.ec);
+      (pageout ? ret.pageout_bytes : ret.cold_bytes)+=bytes;
+      ++ret.allocations;
+      ++advised;
+    }
+    // Remember what each was advised at, so it is skipped until it is next used
+    lock_guard<mutex> g(_lock);
+    for(size_type i=0; i<advised; i++)
+    {
+      const candidate_t &c=candidates[i];
+      auto same=[&c](const entry_t &e) { return e.a.lock()==c.a; };
+      if(c.index<_entries.size() && same(_entries[c.index]))
+        _entries[c.index].advised_at=c.last_used;
+      else
+      {
+        auto it=std::find_if(_entries.begin(), _entries.end(), same);
+        if(it!=_entries.end())
+          it->advised_at=c.last_used;
+      }
+    }
+    return ret;
+  }
+
+  //! \brief Starts a background thread calling reclaim_once() every config().interval
+  void start()
+  {
+    lock_guard<mutex> g(_lock);
+    if(_thread.joinable())
+      return;
+    _done=false;
+    _thread=thread([this]
+    {
+      unique_lock<mutex> g(_lock);
+      while(!_done)
+      {
+        if(_changed.wait_for(g, _config.interval, [this] { return _done; }))
+          break;
+        g.unlock();
+        reclaim_once();
+        g.lock();
+      }
+    });
+  }
+
+  //! \brief Stops any background thread, waiting for any pass in progress to complete
+  void stop() BOOST_NOEXCEPT
+  {
+    {
+      lock_guard<mutex> g(_lock);
+      _done=true;
+    }
+    _changed.notify_all();
+    if(_thread.joinable())
+      _thread.join();
+  }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
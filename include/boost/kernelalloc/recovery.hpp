@@ -0,0 +1,430 @@
+/* recovery.hpp
+Crash recovery of allocation tables and orphaned segments
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_RECOVERY_HPP
+#define BOOST_KERNELALLOC_RECOVERY_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#ifndef WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*! \file recovery.hpp
+ * \brief Provides validation of allocation tables and background reclaim of segments orphaned by dead processes
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+//! \brief An extent of a backing store, as recorded in a source's allocation table
+struct extent_t
+{
+  unsigned long long offset;    //!< The offset of the extent
+  unsigned long long length;    //!< The length of the extent
+  unsigned long long id;        //!< The unique id of the allocation, unused for free extents
+};
+
+//! \brief The outcome of validate_extents()
+struct extent_table_t
+{
+  std::vector<extent_t> allocated;  //!< The valid allocations, in offset order
+  std::vector<extent_t> free;       //!< The coalesced gaps between them, in offset order
+  std::vector<extent_t> invalid;    //!< Entries which were rejected, whose storage is treated as free
+};
+
+/*! \brief Validates an allocation table read back after a crash, and rebuilds the free extents
+from it. Entries which are empty, misaligned to \em alignment, extend past \em capacity, repeat
+an id already seen, or overlap an earlier valid entry are rejected. Everything not covered by a
+valid entry becomes free. The sources in this library keep no allocation table of their own yet,
+so this is for callers persisting one themselves, e.g. through a journal.
+*/
+inline expected<extent_table_t, error_code> validate_extents(std::vector<extent_t> table, unsigned long long capacity, unsigned long long alignment=1) BOOST_NOEXCEPT
+{
+  try
+  {
+    extent_table_t ret;
+    std::sort(table.begin(), table.end(), [](const extent_t &a, const extent_t &b) { return a.offset<b.offset || (a.offset==b.offset && a.length<b.length); });
+    std::vector<unsigned long long> ids;
+    ids.reserve(table.size());
+    for(auto &e : table)
+      ids.push_back(e.id);
+    std::sort(ids.begin(), ids.end());
+    // Ids appearing more than once are all suspect, as which is the real one is unknowable
+    auto duplicated=[&ids](unsigned long long id)
+    {
+      auto range=std::equal_range(ids.begin(), ids.end(), id);
+      return range.second-range.first>1;
+    };
+    unsigned long long end=0;
+    for(auto &e : table)
+    {
+      if(!e.length || (alignment>1 && (e.offset % alignment)) || e.offset>capacity || e.length>capacity-e.offset || e.offset<end || duplicated(e.id))
+      {
+        ret.invalid.push_back(e);
+        continue;
+      }
+      if(e.offset>end)
+      {
+        extent_t f={ end, e.offset-end, 0 };
+        ret.free.push_back(f);
+      }
+      ret.allocated.push_back(e);
+      end=e.offset+e.length;
+    }
+    if(end<capacity)
+    {
+      extent_t f={ end, capacity-end, 0 };
+      ret.free.push_back(f);
+    }
+    return ret;
+  }
+  catch(...)
+  {
+    return make_unexpected(error_code(ENOMEM, std::system_category()));
+  }
+}
+
+/*! \class process_lock
+ * \brief Marks the segments this process creates as owned by a live process, so recovery in
+ * other processes leaves them alone.
+ *
+ * Acquiring the lock creates the file \em prefix.pid.lock in the segment directory and holds an
+ * exclusive flock() on it for the lifetime of the process lock. Segments named with
+ * segment_name() carry the same prefix and pid. Because the kernel drops the flock when a process
+ * dies however it dies, another process can tell a crashed owner from a live one reliably, even if
+ * the pid has since been reused.
+ */
+class process_lock
+{
+  std::string _directory, _prefix, _lockfile;
+  int _fd;
+public:
+  //! \brief Constructs a process lock which locks nothing
+  process_lock() BOOST_NOEXCEPT : _fd(-1) { }
+  //! \brief The default directory, where POSIX shared memory segments live on Linux
+  static const char *default_directory() BOOST_NOEXCEPT { return "/dev/shm"; }
+  //! \brief The default prefix of segment names
+  static const char *default_prefix() BOOST_NOEXCEPT { return "boost_kernelalloc"; }
+
+  //! \brief Creates and locks the lock file for this process
+  static expected<process_lock, error_code> acquire(std::string directory=default_directory(), std::string prefix=default_prefix()) BOOST_NOEXCEPT
+  {
+#ifdef WIN32
+    (void) directory; (void) prefix;
+    return make_unexpected(error_code(ENOSYS, std::system_category()));
+#else
+    try
+    {
+      process_lock ret;
+      ret._directory=std::move(directory);
+      ret._prefix=std::move(prefix);
+      ret._lockfile=ret._directory+"/"+ret._prefix+"."+std::to_string((long long) getpid())+".lock";
+      ret._fd=::open(ret._lockfile.c_str(), O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+      if(-1==ret._fd)
+        return make_unexpected(error_code(errno, std::system_category()));
+      if(-1==::flock(ret._fd, LOCK_EX|LOCK_NB))
+        return make_unexpected(error_code(errno, std::system_category()));
+      return expected<process_lock, error_code>(std::move(ret));
+    }
+    catch(...)
+    {
+      return make_unexpected(error_code(ENOMEM, std::system_category()));
+    }
+#endif
+  }
+  process_lock(process_lock &&o) BOOST_NOEXCEPT : _directory(std::move(o._directory)), _prefix(std::move(o._prefix)), _lockfile(std::move(o._lockfile)), _fd(o._fd) { o._fd=-1; }
+  process_lock &operator=(process_lock &&o) BOOST_NOEXCEPT
+  {
+    std::swap(_directory, o._directory);
+    std::swap(_prefix, o._prefix);
+    std::swap(_lockfile, o._lockfile);
+    std::swap(_fd, o._fd);
+    return *this;
+  }
+  process_lock(const process_lock &)=delete;
+  process_lock &operator=(const process_lock &)=delete;
+  //! \brief Removes the lock file. Any segments still named for this process then look orphaned.
+  ~process_lock()
+  {
+#ifndef WIN32
+    if(-1!=_fd)
+    {
+      ::unlink(_lockfile.c_str());
+      ::close(_fd);
+    }
+#endif
+  }
+  //! \brief The directory holding the lock file and segments
+  const std::string &directory() const BOOST_NOEXCEPT { return _directory; }
+  //! \brief The prefix of the lock file and segments
+  const std::string &prefix() const BOOST_NOEXCEPT { return _prefix; }
+  //! \brief Returns the name, without directory, to give a segment owned by this process
+  std::string segment_name(const std::string &suffix) const
+  {
+#ifdef WIN32
+    return _prefix+"."+suffix;
+#else
+    return _prefix+"."+std::to_string((long long) getpid())+"."+suffix;
+#endif
+  }
+};
+
+/*! \class orphan_reclaimer
+ * \brief Finds segments left behind by dead processes and removes them, a few at a time in the background.
+ *
+ * Segments named by process_lock::segment_name() are grouped by the pid in their name. A pid's
+ * segments are orphaned if its lock file exists but is no longer flock()ed, or if it has no lock
+ * file and no process of that pid exists. Segments younger than config_t::min_age are left alone
+ * in case their owner is still starting up. Files not matching the naming scheme are never touched.
+ *
+ * Each step() reads at most config_t::batch directory entries, so a directory of many thousands of
+ * segments is worked through incrementally and startup is never blocked. start() runs steps on a
+ * background thread.
+ */
+class orphan_reclaimer
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+
+  //! \brief Configures a reclaimer
+  struct config_t
+  {
+    std::string directory;                  //!< The directory to scan
+    std::string prefix;                     //!< Only names starting with prefix and a dot are considered
+    size_type batch;                        //!< The directory entries examined per step
+    chrono::seconds min_age;                //!< Segments modified more recently than this are never reclaimed
+    chrono::steady_clock::duration interval;  //!< The delay between steps of the background thread
+    chrono::steady_clock::duration rescan;  //!< The delay between passes of the background thread
+    bool dry_run;                           //!< Count orphans but don't remove them
+    config_t() : directory(process_lock::default_directory()), prefix(process_lock::default_prefix()), batch(64),
+      min_age(60), interval(chrono::milliseconds(10)), rescan(chrono::seconds(60)), dry_run(false) { }
+  };
+
+  //! \brief Running totals of reclaim
+  struct stats_t
+  {
+    size_type passes;                 //!< Complete passes over the directory
+    size_type scanned;                //!< Entries matching the prefix examined
+    size_type orphaned;               //!< Segments found orphaned
+    unsigned long long bytes;         //!< Storage used by the orphaned segments
+    error_code ec;                    //!< The first error encountered
+    stats_t() : passes(0), scanned(0), orphaned(0), bytes(0) { }
+  };
+private:
+  config_t _config;
+  mutex _lock;
+  stats_t _stats;
+#ifndef WIN32
+  DIR *_dir;
+#endif
+  std::map<long long, bool> _alive;   // Liveness of pids seen this pass
+  bool _done;
+  condition_variable _changed;
+  thread _thread;
+
+#ifndef WIN32
+  bool _is_alive(long long pid)
+  {
+    auto it=_alive.find(pid);
+    if(it!=_alive.end())
+      return it->second;
+    bool alive;
+    std::string lockfile(_config.directory+"/"+_config.prefix+"."+std::to_string(pid)+".lock");
+    int fd=::open(lockfile.c_str(), O_RDONLY|O_CLOEXEC);
+    if(-1!=fd)
+    {
+      alive=(-1==::flock(fd, LOCK_SH|LOCK_NB));
+      ::close(fd);
+    }
+    else
+      alive=(pid==(long long) getpid()) || !(-1==::kill((pid_t) pid, 0) && ESRCH==errno);
+    _alive[pid]=alive;
+    return alive;
+  }
+  void _examine(const char *name)
+  {
+    const size_t prefixlen=_config.prefix.size();
+    if(strncmp(name, _config.prefix.c_str(), prefixlen) || '.'!=name[prefixlen])
+      return;
+    char *end;
+    long long pid=strtoll(name+prefixlen+1, &end, 10);
+    if(end==name+prefixlen+1 || '.'!=*end || pid<=0)
+      return;
+    ++_stats.scanned;
+    // Lock files are removed after the segments of their pid, on a later pass
+    const bool lockfile=!strcmp(end, ".lock");
+    if(_is_alive(pid))
+      return;
+    std::string file(_config.directory+"/"+name);
+    struct stat s;
+    if(-1==::lstat(file.c_str(), &s) || !S_ISREG(s.st_mode))
+      return;
+    if(time(nullptr)-s.st_mtime<(time_t) _config.min_age.count())
+      return;
+    if(lockfile)
+    {
+      if(!_config.dry_run)
+        ::unlink(file.c_str());
+      return;
+    }
+    ++_stats.orphaned;
+    _stats.bytes+=(unsigned long long) s.st_blocks*512;
+    if(!_config.dry_run && -1==::unlink(file.c_str()) && ENOENT!=errno && !_stats.ec)
+      _stats.ec=error_code(errno, std::system_category());
+  }
+#endif
+public:
+  //! \brief Constructs a reclaimer. Nothing is scanned until step() or start() is called.
+  orphan_reclaimer(config_t config=config_t()) : _config(std::move(config)),
+#ifndef WIN32
+    _dir(nullptr),
+#endif
+    _done(false) { }
+  orphan_reclaimer(const orphan_reclaimer &)=delete;
+  orphan_reclaimer &operator=(const orphan_reclaimer &)=delete;
+  ~orphan_reclaimer()
+  {
+    stop();
+#ifndef WIN32
+    if(_dir)
+      closedir(_dir);
+#endif
+  }
+
+  //! \brief The configuration of this reclaimer
+  const config_t &config() const BOOST_NOEXCEPT { return _config; }
+
+  //! \brief The totals so far
+  stats_t stats() BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> g(_lock);
+    return _stats;
+  }
+
+  /*! \brief Examines up to config().batch directory entries, returning true if this completed a
+  pass over the directory, in which case the next step begins a new pass.
+  */
+  bool step() BOOST_NOEXCEPT
+  {
+#ifdef WIN32
+    return true;
+#else
+    lock_guard<mutex> g(_lock);
+    try
+    {
+      if(!_dir)
+      {
+        _alive.clear();
+        if(!(_dir=opendir(_config.directory.c_str())))
+        {
+          if(!_stats.ec)
+            _stats.ec=error_code(errno, std::system_category());
+          return true;
+        }
+      }
+      for(size_type n=0; n<_config.batch; n++)
+      {
+        dirent *e=readdir(_dir);
+        if(!e)
+        {
+          closedir(_dir);
+          _dir=nullptr;
+          ++_stats.passes;
+          return true;
+        }
+        _examine(e->d_name);
+      }
+    }
+    catch(...)
+    {
+      if(!_stats.ec)
+        _stats.ec=error_code(ENOMEM, std::system_category());
+    }
+    return false;
+#endif
+  }
+
+  //! \brief Runs steps until a pass completes, returning the totals
+  stats_t run_once() BOOST_NOEXCEPT
+  {
+    while(!step());
+    return stats();
+  }
+
+  //! \brief Starts a background thread stepping every config().interval, pausing config().rescan between passes
+  void start()
+  {
+    lock_guard<mutex> g(_lock);
+    if(_thread.joinable())
+      return;
+    _done=false;
+    _thread=thread([this]
+    {
+      unique_lock<mutex> g(_lock);
+      chrono::steady_clock::duration delay=_config.interval;
+      while(!_done)
+      {
+        if(_changed.wait_for(g, delay, [this] { return _done; }))
+          break;
+        g.unlock();
+        delay=step() ? _config.rescan : _config.interval;
+        g.lock();
+      }
+    });
+  }
+
+  //! \brief Stops any background thread
+  void stop() BOOST_NOEXCEPT
+  {
+    {
+      lock_guard<mutex> g(_lock);
+      _done=true;
+    }
+    _changed.notify_all();
+    if(_thread.joinable())
+      _thread.join();
+  }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
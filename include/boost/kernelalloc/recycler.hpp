@@ -0,0 +1,400 @@
+/* recycler.hpp
+Reuse of freed allocations with their memory returned to the kernel as they age
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_RECYCLER_HPP
+#define BOOST_KERNELALLOC_RECYCLER_HPP
+
+#include <algorithm>
+#include <map>
+
+/*! \file recycler.hpp
+ * \brief Provides a cache of freed allocations whose memory is given back to the kernel as it ages
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+/*! \class recycler
+ * \brief Keeps freed allocations mapped for reuse, giving their memory back progressively the
+ * longer they go unused.
+ *
+ * Mapping and faulting in fresh memory is expensive, so freed allocations are worth keeping for
+ * the next request of a similar size. Kept forever though, a load spike leaves the process at its
+ * peak footprint for good. A recycler decays what it keeps in stages, in the manner of jemalloc's
+ * dirty and muzzy decay:
+ *  - cached: kept as is, and reused at no cost.
+ *  - lazily freed: discarded with discard_policy::lazy after free_after. The kernel takes the
+ *    pages only if it needs them, so reuse is still cheap unless it did. Where a map cannot be
+ *    lazily discarded this stage is skipped.
+ *  - discarded: discard()-ed after discard_after, so the pages are gone and reuse faults them
+ *    back in, but the allocation and its map are kept.
+ *  - released: unmapped and dropped after unmap_after.
+ *
+ * Each decay pass moves the oldest allocations due first and stops once it has advised
+ * max_bytes_per_pass, so the work after a spike is spread across many passes instead of one
+ * caller paying for it. Passes run on a background thread every interval once start() is called,
+ * or whenever decay_once() is called. The contents of a reused allocation are unspecified.
+ */
+class recycler
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+  //! \brief The clock used to measure age
+  typedef chrono::steady_clock clock_type;
+
+  //! \brief How far an allocation kept has decayed
+  enum class stage
+  {
+    cached,       //!< Untouched since it was recycled
+    lazily_freed, //!< MADV_FREE-d, the kernel may have taken its pages
+    discarded     //!< Discarded, its pages are gone
+  };
+
+  //! \brief Configures how quickly memory decays
+  struct config_t
+  {
+    clock_type::duration free_after;      //!< Cached allocations unused for longer than this are lazily discarded
+    clock_type::duration discard_after;   //!< Allocations unused for longer than this are discarded
+    clock_type::duration unmap_after;     //!< Allocations unused for longer than this are released
+    size_type max_bytes_per_pass;         //!< The maximum bytes decayed in a single pass
+    size_type max_bytes;                  //!< Allocations recycled beyond this many bytes kept are released at once
+    clock_type::duration interval;        //!< How often the background thread runs a pass
+    config_t() : free_after(chrono::seconds(10)), discard_after(chrono::seconds(60)), unmap_after(chrono::seconds(600)),
+      max_bytes_per_pass(16*1024*1024), max_bytes((size_type) -1), interval(chrono::milliseconds(100)) { }
+  };
+
+  //! \brief What a single pass did
+  struct pass_t
+  {
+    size_type lazily_freed_bytes; //!< Bytes MADV_FREE-d
+    size_type discarded_bytes;    //!< Bytes discarded
+    size_type released_bytes;     //!< Bytes released
+    error_code ec;                //!< The first error which occurred during the pass
+    pass_t() : lazily_freed_bytes(0), discarded_bytes(0), released_bytes(0) { }
+  };
+
+  //! \brief The bytes kept in each stage, and how often recycling paid off
+  struct stats_t
+  {
+    size_type cached_bytes;       //!< Bytes kept untouched
+    size_type lazily_freed_bytes; //!< Bytes kept MADV_FREE-d
+    size_type discarded_bytes;    //!< Bytes kept discarded
+    size_type reused;             //!< Requests satisfied by a kept allocation
+    size_type missed;             //!< Requests with no kept allocation large enough
+    stats_t() : cached_bytes(0), lazily_freed_bytes(0), discarded_bytes(0), reused(0), missed(0) { }
+  };
+private:
+  struct entry_t
+  {
+    source::pointer a;
+    allocation::map_t m;
+    recycler::stage stage;
+    clock_type::time_point since;  // when recycled
+  };
+  // Keyed by size, and for each size in the order recycled, so the most recently recycled is last
+  typedef std::multimap<size_type, entry_t> entries_t;
+  config_t _config;
+  mutex _lock;
+  entries_t _entries;
+  stats_t _stats;
+  bool _done;
+  condition_variable _changed;
+  thread _thread;
+
+  size_type &_bytes_in(recycler::stage s) BOOST_NOEXCEPT
+  {
+    return s==stage::cached ? _stats.cached_bytes : s==stage::lazily_freed ? _stats.lazily_freed_bytes : _stats.discarded_bytes;
+  }
+  size_type _kept() const BOOST_NOEXCEPT { return _stats.cached_bytes+_stats.lazily_freed_bytes+_stats.discarded_bytes; }
+  static void _release(entry_t &e) BOOST_NOEXCEPT
+  {
+    if(e.m.addr)
+      e.a->unmap(e.m);
+    e.a.reset();
+  }
+public:
+  //! \brief Constructs a recycler. No background thread runs until start() is called.
+  recycler(config_t config=config_t()) : _config(std::move(config)), _done(false) { }
+  recycler(const recycler &)=delete;
+  recycler &operator=(const recycler &)=delete;
+  //! \brief Stops any background thread and releases everything kept
+  ~recycler()
+  {
+    stop();
+    for(auto &e : _entries)
+      _release(e.second);
+  }
+
+  //! \brief The configuration of this recycler
+  const config_t &config() const BOOST_NOEXCEPT { return _config; }
+  //! \brief The bytes kept in each stage and the reuse counts
+  stats_t stats() BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> g(_lock);
+    return _stats;
+  }
+
+  /*! \brief Keeps \em a, mapped at \em m, for reuse. If keeping it would exceed max_bytes, or it
+  cannot be kept, it is released at once.
+  */
+  void recycle(source::pointer a, allocation::map_t m) BOOST_NOEXCEPT
+  {
+    entry_t e;
+    e.a=std::move(a);
+    e.m=m;
+    e.stage=stage::cached;
+    e.since=clock_type::now();
+    // It was written through while in use, whatever its source last knew to be zero
+    e.a->mark_written(0, e.a->size());
+    const size_type bytes=e.a->size();
+    {
+      lock_guard<mutex> g(_lock);
+      if(_kept()+bytes<=_config.max_bytes)
+      {
+        try
+        {
+          _entries.insert(entries_t::value_type(bytes, std::move(e)));
+          _stats.cached_bytes+=bytes;
+          return;
+        }
+        catch(...)
+        {
+        }
+      }
+    }
+    _release(e);
+  }
+
+  /*! \brief Returns the most recently recycled of the smallest allocations kept of at least \em bytes,
+  with its map, or a null pointer if none is kept. A decayed allocation is still mapped, but its
+  pages fault back in on first touch. If \em stage_ is not null it is set to how far the
+  allocation returned had decayed.
+  */
+  std::pair<source::pointer, allocation::map_t> take(size_type bytes, recycler::stage *stage_=nullptr) BOOST_NOEXCEPT
+  {
+    lock_guard<mutex> g(_lock);
+    auto it=_entries.lower_bound(bytes);
+    if(it==_entries.end())
+    {
+      ++_stats.missed;
+      return std::make_pair(source::pointer(), allocation::map_t());
+    }
+    it=std::prev(_entries.upper_bound(it->first));
+    entry_t &e=it->second;
+    _bytes_in(e.stage)-=it->first;
+    if(stage_)
+      *stage_=e.stage;
+    std::pair<source::pointer, allocation::map_t> ret(std::move(e.a), e.m);
+    _entries.erase(it);
+    ++_stats.reused;
+    return ret;
+  }
+
+  //! \brief Reuses a kept allocation of at least \em bytes, else allocates and maps one from \em src
+  expected<std::pair<source::pointer, allocation::map_t>, error_code> acquire(source &src, size_type bytes) BOOST_NOEXCEPT
+  {
+    auto ret(take(bytes));
+    if(ret.first)
+      return ret;
+    auto a(src.allocate(bytes));
+    if(!a)
+      return make_unexpected(a.error());
+    allocation::map_t m((*a)->map());
+    if(!m.addr)
+      return make_unexpected(m.ec);
+    return std::make_pair(std::move(*a), m);
+  }
+  
+  /*! \brief As acquire(), but the map returned reads as zero. A lazily freed allocation has only
+  the pages the kernel did not reclaim cleared, and others only what is not known zero.
+  */
+  expected<std::pair<source::pointer, allocation::map_t>, error_code> acquire_zeroed(source &src, size_type bytes) BOOST_NOEXCEPT
+  {
+    recycler::stage s;
+    auto ret(take(bytes, &s));
+    if(!ret.first)
+      return src.allocate_zeroed(bytes);
+    auto z(s==stage::lazily_freed ? allocation::zero_unreclaimed(ret.second) : ret.first->ensure_zero(ret.second));
+    if(!z)
+    {
+      // Couldn't tell, so clear the lot
+      memset(ret.second.addr, 0, ret.second.length);
+    }
+    if(s==stage::lazily_freed)
+      ret.first->mark_written(ret.second.offset, ret.second.length);
+    return ret;
+  }
+
+  /*! \brief Runs a single pass, moving the longest unused allocations due on to their next stage
+  until the per pass budget is exhausted.
+  */
+  pass_t decay_once() BOOST_NOEXCEPT
+  {
+    pass_t ret;
+    const clock_type::time_point now(clock_type::now());
+    std::vector<entry_t> work;
+    std::vector<size_type> sizes;
+    {
+      lock_guard<mutex> g(_lock);
+      std::vector<entries_t::iterator> due;
+      try
+      {
+        for(auto it=_entries.begin(); it!=_entries.end(); ++it)
+        {
+          const clock_type::duration idle=now-it->second.since;
+          if(idle>=_config.unmap_after || (it->second.stage!=stage::discarded && idle>=_config.discard_after)
+            || (it->second.stage==stage::cached && idle>=_config.free_after))
+            due.push_back(it);
+        }
+        // Oldest first, and take them out while they are worked on so they can't be reused half way
+        std::sort(due.begin(), due.end(), [](entries_t::iterator a, entries_t::iterator b) { return a->second.since<b->second.since; });
+        size_type budget=0;
+        work.reserve(due.size());
+        sizes.reserve(due.size());
+        for(auto it : due)
+        {
+          if(budget>=_config.max_bytes_per_pass)
+            break;
+          budget+=it->first;
+          _bytes_in(it->second.stage)-=it->first;
+          sizes.push_back(it->first);
+          work.push_back(std::move(it->second));
+          _entries.erase(it);
+        }
+      }
+      catch(...)
+      {
+        ret.ec=error_code(ENOMEM, std::system_category());
+      }
+    }
+    for(auto &e : work)
+    {
+      const clock_type::duration idle=now-e.since;
+      if(idle>=_config.unmap_after)
+      {
+        ret.released_bytes+=e.a->size();
+        _release(e);
+        continue;
+      }
+      // Only anonymous private maps can be lazily freed, the rest go straight to discarded
+      allocation::map_t d(e.m);
+      bool lazily=false;
+      if(e.a->discard(d, idle<_config.discard_after ? discard_policy::lazy : discard_policy::immediate, &lazily))
+      {
+        (lazily ? ret.lazily_freed_bytes : ret.discarded_bytes)+=d.length;
+        e.stage=lazily ? stage::lazily_freed : stage::discarded;
+      }
+      else
+      {
+        if(!ret.ec)
+          ret.ec=d.ec;
+        e.stage=stage::discarded;
+      }
+    }
+    {
+      lock_guard<mutex> g(_lock);
+      for(size_type n=0; n<work.size(); n++)
+      {
+        if(!work[n].a)
+          continue;
+        try
+        {
+          _bytes_in(work[n].stage)+=sizes[n];
+          _entries.insert(entries_t::value_type(sizes[n], std::move(work[n])));
+        }
+        catch(...)
+        {
+          _bytes_in(work[n].stage)-=sizes[n];
+          _release(work[n]);
+        }
+      }
+    }
+    return ret;
+  }
+
+  //! \brief Releases everything kept at once, returning the bytes released
+  size_type release_all() BOOST_NOEXCEPT
+  {
+    entries_t entries;
+    {
+      lock_guard<mutex> g(_lock);
+      entries.swap(_entries);
+      _stats.cached_bytes=_stats.lazily_freed_bytes=_stats.discarded_bytes=0;
+    }
+    size_type ret=0;
+    for(auto &e : entries)
+    {
+      ret+=e.first;
+      _release(e.second);
+    }
+    return ret;
+  }
+
+  //! \brief Starts a background thread calling decay_once() every config().interval
+  void start()
+  {
+    lock_guard<mutex> g(_lock);
+    if(_thread.joinable())
+      return;
+    _done=false;
+    _thread=thread([this]
+    {
+      unique_lock<mutex> g(_lock);
+      while(!_done)
+      {
+        if(_changed.wait_for(g, _config.interval, [this] { return _done; }))
+          break;
+        g.unlock();
+        decay_once();
+        g.lock();
+      }
+    });
+  }
+
+  //! \brief Stops any background thread, waiting for any pass in progress to complete
+  void stop() BOOST_NOEXCEPT
+  {
+    {
+      lock_guard<mutex> g(_lock);
+      _done=true;
+    }
+    _changed.notify_all();
+    if(_thread.joinable())
+      _thread.join();
+  }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
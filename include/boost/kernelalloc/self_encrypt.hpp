@@ -0,0 +1,294 @@
+/* self_encrypt.hpp
+Self encryption of large allocations across many cores
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_SELF_ENCRYPT_HPP
+#define BOOST_KERNELALLOC_SELF_ENCRYPT_HPP
+
+#include "tree_hash.hpp"
+#include <functional>
+
+/*! \file self_encrypt.hpp
+ * \brief Provides a parallel self encryption pipeline over allocations
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+/*! \class self_encryptor
+ * \brief Self encrypts a large allocation into chunk allocations using all cores.
+ *
+ * Self encryption splits the input into fixed size chunks (at least three) and hashes each.
+ * Each chunk is then encrypted with a key derived from the hashes of the two chunks before it,
+ * wrapping round at the start, and then obfuscated with a pad derived from its own hash and
+ * those of the same two neighbours. The result is convergent: identical input produces identical
+ * chunks, so they deduplicate, yet no chunk can be decrypted without the data map of hashes.
+ *
+ * Hashing uses BLAKE3, and encryption XORs the chunk with the BLAKE3 extendable output keyed
+ * by the derived key. Hashing and encryption run concurrently over a pool of workers: chunk
+ * n can be encrypted as soon as chunks n-2, n-1 and n have been hashed, so encryption trails
+ * hashing by only a couple of chunks. The number of output allocations in flight, and hence the
+ * extra memory used, is bounded.
+ */
+class self_encryptor
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+  //! \brief A chunk hash
+  typedef tree_hasher::digest_type digest_type;
+
+  //! \brief Configures a self encryptor
+  struct config_t
+  {
+    size_type chunk_size;     //!< The size of each chunk except possibly the last
+    size_type threads;        //!< The number of threads to use, zero means hardware concurrency
+    size_type max_in_flight;  //!< The maximum chunks being encrypted at once, zero means one per thread
+    config_t() : chunk_size(1024*1024), threads(0), max_in_flight(0) { }
+  };
+
+  //! \brief Describes one chunk of the encrypted output
+  struct chunk_info_t
+  {
+    unsigned long long offset;  //!< The offset of this chunk within the input
+    size_type length;           //!< The length of this chunk
+    digest_type pre_hash;       //!< The hash of the chunk before encryption
+    digest_type post_hash;      //!< The hash of the chunk after encryption, and so its name when stored
+  };
+  //! \brief Everything needed to decrypt a set of chunks back into the original
+  struct data_map_t
+  {
+    unsigned long long size;            //!< The size of the original
+    std::vector<chunk_info_t> chunks;   //!< The chunks in order
+  };
+
+  /*! \brief Receives each encrypted chunk. Called concurrently from the worker threads, and
+  not necessarily in chunk order.
+  */
+  typedef std::function<void(size_type index, source::pointer chunk)> sink_type;
+private:
+  config_t _config;
+
+  // Chunk i is encrypted with a key derived from chunks i-1 and i-2, then obfuscated with a pad from all three
+  static void _keystream(const std::vector<chunk_info_t> &chunks, size_type i, unsigned char *out, size_type bytes) BOOST_NOEXCEPT
+  {
+    const size_type n=chunks.size();
+    const digest_type &h0=chunks[i].pre_hash, &h1=chunks[(i+n-1) % n].pre_hash, &h2=chunks[(i+n-2) % n].pre_hash;
+    tree_hasher::config_t serial;
+    serial.threads=1;
+    unsigned char material[96];
+    memcpy(material, h1.data(), 32);
+    memcpy(material+32, h2.data(), 32);
+    tree_hasher::key_type key;
+    tree_hasher("boost.kernelalloc self_encrypt key", serial).hash(material, 64, key.data(), key.size());
+    tree_hasher(key, serial).hash(h0.data(), h0.size(), out, bytes);
+    unsigned char pad[144];
+    memcpy(material, h0.data(), 32);
+    memcpy(material+32, h1.data(), 32);
+    memcpy(material+64, h2.data(), 32);
+    tree_hasher("boost.kernelalloc self_encrypt pad", serial).hash(material, 96, pad, sizeof(pad));
+    for(size_type b=0; b<bytes; b++)
+      out[b]^=pad[b % sizeof(pad)];
+  }
+  static error_code _layout(unsigned long long bytes, size_type chunk_size, std::vector<chunk_info_t> &chunks)
+  {
+    if(bytes<3 || !chunk_size)
+      return error_code(EINVAL, std::system_category());
+    size_type n=(size_type)((bytes+chunk_size-1)/chunk_size);
+    if(n<3)
+    {
+      n=3;
+      chunk_size=(size_type)(bytes/3);
+    }
+    chunks.resize(n);
+    for(size_type i=0; i<n; i++)
+    {
+      chunks[i].offset=(unsigned long long) i*chunk_size;
+      chunks[i].length=(i==n-1) ? (size_type)(bytes-chunks[i].offset) : chunk_size;
+    }
+    return error_code();
+  }
+public:
+  //! \brief Constructs a self encryptor
+  self_encryptor(config_t config=config_t()) : _config(config) { }
+
+  //! \brief The configuration of this encryptor
+  const config_t &config() const BOOST_NOEXCEPT { return _config; }
+
+  /*! \brief Self encrypts the mapped \em input, allocating each encrypted chunk from \em out and
+  passing it to \em sink, returning the data map needed to decrypt them.
+  */
+  expected<data_map_t, error_code> encrypt(const allocation::map_t &input, source &out, sink_type sink) const BOOST_NOEXCEPT
+  {
+    try
+    {
+      data_map_t ret;
+      ret.size=input.length;
+      error_code ec(_layout(input.length, _config.chunk_size, ret.chunks));
+      if(ec)
+        return make_unexpected(ec);
+      const size_type n=ret.chunks.size();
+      const size_type threads=detail::worker_count(_config.threads, 2*n);
+      const size_type max_in_flight=_config.max_in_flight ? _config.max_in_flight : threads;
+      const unsigned char *in=(const unsigned char *) input.addr;
+      tree_hasher::config_t serial;
+      serial.threads=1;
+      const tree_hasher hasher(serial);
+      mutex lock;
+      condition_variable changed;
+      std::vector<char> hashed(n, 0);
+      size_type next_hash=0, next_encrypt=0, in_flight=0;
+      // Chunks are encrypted from chunk 2 onwards, as chunks 0 and 1 need the hashes of the last two
+      auto encryptable=[&]
+      {
+        size_type i=(next_encrypt+2) % n;
+        return hashed[i] && hashed[(i+n-1) % n] && hashed[(i+n-2) % n] && in_flight<max_in_flight;
+      };
+      detail::parallel_for(threads, threads, [&](size_t)
+      {
+        unique_lock<mutex> g(lock);
+        for(;;)
+        {
+          if(ec)
+            return;
+          if(next_encrypt<n && encryptable())
+          {
+            size_type i=(next_encrypt++ +2) % n;
+            ++in_flight;
+            g.unlock();
+            chunk_info_t &c=ret.chunks[i];
+            error_code _ec;
+            auto a(out.allocate(c.length));
+            if(!a)
+              _ec=a.error();
+            else
+            {
+              allocation::map_t m((*a)->map());
+              if(!m.addr)
+                _ec=m.ec;
+              else
+              {
+                unsigned char *p=(unsigned char *) m.addr;
+                _keystream(ret.chunks, i, p, c.length);
+                for(size_type b=0; b<c.length; b++)
+                  p[b]^=in[c.offset+b];
+                c.post_hash=hasher.hash(p, c.length);
+                (*a)->unmap(m);
+                try
+                {
+                  sink(i, std::move(*a));
+                }
+                catch(...)
+                {
+                  _ec=error_code(ECANCELED, std::system_category());
+                }
+              }
+            }
+            g.lock();
+            --in_flight;
+            if(_ec && !ec)
+              ec=_ec;
+            changed.notify_all();
+          }
+          else if(next_hash<n)
+          {
+            size_type i=next_hash++;
+            g.unlock();
+            ret.chunks[i].pre_hash=hasher.hash(in+ret.chunks[i].offset, ret.chunks[i].length);
+            g.lock();
+            hashed[i]=1;
+            changed.notify_all();
+          }
+          else if(next_encrypt<n)
+            changed.wait(g);
+          else
+            return;
+        }
+      });
+      if(ec)
+        return make_unexpected(ec);
+      return ret;
+    }
+    catch(...)
+    {
+      return make_unexpected(error_code(ENOMEM, std::system_category()));
+    }
+  }
+  //! \brief Self encrypts the whole of \em input, mapping it into the process for the duration
+  expected<data_map_t, error_code> encrypt(allocation &input, source &out, sink_type sink) const BOOST_NOEXCEPT
+  {
+    allocation::map_t m(0, input.size());
+    if(!input.map(m))
+      return make_unexpected(m.ec);
+    auto ret(encrypt(m, out, std::move(sink)));
+    input.unmap(m);
+    return ret;
+  }
+
+  /*! \brief Decrypts the mapped encrypted \em chunks described by \em data_map into the mapped
+  \em output, which must be data_map.size bytes long. Every chunk is checked against both its
+  hashes, returning EBADMSG if any does not match.
+  */
+  error_code decrypt(const data_map_t &data_map, const allocation::map_t *chunks, const allocation::map_t &output) const BOOST_NOEXCEPT
+  {
+    if(output.length!=data_map.size || data_map.chunks.size()<3)
+      return error_code(EINVAL, std::system_category());
+    for(size_type i=0; i<data_map.chunks.size(); i++)
+      if(chunks[i].length!=data_map.chunks[i].length)
+        return error_code(EINVAL, std::system_category());
+    tree_hasher::config_t serial;
+    serial.threads=1;
+    const tree_hasher hasher(serial);
+    atomic<bool> bad(false);
+    unsigned char *out=(unsigned char *) output.addr;
+    detail::parallel_for(data_map.chunks.size(), _config.threads, [&](size_t i)
+    {
+      const chunk_info_t &c=data_map.chunks[i];
+      const unsigned char *p=(const unsigned char *) chunks[i].addr;
+      if(hasher.hash(p, c.length)!=c.post_hash)
+      {
+        bad=true;
+        return;
+      }
+      unsigned char *o=out+c.offset;
+      _keystream(data_map.chunks, i, o, c.length);
+      for(size_type b=0; b<c.length; b++)
+        o[b]^=p[b];
+      if(hasher.hash(o, c.length)!=c.pre_hash)
+        bad=true;
+    });
+    return bad ? error_code(EBADMSG, std::system_category()) : error_code();
+  }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
@@ -0,0 +1,412 @@
+/* tree_hash.hpp
+Parallel tree hashing of very large allocations
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "kernel_alloc.hpp"
+
+#ifndef BOOST_KERNELALLOC_TREE_HASH_HPP
+#define BOOST_KERNELALLOC_TREE_HASH_HPP
+
+#include "detail/parallel_for.hpp"
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+/*! \file tree_hash.hpp
+ * \brief Provides BLAKE3 tree hashing of allocations across many cores
+ */
+
+BOOST_KERNELALLOC_V1_NAMESPACE_BEGIN
+
+namespace detail
+{
+  namespace blake3
+  {
+    static BOOST_CONSTEXPR_OR_CONST size_t block_len=64, chunk_len=1024, lanes=8;
+    enum flags : uint32_t
+    {
+      chunk_start=1, chunk_end=2, parent=4, root=8, keyed_hash=16, derive_key_context=32, derive_key_material=64
+    };
+    inline const uint32_t *iv() BOOST_NOEXCEPT
+    {
+      static const uint32_t v[8]={ 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+      return v;
+    }
+    inline uint32_t load32(const unsigned char *p) BOOST_NOEXCEPT
+    {
+      return (uint32_t) p[0] | ((uint32_t) p[1]<<8) | ((uint32_t) p[2]<<16) | ((uint32_t) p[3]<<24);
+    }
+    inline void store32(unsigned char *p, uint32_t v) BOOST_NOEXCEPT
+    {
+      p[0]=(unsigned char) v; p[1]=(unsigned char)(v>>8); p[2]=(unsigned char)(v>>16); p[3]=(unsigned char)(v>>24);
+    }
+    inline uint32_t rotr(uint32_t v, int n) BOOST_NOEXCEPT { return (v>>n) | (v<<(32-n)); }
+
+    /* The compression function run over N independent lanes at once, laid out so that every
+    step is an N wide loop the compiler turns into SIMD. v is the state, m the message words.
+    */
+    template<size_t N> struct lanes_t
+    {
+      uint32_t v[16][N], m[16][N];
+      void g(int a, int b, int c, int d, int x, int y) BOOST_NOEXCEPT
+      {
+        for(size_t l=0; l<N; l++) { v[a][l]+=v[b][l]+m[x][l]; v[d][l]=rotr(v[d][l]^v[a][l], 16); }
+        for(size_t l=0; l<N; l++) { v[c][l]+=v[d][l]; v[b][l]=rotr(v[b][l]^v[c][l], 12); }
+        for(size_t l=0; l<N; l++) { v[a][l]+=v[b][l]+m[y][l]; v[d][l]=rotr(v[d][l]^v[a][l], 8); }
+        for(size_t l=0; l<N; l++) { v[c][l]+=v[d][l]; v[b][l]=rotr(v[b][l]^v[c][l], 7); }
+      }
+      void permute() BOOST_NOEXCEPT
+      {
+        static const int p[16]={ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+        uint32_t t[16][N];
+        for(int i=0; i<16; i++)
+          for(size_t l=0; l<N; l++)
+            t[i][l]=m[p[i]][l];
+        memcpy(m, t, sizeof(m));
+      }
+      // cv[8][N] is the input chaining value. Leaves the 16 word output in v.
+      void compress(const uint32_t (*cv)[N], const uint64_t *counter, uint32_t len, uint32_t flags) BOOST_NOEXCEPT
+      {
+        for(int i=0; i<8; i++)
+          for(size_t l=0; l<N; l++)
+          {
+            v[i][l]=cv[i][l];
+            v[i+8][l]=(i<4) ? iv()[i] : 0;
+          }
+        for(size_t l=0; l<N; l++)
+        {
+          v[12][l]=(uint32_t) counter[l];
+          v[13][l]=(uint32_t)(counter[l]>>32);
+          v[14][l]=len;
+          v[15][l]=flags;
+        }
+        for(int r=0; r<7; r++)
+        {
+          g(0, 4, 8, 12, 0, 1); g(1, 5, 9, 13, 2, 3); g(2, 6, 10, 14, 4, 5); g(3, 7, 11, 15, 6, 7);
+          g(0, 5, 10, 15, 8, 9); g(1, 6, 11, 12, 10, 11); g(2, 7, 8, 13, 12, 13); g(3, 4, 9, 14, 14, 15);
+          if(r<6)
+            permute();
+        }
+        for(int i=0; i<8; i++)
+          for(size_t l=0; l<N; l++)
+          {
+            v[i][l]^=v[i+8][l];
+            v[i+8][l]^=cv[i][l];
+          }
+      }
+    };
+
+    // Everything needed to produce a node's chaining value or, for the root, its output bytes
+    struct output_t
+    {
+      uint32_t cv[8][1], block[16];
+      uint64_t counter;
+      uint32_t len, flags;
+      void chaining_value(uint32_t *out) const BOOST_NOEXCEPT
+      {
+        lanes_t<1> s;
+        for(int i=0; i<16; i++)
+          s.m[i][0]=block[i];
+        uint64_t c[1]={ counter };
+        s.compress(cv, c, len, flags);
+        for(int i=0; i<8; i++)
+          out[i]=s.v[i][0];
+      }
+      // Extendable output, each 64 byte block of which is independent so done lanes wide
+      void root_bytes(unsigned char *out, size_t bytes) const BOOST_NOEXCEPT
+      {
+        lanes_t<lanes> s;
+        uint32_t cvs[8][lanes];
+        uint64_t c[lanes];
+        for(int i=0; i<8; i++)
+          for(size_t l=0; l<lanes; l++)
+            cvs[i][l]=cv[i][0];
+        for(uint64_t block_no=0; bytes; block_no+=lanes)
+        {
+          for(int i=0; i<16; i++)
+            for(size_t l=0; l<lanes; l++)
+              s.m[i][l]=block[i];
+          for(size_t l=0; l<lanes; l++)
+            c[l]=block_no+l;
+          s.compress(cvs, c, len, flags | root);
+          for(size_t l=0; l<lanes && bytes; l++)
+            for(int i=0; i<16 && bytes; i++)
+            {
+              unsigned char w[4];
+              store32(w, s.v[i][l]);
+              size_t n=bytes<4 ? bytes : 4;
+              memcpy(out, w, n);
+              out+=n;
+              bytes-=n;
+            }
+        }
+      }
+    };
+
+    inline output_t parent_output(const uint32_t *left, const uint32_t *right, const uint32_t *key, uint32_t flags) BOOST_NOEXCEPT
+    {
+      output_t o;
+      for(int i=0; i<8; i++)
+      {
+        o.cv[i][0]=key[i];
+        o.block[i]=left[i];
+        o.block[i+8]=right[i];
+      }
+      o.counter=0;
+      o.len=block_len;
+      o.flags=flags | parent;
+      return o;
+    }
+
+    // The output of a single chunk of up to chunk_len bytes, which may be empty
+    inline output_t chunk_output(const unsigned char *data, size_t bytes, uint64_t chunk_no, const uint32_t *key, uint32_t flags) BOOST_NOEXCEPT
+    {
+      output_t o;
+      for(int i=0; i<8; i++)
+        o.cv[i][0]=key[i];
+      o.counter=chunk_no;
+      uint32_t start=chunk_start;
+      for(;;)
+      {
+        size_t n=bytes<block_len ? bytes : block_len;
+        unsigned char buffer[block_len]={ 0 };
+        if(n)
+          memcpy(buffer, data, n);
+        for(int i=0; i<16; i++)
+          o.block[i]=load32(buffer+4*i);
+        o.len=(uint32_t) n;
+        data+=n;
+        bytes-=n;
+        if(!bytes)
+        {
+          o.flags=flags | start | chunk_end;
+          return o;
+        }
+        uint32_t cv[8];
+        o.flags=flags | start;
+        o.chaining_value(cv);
+        for(int i=0; i<8; i++)
+          o.cv[i][0]=cv[i];
+        start=0;
+      }
+    }
+
+    // Chaining values of N consecutive full chunks starting at chunk chunk_no
+    template<size_t N> inline void chunk_cvs(const unsigned char *data, uint64_t chunk_no, const uint32_t *key, uint32_t flags, uint32_t (*out)[8]) BOOST_NOEXCEPT
+    {
+      lanes_t<N> s;
+      uint32_t cv[8][N];
+      uint64_t c[N];
+      for(size_t l=0; l<N; l++)
+      {
+        c[l]=chunk_no+l;
+        for(int i=0; i<8; i++)
+          cv[i][l]=key[i];
+      }
+      for(size_t b=0; b<chunk_len/block_len; b++)
+      {
+        for(int i=0; i<16; i++)
+          for(size_t l=0; l<N; l++)
+            s.m[i][l]=load32(data+l*chunk_len+b*block_len+4*i);
+        uint32_t f=flags | (b==0 ? (uint32_t) chunk_start : 0) | (b==chunk_len/block_len-1 ? (uint32_t) chunk_end : 0);
+        s.compress(cv, c, block_len, f);
+        for(int i=0; i<8; i++)
+          for(size_t l=0; l<N; l++)
+            cv[i][l]=s.v[i][l];
+      }
+      for(size_t l=0; l<N; l++)
+        for(int i=0; i<8; i++)
+          out[l][i]=cv[i][l];
+    }
+
+    // A stack of subtree chaining values, merged as per the BLAKE3 incremental hasher
+    struct cv_stack_t
+    {
+      uint32_t cvs[64][8];
+      size_t depth;
+      cv_stack_t() : depth(0) { }
+      // total is the count of subtrees of this size after adding this one
+      void push(const uint32_t *cv, uint64_t total, const uint32_t *key, uint32_t flags) BOOST_NOEXCEPT
+      {
+        uint32_t merged[8];
+        memcpy(merged, cv, sizeof(merged));
+        for(; !(total & 1); total>>=1)
+          parent_output(cvs[--depth], merged, key, flags).chaining_value(merged);
+        memcpy(cvs[depth++], merged, sizeof(merged));
+      }
+    };
+
+    // The chaining value of the 2^k full chunks starting at chunk_no
+    inline void subtree_cv(const unsigned char *data, uint64_t chunk_no, uint64_t chunks, const uint32_t *key, uint32_t flags, uint32_t *out) BOOST_NOEXCEPT
+    {
+      cv_stack_t stack;
+      uint32_t cvs[lanes][8];
+      for(uint64_t n=0; n<chunks;)
+      {
+        size_t batch=(chunks-n>=lanes) ? lanes : 1;
+        if(batch==lanes)
+          chunk_cvs<lanes>(data+n*chunk_len, chunk_no+n, key, flags, cvs);
+        else
+          chunk_cvs<1>(data+n*chunk_len, chunk_no+n, key, flags, cvs);
+        for(size_t l=0; l<batch; l++)
+          stack.push(cvs[l], ++n, key, flags);
+      }
+      memcpy(out, stack.cvs[0], 8*sizeof(uint32_t));
+    }
+  }
+}
+
+/*! \class tree_hasher
+ * \brief Hashes very large allocations with BLAKE3 across many cores.
+ *
+ * BLAKE3 is a Merkle tree over 1Kb chunks, so the input is divided into large power of two
+ * aligned subtrees which are hashed independently by a pool of worker threads, each hashing
+ * eight chunks at once in SIMD friendly form, and the subtree chaining values are then merged
+ * into the root. Because the tree shape is fixed by the input length alone, the digest is
+ * standard BLAKE3 and is identical whatever the number of threads or subtree size.
+ *
+ * Keyed hashing and key derivation are also supported, as is output of any length.
+ */
+class tree_hasher
+{
+public:
+  //! \brief A size_t
+  typedef size_t size_type;
+  //! \brief A BLAKE3 digest
+  typedef std::array<unsigned char, 32> digest_type;
+  //! \brief A BLAKE3 key
+  typedef std::array<unsigned char, 32> key_type;
+
+  //! \brief Configures the parallelism of a hasher
+  struct config_t
+  {
+    size_type threads;          //!< The number of threads to use, zero means hardware concurrency
+    size_type subtree_chunks;   //!< The maximum 1Kb chunks in a unit of work, rounded down to a power of two
+    config_t() : threads(0), subtree_chunks(1024) { }
+  };
+private:
+  config_t _config;
+  uint32_t _key[8], _flags;
+
+  void _hash(const unsigned char *data, size_type bytes, unsigned char *out, size_type outbytes) const BOOST_NOEXCEPT
+  {
+    using namespace detail::blake3;
+    const uint64_t chunks=bytes ? (bytes+chunk_len-1)/chunk_len : 1;
+    // Every chunk but the last is full, and goes into a subtree
+    const uint64_t full=chunks-1;
+    uint64_t limit=1;
+    while(limit*2<=_config.subtree_chunks)
+      limit*=2;
+    struct subtree_t { uint64_t chunk_no, chunks; uint32_t cv[8]; };
+    std::vector<subtree_t> subtrees;
+    for(uint64_t c=0; c<full;)
+    {
+      uint64_t size=limit;
+      while((c & (size-1)) || c+size>full)
+        size>>=1;
+      subtree_t s={ c, size, { 0 } };
+      subtrees.push_back(s);
+      c+=size;
+    }
+    detail::parallel_for(subtrees.size(), _config.threads, [&](size_t n)
+    {
+      subtree_t &s=subtrees[n];
+      subtree_cv(data+s.chunk_no*chunk_len, s.chunk_no, s.chunks, _key, _flags, s.cv);
+    });
+    cv_stack_t stack;
+    for(auto &s : subtrees)
+      stack.push(s.cv, (s.chunk_no+s.chunks)/s.chunks, _key, _flags);
+    output_t o(chunk_output(data+full*chunk_len, bytes-(size_type)(full*chunk_len), full, _key, _flags));
+    while(stack.depth)
+    {
+      uint32_t cv[8];
+      o.chaining_value(cv);
+      o=parent_output(stack.cvs[--stack.depth], cv, _key, _flags);
+    }
+    o.root_bytes(out, outbytes);
+  }
+public:
+  //! \brief Constructs a hasher of plain BLAKE3
+  tree_hasher(config_t config=config_t()) : _config(config), _flags(0)
+  {
+    memcpy(_key, detail::blake3::iv(), sizeof(_key));
+  }
+  //! \brief Constructs a hasher of BLAKE3 keyed by \em key
+  tree_hasher(const key_type &key, config_t config=config_t()) : _config(config), _flags(detail::blake3::keyed_hash)
+  {
+    for(int i=0; i<8; i++)
+      _key[i]=detail::blake3::load32(key.data()+4*i);
+  }
+  //! \brief Constructs a hasher deriving keys from key material in the given application specific \em context
+  tree_hasher(const char *context, config_t config=config_t()) : _config(config), _flags(detail::blake3::derive_key_context)
+  {
+    memcpy(_key, detail::blake3::iv(), sizeof(_key));
+    unsigned char context_key[32];
+    _hash((const unsigned char *) context, strlen(context), context_key, sizeof(context_key));
+    for(int i=0; i<8; i++)
+      _key[i]=detail::blake3::load32(context_key+4*i);
+    _flags=detail::blake3::derive_key_material;
+  }
+
+  //! \brief The configuration of this hasher
+  const config_t &config() const BOOST_NOEXCEPT { return _config; }
+
+  //! \brief Hashes \em bytes at \em data into \em outbytes of output
+  void hash(const void *data, size_type bytes, void *out, size_type outbytes) const BOOST_NOEXCEPT
+  {
+    _hash((const unsigned char *) data, bytes, (unsigned char *) out, outbytes);
+  }
+  //! \brief Hashes \em bytes at \em data
+  digest_type hash(const void *data, size_type bytes) const BOOST_NOEXCEPT
+  {
+    digest_type ret;
+    _hash((const unsigned char *) data, bytes, ret.data(), ret.size());
+    return ret;
+  }
+  //! \brief Hashes a map of an allocation
+  digest_type hash(const allocation::map_t &m) const BOOST_NOEXCEPT
+  {
+    return hash(m.addr, m.length);
+  }
+  //! \brief Hashes the whole of an allocation, mapping it into the process for the duration
+  expected<digest_type, error_code> hash(allocation &a) const BOOST_NOEXCEPT
+  {
+    allocation::map_t m(0, a.size());
+    if(!a.map(m))
+      return make_unexpected(m.ec);
+    digest_type ret(hash(m));
+    a.unmap(m);
+    return ret;
+  }
+};
+
+BOOST_KERNELALLOC_V1_NAMESPACE_END
+
+#endif
@@ -0,0 +1,84 @@
+/* allocation_tag.cpp
+Tests per tag accounting of allocations, including untagged ones
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "test_common.hpp"
+
+using namespace test;
+
+static allocation_tag::statistics_t stats(allocation_tag t)
+{
+  for(auto &s : allocation_tag::snapshot())
+    if(s.tag==t.value)
+      return s;
+  allocation_tag::statistics_t none;
+  memset(&none, 0, sizeof(none));
+  return none;
+}
+
+int main()
+{
+  auto src(std::make_shared<mock_source>());
+  const allocation_tag untagged, mine(7), named(allocation_tag::intern("test"));
+  CHECK(named.value>=allocation_tag::user_tags && named==allocation_tag::intern("test"));
+  CHECK(allocation_tag(allocation_tag::user_tags+1)==untagged);
+  auto before(stats(untagged));
+
+  // A plain allocate() is accounted as untagged, and its maps as resident under it
+  auto a(*src->allocate(65536));
+  auto s(stats(untagged));
+  CHECK(s.allocations==before.allocations+1 && s.live_bytes==before.live_bytes+65536);
+  CHECK(s.total_allocations==before.total_allocations+1);
+  allocation::map_t m(a->map());
+  CHECK(stats(untagged).resident_bytes==before.resident_bytes+65536);
+  a->unmap(m);
+  CHECK(stats(untagged).resident_bytes==before.resident_bytes);
+
+  // A tagged allocate() is accounted only under its tag
+  auto b(*src->allocate(8192, mine)), c(*src->allocate(4096, named));
+  CHECK(b->tag()==mine && c->tag()==named);
+  s=stats(untagged);
+  CHECK(s.allocations==before.allocations+1 && s.total_allocations==before.total_allocations+1);
+  CHECK(stats(mine).allocations==1 && stats(mine).live_bytes==8192);
+  CHECK(stats(named).live_bytes==4096 && !strcmp(stats(named).name, "test"));
+  m=b->map();
+  CHECK(stats(mine).resident_bytes==8192);
+  b->unmap(m);
+
+  // Freeing returns every count to where it was
+  a.reset();
+  b.reset();
+  c.reset();
+  s=stats(untagged);
+  CHECK(s.allocations==before.allocations && s.live_bytes==before.live_bytes && s.resident_bytes==before.resident_bytes);
+  CHECK(!stats(mine).allocations && !stats(mine).live_bytes && stats(mine).total_allocations==1 && stats(mine).peak_bytes==8192);
+  return test::report("allocation_tag");
+}
@@ -0,0 +1,81 @@
+/* handle_passing.cpp
+Tests passing descriptors between sockets with send_handle() and receive_handle()
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "test_common.hpp"
+#include "../include/boost/kernelalloc/handle_passing.hpp"
+#include <sys/socket.h>
+#include <thread>
+
+using namespace test;
+
+int main()
+{
+  for(int type : { SOCK_STREAM, SOCK_SEQPACKET })
+  {
+    int fds[2];
+    CHECK(!socketpair(AF_UNIX, type, 0, fds));
+    // A pipe stands in for the object backing an allocation, as anything with a descriptor will do
+    int pipefds[2];
+    CHECK(!pipe(pipefds));
+    passed_handle h;
+    h.handle=pipefds[1];
+    h.unique_id=78;
+    h.offset=4096;
+    h.size=65536;
+    CHECK(!send_handle(fds[0], h));
+    auto r(receive_handle(fds[1]));
+    CHECK(!!r);
+    if(r)
+    {
+      CHECK(r->unique_id==78 && r->offset==4096 && r->size==65536);
+      CHECK(r->handle!=pipefds[1]);
+      // The received descriptor is the same pipe
+      CHECK(write(r->handle, "x", 1)==1);
+      char c=0;
+      CHECK(read(pipefds[0], &c, 1)==1 && c=='x');
+      close(r->handle);
+    }
+
+    // Anything else arriving is rejected
+    CHECK(write(fds[0], "not a handle", 12)==12);
+    if(type==SOCK_STREAM)
+      close(fds[0]);
+    auto bad(receive_handle(fds[1]));
+    CHECK(!bad && bad.error().value()==EBADMSG);
+    if(type!=SOCK_STREAM)
+      close(fds[0]);
+    close(fds[1]);
+    close(pipefds[0]);
+    close(pipefds[1]);
+  }
+  return test::report("handle_passing");
+}
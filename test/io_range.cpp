@@ -0,0 +1,141 @@
+/* io_range.cpp
+Tests vectored I/O over io_range with short transfers and failed maps
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "test_common.hpp"
+#include "../include/boost/kernelalloc/io_range.hpp"
+#include <sys/socket.h>
+#include <thread>
+
+using namespace test;
+
+int main()
+{
+  auto src(std::make_shared<mock_source>());
+  auto a(*src->allocate(1024*1024));
+
+  // A failed map is added with a null address and no length, so the range is still safe for I/O
+  {
+    io_range r;
+    const io_range::size_type offsets[]={ 0, 2*1024*1024, 4096 }, lengths[]={ 16, 4096, 16 };
+    CHECK(r.map(*a, offsets, lengths, 3)==2);
+    CHECK(r.size()==3);
+    CHECK(!r.iov()[1].iov_base && !r.iov()[1].iov_len);
+    CHECK(!!r.error(1) && !r.error(0) && !r.error(2));
+    CHECK(r.bytes()==32);
+    memset(r.iov()[0].iov_base, 'a', 16);
+    memset(r.iov()[2].iov_base, 'b', 16);
+    int fds[2];
+    CHECK(!pipe(fds));
+    auto written(boost::kernel_alloc::writev(fds[1], r));
+    CHECK(written && *written==32);
+    close(fds[1]);
+    char buffer[64];
+    CHECK(read(fds[0], buffer, sizeof(buffer))==32);
+    CHECK(buffer[15]=='a' && buffer[16]=='b');
+    close(fds[0]);
+    CHECK(r.unmap(*a)==2);
+  }
+
+  // Reads arriving in pieces which split the iovecs are resumed part way through, and the
+  // iovecs are restored afterwards
+  {
+    const io_range::size_type offsets[]={ 0, 8192, 65536 }, lengths[]={ 5, 13, 30 };
+    io_range r;
+    CHECK(r.map(*a, offsets, lengths, 3)==3);
+    int fds[2];
+    CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    std::thread writer([&]
+    {
+      for(int n=0; n<48; n+=7)
+      {
+        char piece[7];
+        for(int i=0; i<7; i++)
+          piece[i]=(char)(n+i);
+        CHECK(write(fds[1], piece, std::min(7, 48-n))==std::min(7, 48-n));
+        usleep(2000);
+      }
+    });
+    auto read(boost::kernel_alloc::readv(fds[0], r));
+    writer.join();
+    CHECK(read && *read==48);
+    int n=0;
+    bool ok=true;
+    for(io_range::size_type i=0; i<r.size(); i++)
+    {
+      CHECK(r[i].length==lengths[i] && (char *) r[i].addr==(char *) a->maps()[0].addr-a->maps()[0].offset+offsets[i]);
+      for(io_range::size_type j=0; j<r[i].length; j++)
+        ok=ok && ((char *) r[i].addr)[j]==(char) n++;
+    }
+    CHECK(ok);
+
+    // End of file part way through a range returns the bytes read so far
+    CHECK(write(fds[1], "xyz", 3)==3);
+    close(fds[1]);
+    read=boost::kernel_alloc::readv(fds[0], r);
+    CHECK(read && *read==3);
+    CHECK(r[0].length==5 && ((char *) r[0].addr)[2]=='z');
+    close(fds[0]);
+    r.unmap(*a);
+  }
+
+  // Writes larger than the pipe buffer are completed across many short writev()s
+  {
+    const io_range::size_type offsets[]={ 0, 300000, 600000 }, lengths[]={ 300000, 300000, 300000 };
+    io_range r;
+    CHECK(r.map(*a, offsets, lengths, 3)==3);
+    for(io_range::size_type i=0; i<r.size(); i++)
+      for(io_range::size_type j=0; j<r[i].length; j++)
+        ((unsigned char *) r[i].addr)[j]=(unsigned char)(i*7+j*13);
+    int fds[2];
+    CHECK(!pipe(fds));
+    std::vector<unsigned char> received;
+    std::thread reader([&]
+    {
+      unsigned char buffer[10000];
+      ssize_t bytes;
+      while((bytes=::read(fds[0], buffer, sizeof(buffer)))>0)
+        received.insert(received.end(), buffer, buffer+bytes);
+    });
+    auto written(boost::kernel_alloc::writev(fds[1], r));
+    close(fds[1]);
+    reader.join();
+    close(fds[0]);
+    CHECK(written && *written==900000);
+    CHECK(received.size()==900000);
+    bool ok=received.size()==900000;
+    for(size_t n=0; ok && n<received.size(); n++)
+      ok=received[n]==(unsigned char)((n/300000)*7+(n%300000)*13);
+    CHECK(ok);
+    r.unmap(*a);
+  }
+  return test::report("io_range");
+}
@@ -0,0 +1,131 @@
+/* journal.cpp
+Tests concurrent appends to a journal and its recovery of intact records
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "test_common.hpp"
+#include "../include/boost/kernelalloc/journal.hpp"
+#include <string>
+#include <thread>
+
+using namespace test;
+
+static std::vector<std::string> records(const journal &j)
+{
+  std::vector<std::string> ret;
+  j.for_each([&](const char *data, size_t bytes) { ret.push_back(std::string(data, bytes)); });
+  return ret;
+}
+
+static std::string record(int t, int n)
+{
+  // Lengths vary so records are padded differently and straddle pages
+  return std::string((size_t)(1+(t*131+n*17) % 300), (char)('a'+t)) + std::to_string(n);
+}
+
+int main()
+{
+  auto src(std::make_shared<mock_source>());
+  auto a(*src->allocate(1024*1024));
+  char *storage=std::static_pointer_cast<mock_allocation>(a)->storage();
+  std::vector<std::string> written;
+
+  // Records appended concurrently are all durable once waited for, each exactly once
+  {
+    auto j(*journal::make(a, -1));
+    CHECK(j->tail()==0);
+    std::vector<std::thread> threads;
+    for(int t=0; t<4; t++)
+      threads.push_back(std::thread([&, t]
+      {
+        for(int n=0; n<200; n++)
+        {
+          std::string r(record(t, n));
+          auto lsn((n % 10) ? j->append(r.data(), r.size()) : j->append_durable(r.data(), r.size()));
+          CHECK(!!lsn);
+        }
+      }));
+    for(auto &t : threads)
+      t.join();
+    CHECK(!j->wait_durable(j->tail()));
+    written=records(*j);
+    CHECK(written.size()==800);
+    std::vector<std::string> expected, got(written);
+    for(int t=0; t<4; t++)
+      for(int n=0; n<200; n++)
+        expected.push_back(record(t, n));
+    std::sort(expected.begin(), expected.end());
+    std::sort(got.begin(), got.end());
+    CHECK(got==expected);
+  }
+
+  // Reopening recovers every record in order, and appending continues after them
+  journal::lsn_t end;
+  {
+    auto j(*journal::make(a, -1));
+    CHECK(records(*j)==written);
+    end=j->tail();
+    CHECK(end && j->durable()==end);
+    CHECK(!!j->append_durable("after", 5));
+    written.push_back("after");
+    CHECK(records(*j)==written);
+  }
+
+  // A record torn by a crash ends recovery there, and everything after it is destroyed
+  {
+    // Find the offset of record 500 by walking the headers as the journal lays them out
+    size_t offset=0;
+    for(int n=0; n<500; n++)
+      offset+=8+((written[n].size()+7) & ~(size_t) 7);
+    storage[offset+8]^=1;
+    auto j(*journal::make(a, -1));
+    std::vector<std::string> intact(written.begin(), written.begin()+500);
+    CHECK(records(*j)==intact);
+    CHECK(j->tail()==offset);
+    bool zero=true;
+    for(size_t n=offset; n<a->size(); n++)
+      zero=zero && !storage[n];
+    CHECK(zero);
+    CHECK(!!j->append_durable("replacement", 11));
+    intact.push_back("replacement");
+    CHECK(records(*j)==intact);
+  }
+
+  // A header published past the end of the allocation is not trusted
+  {
+    auto b(*src->allocate(4096));
+    char *bs=std::static_pointer_cast<mock_allocation>(b)->storage();
+    uint64_t h=(uint64_t) 100000;
+    memcpy(bs, &h, 8);
+    auto j(*journal::make(b, -1));
+    CHECK(records(*j).empty() && j->tail()==0);
+  }
+  return test::report("journal");
+}
@@ -0,0 +1,180 @@
+/* known_zero.cpp
+Tests known zero tracking through maps, clears, discards and recycling
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "test_common.hpp"
+#include "../include/boost/kernelalloc/recycler.hpp"
+
+using namespace test;
+
+// A source whose fresh allocations are marked zero but are not, so trusting the mark shows
+class lying_source : public mock_source
+{
+public:
+  virtual expected<pointer, error_code> allocate(size_type bytes) BOOST_NOEXCEPT override
+  {
+    auto a(mock_source::allocate(bytes));
+    if(a)
+      memset(std::static_pointer_cast<mock_allocation>(*a)->storage(), 0x5a, (*a)->actual_size());
+    return a;
+  }
+  using mock_source::allocate;
+};
+
+// A source which cannot vouch that its fresh allocations read as zero
+class reusing_source : public mock_source
+{
+public:
+  virtual bool fresh_allocations_zero() const BOOST_NOEXCEPT override { return false; }
+};
+
+static bool all(const allocation::map_t &m, unsigned char v)
+{
+  for(size_t n=0; n<m.length; n++)
+    if(((unsigned char *) m.addr)[n]!=v)
+      return false;
+  return true;
+}
+
+int main()
+{
+  auto src(std::make_shared<mock_source>());
+
+  // A fresh allocation is known zero until mapped
+  {
+    auto a(*src->allocate(65536));
+    CHECK(a->is_known_zero(0, 65536));
+    allocation::map_t m(a->map());
+    CHECK(!a->is_known_zero(0, 65536));
+    a->unmap(m);
+  }
+
+  // Only a source whose fresh allocations read as zero gets them marked known zero, so
+  // allocate_zeroed() clears the others
+  {
+    auto reusing(std::make_shared<reusing_source>());
+    auto a(*reusing->allocate(8192));
+    CHECK(!a->is_known_zero(0, 8192));
+    auto r(reusing->allocate_zeroed(8192));
+    CHECK(r && all(r->second, 0));
+  }
+
+  // allocate_zeroed() trusts a fresh allocation rather than clearing it, and hands it out written
+  {
+    auto lying(std::make_shared<lying_source>());
+    auto r(lying->allocate_zeroed(8192));
+    CHECK(r && all(r->second, 0x5a));
+    CHECK(!r->first->is_known_zero(0, 8192));
+    CHECK(*r->first->ensure_zero(r->second)==8192);
+    CHECK(all(r->second, 0));
+    r->first->unmap(r->second);
+  }
+
+  // ensure_zero() after destroy() skips clearing, but either way leaves the map no longer known zero
+  for(size_t bytes : { (size_t) 16384, (size_t) allocation::destroy_threshold*2 })
+  {
+    auto a(*src->allocate(bytes));
+    allocation::map_t m(a->map());
+    memset(m.addr, 1, bytes);
+    CHECK(*a->ensure_zero(m)==bytes);
+    CHECK(all(m, 0));
+    CHECK(!a->is_known_zero(0, bytes));
+    memset(m.addr, 2, bytes);
+    CHECK(*a->ensure_zero(m)==bytes);
+    CHECK(all(m, 0));
+    memset(m.addr, 3, bytes);
+    CHECK(a->destroy(m));
+    CHECK(a->is_known_zero(0, bytes));
+    CHECK(*a->ensure_zero(m)==0);
+    CHECK(all(m, 0));
+    CHECK(!a->is_known_zero(0, bytes));
+    a->unmap(m);
+  }
+
+  // An immediate discard by a source whose discard zeroes marks only the whole pages, a lazy one nothing
+  {
+    auto a(*src->allocate(65536));
+    allocation::map_t m(a->map());
+    memset(m.addr, 1, 65536);
+    allocation::map_t part(100, 20000);
+    part.addr=(char *) m.addr+100;
+    CHECK(a->discard(part, discard_policy::immediate));
+    CHECK(a->is_known_zero(4096, 12288));
+    CHECK(!a->is_known_zero(100, 4000) && !a->is_known_zero(16384, 4096));
+    a->mark_written(0, 65536);
+    CHECK(a->discard(m, discard_policy::lazy));
+    CHECK(!a->is_known_zero(0, 4096));
+    a->unmap(m);
+  }
+
+  // Memory written after being acquired reads as zero when reacquired zeroed from the recycler
+  {
+    recycler r;
+    auto got(r.acquire(*src, 65536));
+    CHECK(!!got);
+    memset(got->second.addr, 0xab, got->second.length);
+    r.recycle(got->first, got->second);
+    got=r.acquire_zeroed(*src, 65536);
+    CHECK(got && all(got->second, 0));
+    CHECK(!got->first->is_known_zero(0, 65536));
+    memset(got->second.addr, 0xcd, got->second.length);
+    r.recycle(got->first, got->second);
+
+    // Even if it was known zero when recycled
+    got=r.acquire(*src, 65536);
+    got->first->destroy(got->second);
+    CHECK(got->first->is_known_zero(0, 65536));
+    memset(got->second.addr, 0xef, got->second.length);
+    r.recycle(got->first, got->second);
+    got=r.acquire_zeroed(*src, 65536);
+    CHECK(got && all(got->second, 0));
+    r.recycle(got->first, got->second);
+  }
+
+  // An allocation decayed to discarded reads as zero when reacquired, without being cleared again
+  {
+    recycler::config_t config;
+    config.free_after=config.discard_after=chrono::seconds(0);
+    recycler r(config);
+    auto got(r.acquire(*src, 65536));
+    memset(got->second.addr, 0xab, got->second.length);
+    r.recycle(got->first, got->second);
+    r.decay_once();
+    CHECK(r.stats().discarded_bytes==65536);
+    auto m(got->second);
+    got=r.acquire_zeroed(*src, 65536);
+    CHECK(got && got->second.addr==m.addr);
+    CHECK(all(got->second, 0));
+    CHECK(!got->first->is_known_zero(0, 65536));
+    r.recycle(got->first, got->second);
+  }
+  return test::report("known_zero");
+}
@@ -0,0 +1,92 @@
+/* locate_cache.cpp
+Tests the per thread cache in front of locate_addr
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "test_common.hpp"
+#include <thread>
+
+using namespace test;
+
+static allocation *located(void *p) { return std::get<1>(source::locate_addr_cached(p)).get(); }
+
+int main()
+{
+  auto src(std::make_shared<mock_source>());
+  auto a(*src->allocate(65536)), b(*src->allocate(65536));
+  allocation::map_t ma(a->map()), mb(b->map());
+  char *pa=(char *) ma.addr, *pb=(char *) mb.addr;
+
+  // Registered maps are found, and listed by their allocation
+  CHECK(std::get<1>(source::locate_addr(pa+100)).get()==a.get());
+  CHECK(std::get<0>(source::locate_addr(pa+100)).get()==src.get());
+  CHECK(a->maps().size()==1);
+  CHECK(!std::get<1>(source::locate_addr(pa+65536)) || std::get<1>(source::locate_addr(pa+65536)).get()!=a.get());
+
+  // A second lookup into the same map hits
+  auto before(source::locate_cache_stats());
+  CHECK(located(pa+1)==a.get());
+  CHECK(located(pa+60000)==a.get());
+  CHECK(located(pb+5)==b.get());
+  auto after(source::locate_cache_stats());
+  CHECK(after.hits-before.hits==1);
+  CHECK(after.misses-before.misses==2);
+
+  // Unmapping a drops only its entry
+  a->unmap(ma);
+  CHECK(a->maps().empty());
+  before=source::locate_cache_stats();
+  CHECK(located(pa+1)==nullptr);
+  CHECK(located(pb+5)==b.get());
+  after=source::locate_cache_stats();
+  CHECK(after.hits-before.hits==1);
+  CHECK(after.flushes==before.flushes);
+
+  // An unmap on another thread invalidates this thread's entry
+  ma=a->map();
+  pa=(char *) ma.addr;
+  CHECK(located(pa)==a.get());
+  CHECK(located(pa)==a.get());
+  std::thread([&] { a->unmap(ma); }).join();
+  CHECK(located(pa)==nullptr);
+
+  // A freed allocation whose source forgot to unregister its map is never handed back
+  ma=a->map();
+  CHECK(located(pa)==a.get());
+  std::static_pointer_cast<mock_allocation>(a)->leak_maps();
+  a.reset();
+  CHECK(located(pa)==nullptr);
+  CHECK(!std::get<1>(source::locate_addr(pa)));
+
+  // Freeing with the maps unregistered properly does the same
+  CHECK(located(pb)==b.get());
+  b.reset();
+  CHECK(located(pb)==nullptr);
+  return test::report("locate_cache");
+}
@@ -0,0 +1,131 @@
+/* object_pool.cpp
+Tests object_pool under concurrent acquire, release and trim
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "test_common.hpp"
+#include "../include/boost/kernelalloc/object_pool.hpp"
+#include <thread>
+
+using namespace test;
+
+static atomic<long> constructed(0), destroyed(0), resets(0);
+
+struct object_t
+{
+  atomic<int> owner;        // Non-zero while acquired
+  unsigned long long uses;
+  object_t() : owner(0), uses(0) { ++constructed; }
+  ~object_t() { ++destroyed; }
+};
+
+int main()
+{
+  auto src(std::make_shared<mock_source>());
+  {
+    object_pool<object_t>::config_t config;
+    config.slab_bytes=4096;
+    config.max_slabs=256;
+    object_pool<object_t> pool(*src, config, [](object_t &o) { o.owner=0; ++resets; });
+    const size_t per_slab=pool.objects_per_slab();
+    CHECK(per_slab>1 && !pool.in_use());
+
+    // No object is ever held by two threads at once, while another thread keeps trimming
+    atomic<int> bad(0);
+    atomic<bool> done(false);
+    atomic<long> releases(0);
+    std::thread trimmer([&]
+    {
+      while(!done)
+      {
+        pool.trim();
+        this_thread::yield();
+      }
+    });
+    std::vector<std::thread> threads;
+    for(int t=1; t<=8; t++)
+      threads.push_back(std::thread([&, t]
+      {
+        std::vector<object_t *> held;
+        for(int n=0; n<2000; n++)
+        {
+          // Hold a varying number, so slabs keep filling and emptying
+          const size_t want=(size_t)((n*7+t) % (3*per_slab));
+          while(held.size()<want)
+          {
+            object_t *o=pool.acquire();
+            if(!o)
+            {
+              ++bad;
+              break;
+            }
+            int expected=0;
+            if(!o->owner.compare_exchange_strong(expected, t))
+              ++bad;
+            ++o->uses;
+            held.push_back(o);
+          }
+          while(held.size()>want/2)
+          {
+            if(held.back()->owner!=t)
+              ++bad;
+            pool.release(held.back());
+            ++releases;
+            held.pop_back();
+          }
+        }
+        for(auto o : held)
+        {
+          pool.release(o);
+          ++releases;
+        }
+      }));
+    for(auto &t : threads)
+      t.join();
+    done=true;
+    trimmer.join();
+    CHECK(!bad);
+    CHECK(!pool.in_use());
+    CHECK(resets==releases);
+    CHECK(!pool.last_error());
+
+    // Objects are constructed a slab at a time, only again after that slab was trimmed
+    CHECK((constructed-destroyed) % (long) per_slab==0);
+    pool.trim();
+    CHECK(constructed==destroyed);
+
+    // A trimmed pool reconstructs on demand
+    auto u(pool.acquire_unique());
+    CHECK(u && !u->owner && pool.in_use()==1);
+    CHECK(constructed-destroyed==(long) per_slab);
+  }
+  CHECK(constructed==destroyed);
+  return test::report("object_pool");
+}
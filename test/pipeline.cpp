@@ -0,0 +1,136 @@
+/* pipeline.cpp
+Tests many threads per stage passing buffers round an allocation_pipeline
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "test_common.hpp"
+#include "../include/boost/kernelalloc/pipeline.hpp"
+#include <thread>
+
+using namespace test;
+
+struct header_t
+{
+  unsigned long long sequence;  // Written by fill
+  unsigned long long processed; // Written by process
+};
+
+int main()
+{
+  auto src(std::make_shared<mock_source>());
+  const allocation_pipeline::flags_t flags[]={ allocation_pipeline::flags_t::normal,
+    (allocation_pipeline::flags_t)((int) allocation_pipeline::flags_t::discard_after_drain | (int) allocation_pipeline::flags_t::prefault_before_fill),
+    allocation_pipeline::flags_t::colour_buffers };
+  for(auto f : flags)
+  {
+    // Two threads per stage pass every buffer through every stage in sequence order, exactly once
+    const unsigned long long cycles=3000;
+    auto p(*allocation_pipeline::make(*src, 3, 16384, 3, f));
+    std::vector<atomic<long long>> remaining(3);
+    for(auto &r : remaining)
+      r=(long long) cycles;
+    std::vector<char> drained(cycles);
+    atomic<int> bad(0);
+    std::vector<std::thread> threads;
+    for(size_t stage=0; stage<3; stage++)
+      for(int t=0; t<2; t++)
+        threads.push_back(std::thread([&, stage]
+        {
+          while(remaining[stage].fetch_sub(1)>0)
+          {
+            auto h(p->acquire(stage));
+            if(!h || h.size()<16384)
+            {
+              ++bad;
+              continue;
+            }
+            header_t *hdr=(header_t *) h.data();
+            switch(stage)
+            {
+            case 0:
+              // A discarded buffer may read as anything, but is wholly ours to fill
+              memset(h.data(), (int)(h.sequence() & 0xff), h.size());
+              hdr->sequence=h.sequence();
+              hdr->processed=(unsigned long long) -1;
+              break;
+            case 1:
+              if(hdr->sequence!=h.sequence() || ((unsigned char *) h.data())[h.size()-1]!=(unsigned char)(h.sequence() & 0xff))
+                ++bad;
+              hdr->processed=h.sequence();
+              break;
+            default:
+              if(hdr->sequence!=h.sequence() || hdr->processed!=h.sequence() || h.sequence()>=cycles || drained[h.sequence()]++)
+                ++bad;
+              break;
+            }
+          }
+        }));
+    for(auto &t : threads)
+      t.join();
+    CHECK(!bad);
+    CHECK(std::count(drained.begin(), drained.end(), 1)==(long) cycles);
+  }
+
+  // A stage the pipeline does not have gets an empty handle, and the real stages carry on
+  {
+    auto p(*allocation_pipeline::make(*src, 2, 4096, 2));
+    CHECK(!p->acquire(2) && !p->acquire((size_t) -1));
+    auto h(p->acquire_fill());
+    CHECK(h && h.sequence()==0);
+  }
+
+  // Closing wakes threads waiting for a buffer which will never reach their stage
+  {
+    auto p(*allocation_pipeline::make(*src, 2, 4096));
+    std::vector<allocation_pipeline::handle> filled;
+    filled.push_back(p->acquire_fill());
+    filled.push_back(p->acquire_fill());
+    atomic<int> empty(0);
+    std::vector<std::thread> threads;
+    for(int t=0; t<3; t++)
+      threads.push_back(std::thread([&] { if(!p->acquire_fill()) ++empty; }));
+    this_thread::sleep_for(chrono::milliseconds(20));
+    CHECK(!p->is_closed());
+    p->close();
+    for(auto &t : threads)
+      t.join();
+    CHECK(empty==3);
+    CHECK(p->is_closed());
+    CHECK(filled[0] && filled[1]);
+
+    // Buffers passed on are still handed out without waiting, so what was filled can be drained
+    filled.clear();
+    auto h(p->acquire_process());
+    CHECK(h && h.sequence()==0);
+    CHECK(!!p->acquire_process());
+    CHECK(!p->acquire_process());
+  }
+  return test::report("pipeline");
+}
@@ -0,0 +1,139 @@
+/* prewarm.cpp
+Tests prewarmed_source under concurrent use and a failing upstream
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "test_common.hpp"
+#include "../include/boost/kernelalloc/prewarm.hpp"
+#include <atomic>
+#include <thread>
+
+using namespace test;
+
+// A source which fails every allocation while failing is set
+class failing_source : public mock_source
+{
+public:
+  std::atomic<bool> failing;
+  failing_source() : failing(false) { }
+  virtual expected<pointer, error_code> allocate(size_type bytes) BOOST_NOEXCEPT override
+  {
+    if(failing)
+      return make_unexpected(error_code(ENOMEM, std::system_category()));
+    return mock_source::allocate(bytes);
+  }
+};
+
+int main()
+{
+  // Many threads acquiring and allocating through every exhaustion policy get usable allocations,
+  // with the readied map handed back by acquire() and unmapped by allocate()
+  const prewarmed_source::exhausted_policy policies[]={ prewarmed_source::exhausted_policy::fallback,
+    prewarmed_source::exhausted_policy::wait, prewarmed_source::exhausted_policy::fail };
+  for(auto policy : policies)
+  {
+    auto upstream(std::make_shared<mock_source>());
+    prewarmed_source::config_t config;
+    config.size_classes.push_back(4096);
+    config.size_classes.push_back(65536);
+    config.ready=4;
+    config.refill_batch=4;
+    config.on_exhausted=policy;
+    auto src(*prewarmed_source::make(upstream, config));
+    CHECK(src->wait_ready(chrono::seconds(5)));
+    CHECK(src->ready(100)==4 && src->ready(5000)==4);
+    std::atomic<int> bad(0), failed(0), done(0);
+    std::vector<std::thread> threads;
+    for(int t=0; t<4; t++)
+      threads.push_back(std::thread([&, t]
+      {
+        for(int n=0; n<500; n++)
+        {
+          const size_t bytes=(n & 1) ? 100 : (n % 3) ? 5000 : 100000;
+          if((n+t) & 2)
+          {
+            auto r(src->acquire(bytes));
+            if(!r)
+            {
+              ++failed;
+              continue;
+            }
+            if(!r->second.addr || r->second.length<bytes || r->first->maps().size()!=1)
+              ++bad;
+            else
+              memset(r->second.addr, t, bytes);
+            r->first->unmap(r->second);
+          }
+          else
+          {
+            auto a(src->allocate(bytes));
+            if(!a)
+            {
+              ++failed;
+              continue;
+            }
+            if((*a)->size()<bytes || !(*a)->maps().empty())
+              ++bad;
+          }
+          ++done;
+        }
+      }));
+    for(auto &t : threads)
+      t.join();
+    CHECK(!bad);
+    CHECK(done+failed==2000);
+    auto stats(src->stats());
+    CHECK(stats.hits+stats.fallbacks==(size_t) done);
+    CHECK(stats.failures==(size_t) failed);
+    if(policy!=prewarmed_source::exhausted_policy::fail)
+      CHECK(!failed);
+  }
+
+  // A failing upstream is retried ever less often, and refilling resumes once it recovers
+  {
+    auto upstream(std::make_shared<failing_source>());
+    upstream->failing=true;
+    prewarmed_source::config_t config;
+    config.size_classes.push_back(4096);
+    config.ready=2;
+    config.refill_interval=chrono::milliseconds(1);
+    config.max_backoff=chrono::milliseconds(40);
+    auto src(*prewarmed_source::make(upstream, config));
+    this_thread::sleep_for(chrono::milliseconds(200));
+    auto stats(src->stats());
+    CHECK(stats.refill_errors>=3 && stats.refill_errors<=12);
+    CHECK(stats.last_error.value()==ENOMEM);
+    CHECK(!stats.refilled);
+    upstream->failing=false;
+    CHECK(src->wait_ready(chrono::seconds(5)));
+    CHECK(src->ready(4096)==2);
+  }
+  return test::report("prewarm");
+}
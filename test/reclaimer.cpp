@@ -0,0 +1,79 @@
+/* reclaimer.cpp
+Tests that a reclaimer pass keeps within its byte budget
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "test_common.hpp"
+#include "../include/boost/kernelalloc/reclaimer.hpp"
+
+using namespace test;
+
+int main()
+{
+  const size_t page=page_size();
+  auto src(std::make_shared<mock_source>());
+  auto a(*src->allocate(4*page)), b(*src->allocate(4*page));
+  allocation::map_t ma(a->map()), mb(b->map());
+
+  reclaimer::config_t config;
+  config.cold_after=reclaimer::clock_type::duration(0);
+  config.pageout_after=chrono::hours(1);
+
+  // A budget of less than a page advises nothing
+  {
+    config.max_bytes_per_pass=page/2;
+    reclaimer r(config);
+    r.track(a);
+    r.track(b);
+    auto pass(r.reclaim_once());
+    CHECK(pass.allocations==0);
+    CHECK(pass.cold_bytes==0);
+  }
+
+  // The allocation which exhausts the budget is clipped to it, not advised in full
+  {
+    config.max_bytes_per_pass=2*page+page/2;
+    reclaimer r(config);
+    r.track(a);
+    r.track(b);
+    auto pass(r.reclaim_once());
+    CHECK(pass.cold_bytes+pass.pageout_bytes<=config.max_bytes_per_pass);
+    CHECK(pass.pageout_bytes==0);
+    if(!pass.ec)
+    {
+      CHECK(pass.allocations==1);
+      CHECK(pass.cold_bytes==2*page);
+    }
+  }
+
+  a->unmap(ma);
+  b->unmap(mb);
+  return test::report("reclaimer");
+}
@@ -0,0 +1,207 @@
+/* test_common.hpp
+Check macro and an mmap backed source shared by the tests
+(C) 2014 MaidSafe Ltd.
+File Created: Nov 2014
+
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef BOOST_KERNELALLOC_TEST_COMMON_HPP
+#define BOOST_KERNELALLOC_TEST_COMMON_HPP
+
+#include "../include/boost/kernelalloc/kernel_alloc.hpp"
+#include <cstdio>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Each test is a program returning non-zero if any CHECK() failed. The tests run against
+mock_source below rather than the library's own sources, so they exercise the generic code
+exactly as a source implementing the documented contract would drive it.
+*/
+
+namespace test
+{
+  inline int &failures() { static int n; return n; }
+  inline int report(const char *name)
+  {
+    if(failures())
+      fprintf(stderr, "%s: %d checks failed\n", name, failures());
+    else
+      printf("%s: all checks passed\n", name);
+    return failures() ? 1 : 0;
+  }
+}
+
+#define CHECK(expr) do { if(!(expr)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); ++test::failures(); } } while(0)
+
+namespace test
+{
+  using namespace boost::kernel_alloc;
+
+  class mock_source;
+
+  /* An allocation backed by a private anonymous mmap made on construction. Maps are views of it
+  at their offset, registered with the source as a real source must. Fresh and destroyed ranges
+  are marked known zero.
+  */
+  class mock_allocation : public allocation
+  {
+    friend class mock_source;
+    char *_storage;
+    bool _leak_maps;
+  public:
+    mock_allocation(mock_source *s, size_type bytes);
+    ~mock_allocation();
+
+    //! Makes the destructor forget to unregister its maps, as a buggy source would
+    void leak_maps() { _leak_maps=true; }
+    char *storage() const { return _storage; }
+
+    virtual error_code resize(size_type) BOOST_NOEXCEPT override { return error_code(ENOTSUP, std::system_category()); }
+    virtual size_type map(map_t *m, size_type no) BOOST_NOEXCEPT override;
+    virtual size_type map_prefault(map_t *m, size_type no) BOOST_NOEXCEPT override
+    {
+      size_type ret=map(m, no);
+      for(size_type n=0; n<no; n++)
+        if(m[n].addr)
+          madvise(m[n].addr, m[n].length, MADV_WILLNEED);
+      return ret;
+    }
+    virtual size_type unmap(map_t *m, size_type no) BOOST_NOEXCEPT override;
+    virtual size_type discard(map_t *m, size_type no) BOOST_NOEXCEPT override
+    {
+      const size_t mask=(size_t) sysconf(_SC_PAGESIZE)-1;
+      for(size_type n=0; n<no; n++)
+      {
+        char *begin=(char *)(((size_t) m[n].addr+mask) & ~mask), *end=(char *)(((size_t) m[n].addr+m[n].length) & ~mask);
+        if(end>begin)
+          madvise(begin, end-begin, MADV_DONTNEED);
+      }
+      return no;
+    }
+    virtual bool discard_zeroes() const BOOST_NOEXCEPT override { return true; }
+    virtual size_type destroy(map_t *m, size_type no) BOOST_NOEXCEPT override
+    {
+      discard(m, no);
+      for(size_type n=0; n<no; n++)
+      {
+        memset(m[n].addr, 0, m[n].length);
+        _mark_zero(m[n].offset, m[n].length);
+      }
+      return no;
+    }
+  };
+
+  class mock_source : public source
+  {
+    friend class mock_allocation;
+  public:
+    using source::allocate;
+    mock_source(flags_t flags=flags_t::normal) : source(flags, (size_type) -1, (size_type) -1) { }
+    virtual const char *name() BOOST_NOEXCEPT override { return "mock"; }
+    virtual bool fresh_allocations_zero() const BOOST_NOEXCEPT override { return true; }
+    virtual expected<pointer, error_code> allocate(size_type bytes) BOOST_NOEXCEPT override
+    {
+      try
+      {
+        auto a(std::make_shared<mock_allocation>(this, bytes));
+        if(!a->storage())
+          return make_unexpected(error_code(ENOMEM, std::system_category()));
+        return pointer(a);
+      }
+      catch(...)
+      {
+        return make_unexpected(error_code(ENOMEM, std::system_category()));
+      }
+    }
+    virtual expected<std::vector<pointer>, error_code> allocate(size_type no, size_type *bytes) BOOST_NOEXCEPT override
+    {
+      std::vector<pointer> ret;
+      for(size_type n=0; n<no; n++)
+      {
+        auto a(allocate(bytes[n]));
+        if(!a)
+          return make_unexpected(a.error());
+        ret.push_back(std::move(*a));
+      }
+      return ret;
+    }
+  };
+
+  inline mock_allocation::mock_allocation(mock_source *s, size_type bytes) : allocation(s, bytes), _leak_maps(false)
+  {
+    const size_t mask=(size_t) sysconf(_SC_PAGESIZE)-1;
+    _actualsize=(bytes+mask) & ~mask;
+    void *p=mmap(nullptr, _actualsize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    _storage=(p==MAP_FAILED) ? nullptr : (char *) p;
+  }
+  inline mock_allocation::~mock_allocation()
+  {
+    if(!_leak_maps)
+    {
+      std::vector<map_t> m(maps());
+      unmap(m.data(), m.size());
+    }
+    if(_storage)
+      munmap(_storage, _actualsize);
+  }
+  inline allocation::size_type mock_allocation::map(map_t *m, size_type no) BOOST_NOEXCEPT
+  {
+    size_type ret=0;
+    for(size_type n=0; n<no; n++)
+    {
+      if(m[n].offset+m[n].length>_actualsize)
+      {
+        m[n].ec=error_code(EINVAL, std::system_category());
+        continue;
+      }
+      m[n].addr=_storage+m[n].offset;
+      try
+      {
+        static_cast<mock_source *>(source())->_register_map(this, m[n]);
+      }
+      catch(...)
+      {
+        m[n].addr=nullptr;
+        m[n].ec=error_code(ENOMEM, std::system_category());
+        continue;
+      }
+      ++ret;
+    }
+    return ret;
+  }
+  inline allocation::size_type mock_allocation::unmap(map_t *m, size_type no) BOOST_NOEXCEPT
+  {
+    for(size_type n=0; n<no; n++)
+    {
+      static_cast<mock_source *>(source())->_register_unmap(this, m[n]);
+      m[n].addr=nullptr;
+    }
+    return no;
+  }
+}
+
+#endif